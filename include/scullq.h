@@ -0,0 +1,134 @@
+/*
+ * Definitions for the scull quantum store.
+ *
+ * scull, scullc, scullp, scullv and sculld all keep their data the
+ * same way: a linked list of quantum sets, each an array of "qset"
+ * pointers to quanta of "quantum" bytes. They only differ in where
+ * the quanta come from. The scullq module implements the store once;
+ * each driver plugs in its allocator through a struct scullq_ops.
+ */
+
+#ifndef _SCULLQ_H_
+#define _SCULLQ_H_
+
+#include <linux/ioctl.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <asm/semaphore.h>
+
+struct file;
+struct kiocb;
+struct page;
+struct vm_area_struct;
+
+/*
+ * One listitem: "data" points to an array of pointers, each pointer
+ * refers to a quantum. "priv" is a parallel array that the allocator
+ * may fill in if it needs to remember something per quantum.
+ */
+struct scullq_set {
+	void **data;
+	void **priv;
+	struct scullq_set *next;  /* next listitem */
+};
+
+struct scullq;
+
+struct scullq_ops {
+	char *name;
+	/*
+	 * Put a new quantum in set->data[s_pos]; return 0 or -ENOMEM.
+	 * The store clears it, so it need not come zeroed.
+	 */
+	int (*alloc)(struct scullq *sq, struct scullq_set *set, int s_pos);
+	/*
+	 * Give back set->data[s_pos]. Work that can be batched may be
+	 * queued on "dead" and done later in release().
+	 */
+	void (*free)(struct scullq *sq, struct scullq_set *set, int s_pos,
+			struct list_head *dead);
+	void (*release)(struct scullq *sq, struct list_head *dead); /* opt. */
+	/*
+	 * Return the page at "pgoff" within set->data[s_pos]; without
+	 * this method the store can't be mapped.
+	 */
+	struct page *(*page)(struct scullq *sq, struct scullq_set *set,
+			int s_pos, unsigned long pgoff);
+};
+
+struct scullq {
+	struct scullq_set *data;  /* first listitem */
+	struct scullq_ops *ops;
+	void *priv;               /* for the allocator */
+	int quantum;              /* the current quantum size */
+	int order;                /* get_order(quantum), for page allocators */
+	int qset;                 /* the current array size */
+	size_t size;              /* amount of data stored here */
+	int vmas;                 /* active mappings */
+	struct semaphore sem;     /* Mutual exclusion */
+
+	/* statistics */
+	unsigned long quanta;     /* currently allocated */
+	unsigned long faults;
+	unsigned long reads, read_bytes;
+	unsigned long writes, write_bytes;
+
+	/* asynchronous I/O, see scullq_aio() */
+	spinlock_t aio_lock;      /* Protects aio_queue */
+	struct list_head aio_queue; /* Async requests not yet started */
+	struct work_struct aio_work;
+};
+
+extern void scullq_init(struct scullq *sq, struct scullq_ops *ops,
+		int quantum, int qset);
+extern int scullq_trim(struct scullq *sq, int quantum, int qset);
+extern struct scullq_set *scullq_follow(struct scullq *sq, int n);
+extern ssize_t scullq_read(struct scullq *sq, char __user *buf,
+		size_t count, loff_t *f_pos);
+extern ssize_t scullq_write(struct scullq *sq, const char __user *buf,
+		size_t count, loff_t *f_pos);
+extern loff_t scullq_llseek(struct scullq *sq, struct file *filp,
+		loff_t off, int whence);
+extern int scullq_ioctl(unsigned int cmd, unsigned long arg,
+		int *quantum, int *qset, int def_quantum, int def_qset);
+extern ssize_t scullq_aio(struct scullq *sq, int write, struct kiocb *iocb,
+		char __user *buf, size_t count, loff_t pos);
+extern void scullq_release(struct scullq *sq);
+extern int scullq_mmap(struct scullq *sq, struct vm_area_struct *vma);
+
+/*
+ * Ioctl definitions, for the drivers that use scullq_ioctl(). "Quantum"
+ * is whatever the driver uses to size its quanta: bytes for scullc, a
+ * page order for the others.
+ */
+
+/* Use 'K' as magic number */
+#define SCULLQ_IOC_MAGIC  'K'
+
+#define SCULLQ_IOCRESET    _IO(SCULLQ_IOC_MAGIC, 0)
+
+/*
+ * S means "Set" through a ptr,
+ * T means "Tell" directly
+ * G means "Get" (to a pointed var)
+ * Q means "Query", response is on the return value
+ * X means "eXchange": G and S atomically
+ * H means "sHift": T and Q atomically
+ */
+#define SCULLQ_IOCSQUANTUM _IOW(SCULLQ_IOC_MAGIC,  1, int)
+#define SCULLQ_IOCTQUANTUM _IO(SCULLQ_IOC_MAGIC,   2)
+#define SCULLQ_IOCGQUANTUM _IOR(SCULLQ_IOC_MAGIC,  3, int)
+#define SCULLQ_IOCQQUANTUM _IO(SCULLQ_IOC_MAGIC,   4)
+#define SCULLQ_IOCXQUANTUM _IOWR(SCULLQ_IOC_MAGIC, 5, int)
+#define SCULLQ_IOCHQUANTUM _IO(SCULLQ_IOC_MAGIC,   6)
+#define SCULLQ_IOCSQSET    _IOW(SCULLQ_IOC_MAGIC,  7, int)
+#define SCULLQ_IOCTQSET    _IO(SCULLQ_IOC_MAGIC,   8)
+#define SCULLQ_IOCGQSET    _IOR(SCULLQ_IOC_MAGIC,  9, int)
+#define SCULLQ_IOCQQSET    _IO(SCULLQ_IOC_MAGIC,  10)
+#define SCULLQ_IOCXQSET    _IOWR(SCULLQ_IOC_MAGIC,11, int)
+#define SCULLQ_IOCHQSET    _IO(SCULLQ_IOC_MAGIC,  12)
+
+#define SCULLQ_IOC_MAXNR 12
+
+#endif /* _SCULLQ_H_ */
@@ -0,0 +1,269 @@
+/*
+ * scullbench.c -- measure a scull-family device
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ * Runs a fixed set of tests against one device node and prints one
+ * line of JSON per result, so that runs can be compared by a script
+ * (see scullbench_run, which loads each variant in turn):
+ *
+ *   seqwrite, seqread    whole device, "-b" bytes per call
+ *   randwrite, randread  same amount, at random block-aligned offsets
+ *   mmap                 touch every page of a mapping, count faults
+ *   trim                 the write-only open that empties the device
+ *   overhead             memory taken from the system per byte stored
+ *
+ * With "-t N" the read/write tests run in N threads, each working on
+ * its own slice of the device.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+static char *dev;
+static char *label = "";
+static long size = 4 << 20;	/* bytes written to the device */
+static long bsize = 4096;	/* bytes per read()/write() */
+static int nthreads = 1;
+
+struct job {
+    int write, random;
+    long start, len;		/* this thread's slice */
+    long done;
+    int err;
+};
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static void report(char *test, long bytes, long ops, double usec,
+                   char *extra)
+{
+    printf("{\"label\": \"%s\", \"dev\": \"%s\", \"test\": \"%s\", "
+           "\"threads\": %i, \"bsize\": %li, \"bytes\": %li, "
+           "\"ops\": %li, \"usec\": %.0f, \"MBps\": %.2f%s%s}\n",
+           label, dev, test, nthreads, bsize, bytes, ops, usec,
+           usec > 0 ? bytes / usec : 0.0, extra ? ", " : "",
+           extra ? extra : "");
+    fflush(stdout);
+}
+
+/*
+ * Move one block, looping because the device stops at the end of
+ * each quantum.
+ */
+static int xfer(int fd, int write, char *buf, long len, off_t pos)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write ? pwrite(fd, buf, len, pos) : pread(fd, buf, len, pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n ? -errno : -EIO;
+        buf += n; pos += n; len -= n;
+    }
+    return 0;
+}
+
+static void *worker(void *arg)
+{
+    struct job *job = arg;
+    unsigned int seed = job->start;
+    long nblocks = job->len / bsize, i, off;
+    char *buf;
+    int fd;
+
+    fd = open(dev, O_RDWR);
+    buf = malloc(bsize);
+    if (fd < 0 || !buf) {
+        job->err = fd < 0 ? -errno : -ENOMEM;
+        return NULL;
+    }
+    memset(buf, 0x5a, bsize);
+    for (i = 0; i < nblocks; i++) {
+        off = job->random ? rand_r(&seed) % nblocks : i;
+        job->err = xfer(fd, job->write, buf, bsize,
+                        job->start + off * bsize);
+        if (job->err)
+            break;
+        job->done += bsize;
+    }
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+static int run(char *test, int write, int random)
+{
+    struct job jobs[nthreads];
+    pthread_t tids[nthreads];
+    long slice = size / nthreads / bsize * bsize, bytes = 0;
+    double t0;
+    int i, err = 0;
+
+    memset(jobs, 0, sizeof(jobs));
+    t0 = now();
+    for (i = 0; i < nthreads; i++) {
+        jobs[i].write = write;
+        jobs[i].random = random;
+        jobs[i].start = i * slice;
+        jobs[i].len = slice;
+        pthread_create(tids + i, NULL, worker, jobs + i);
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+        bytes += jobs[i].done;
+        if (jobs[i].err)
+            err = jobs[i].err;
+    }
+    if (err) {
+        fprintf(stderr, "%s: %s: %s\n", dev, test, strerror(-err));
+        return err;
+    }
+    report(test, bytes, bytes / bsize, now() - t0, NULL);
+    return 0;
+}
+
+/*
+ * Emptying the device: open it write-only and close it again.
+ */
+static int trim(double *usec)
+{
+    double t0 = now();
+    int fd = open(dev, O_WRONLY);
+
+    if (fd < 0)
+        return -errno;
+    close(fd);
+    if (usec)
+        *usec = now() - t0;
+    return 0;
+}
+
+/*
+ * Read-only mapping of what we wrote, touching one byte per page.
+ * Minor faults are counted by the kernel for us.
+ */
+static int mmap_test(void)
+{
+    long psize = getpagesize(), i;
+    struct rusage r0, r1;
+    volatile char *addr;
+    char extra[64];
+    double t0, usec;
+    long faults;
+    char sum = 0;
+    int fd;
+
+    fd = open(dev, O_RDONLY);
+    if (fd < 0)
+        return -errno;
+    addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        close(fd);
+        report("mmap", 0, 0, 0, "\"skipped\": true");
+        return 0; /* scull and scullc can't, nor large orders */
+    }
+    getrusage(RUSAGE_SELF, &r0);
+    t0 = now();
+    for (i = 0; i < size; i += psize)
+        sum += addr[i];
+    usec = now() - t0;
+    getrusage(RUSAGE_SELF, &r1);
+    munmap((void *) addr, size);
+    close(fd);
+
+    faults = r1.ru_minflt - r0.ru_minflt;
+    sprintf(extra, "\"faults\": %li, \"usec_per_fault\": %.3f", faults,
+            faults ? usec / faults : 0.0);
+    report("mmap", size, size / psize, usec, extra);
+    return 0;
+}
+
+/*
+ * MemFree from /proc/meminfo, in bytes.
+ */
+static long memfree(void)
+{
+    char line[128];
+    long kb = -1;
+    FILE *f = fopen("/proc/meminfo", "r");
+
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "MemFree: %li kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb * 1024;
+}
+
+int main(int argc, char **argv)
+{
+    long before, after;
+    char extra[64];
+    double usec;
+    int c;
+
+    while ((c = getopt(argc, argv, "b:l:s:t:")) != -1) {
+        switch (c) {
+        case 'b': bsize = strtol(optarg, NULL, 0); break;
+        case 'l': label = optarg; break;
+        case 's': size = strtol(optarg, NULL, 0); break;
+        case 't': nthreads = atoi(optarg); break;
+        default: optind = argc; /* usage */
+        }
+    }
+    if (optind != argc - 1 || bsize <= 0 || size < bsize || nthreads < 1) {
+        fprintf(stderr, "%s: Usage \"%s [-b bsize] [-s size] [-t threads] "
+                "[-l label] <device>\"\n", argv[0], argv[0]);
+        exit(1);
+    }
+    dev = argv[optind];
+
+    /* start empty, so that the memory count is right */
+    if (trim(NULL)) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], dev, strerror(errno));
+        exit(1);
+    }
+    before = memfree();
+    if (run("seqwrite", 1, 0))
+        exit(1);
+    after = memfree();
+    sprintf(extra, "\"overhead_per_byte\": %.4f",
+            (double) (before - after) / size - 1.0);
+    report("overhead", size, 0, 0, extra);
+
+    run("seqread", 0, 0);
+    run("randwrite", 1, 1);
+    run("randread", 0, 1);
+    mmap_test();
+
+    if (trim(&usec) == 0)
+        report("trim", size, 1, usec, NULL);
+    return 0;
+}
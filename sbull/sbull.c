@@ -11,7 +11,6 @@
 #include <linux/slab.h>		/* kmalloc() */
 #include <linux/fs.h>		/* everything... */
 #include <linux/errno.h>	/* error codes */
-#include <linux/timer.h>
 #include <linux/types.h>	/* size_t */
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/hdreg.h>	/* HDIO_GETGEO */
@@ -21,6 +20,42 @@
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>	/* invalidate_bdev */
 #include <linux/bio.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/rculist.h>
+#include <linux/hash.h>
+#include <linux/capability.h>
+#include <linux/radix-tree.h>
+#include <linux/highmem.h>
+#include <linux/rcupdate.h>
+#include <linux/rwsem.h>
+#include <linux/bitmap.h>
+#include <linux/log2.h>
+#include <linux/hrtimer.h>
+#include <linux/random.h>
+#include <linux/delay.h>	/* msleep() */
+#include <linux/nodemask.h>
+#include <linux/async.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/lzo.h>
+#include <linux/sysfs.h>
+#include <linux/crc32c.h>
+#include <linux/file.h>
+#include <linux/pagemap.h>	/* mapping_set_gfp_mask() */
+#include <linux/falloc.h>
+#include <asm/uaccess.h>
+#ifdef CONFIG_X86_64
+#include <asm/i387.h>		/* kernel_fpu_begin() */
+#endif
+
+#include "sbull.h"
+
+#define CREATE_TRACE_POINTS
+#include "sbull_trace.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -30,123 +65,3386 @@ static int hardsect_size = 512;
 module_param(hardsect_size, int, 0);
 static int nsectors = 1024 * 8;	/* How big the drive is */
 module_param(nsectors, int, 0);
-static int ndevices = 1;
 
 /*
- * Minor number and partition management.
+ * What the queue advertises. hardsect_size is the logical block size;
+ * a larger physical_block_size gives a "512e" disk (e.g. 512 and
+ * 4096), equal ones a native disk. io_opt is in bytes, 0 for none.
+ */
+static int physical_block_size = 0;	/* 0: hardsect_size */
+module_param(physical_block_size, int, 0);
+static int max_sectors = 1024;		/* Per bio, in 512-byte sectors */
+module_param(max_sectors, int, 0);
+static int max_segments = 128;
+module_param(max_segments, int, 0);
+static int io_opt = 0;
+module_param(io_opt, int, 0);
+static int ndevices = 1;		/* sbulla to sbullz */
+module_param(ndevices, int, 0);
+
+/*
+ * How bios get to the transfer code. The file backing always uses the
+ * hardware queues.
+ */
+enum {
+	QM_BIO = 0,	/* Handle each bio inline in make_request */
+	QM_MQ = 1,	/* Per-CPU hardware queues, drained in batches */
+};
+static int queue_mode = QM_BIO;
+module_param(queue_mode, int, 0);
+static int nr_hw_queues = 0;	/* 0: one per possible CPU */
+module_param(nr_hw_queues, int, 0);
+static int queue_depth = 64;	/* bios per hardware queue */
+module_param(queue_depth, int, 0);
+
+/*
+ * Sector ownership is kept as extents unless uid_extents is 0. Once a
+ * device has more than max_extents of them (default: one per 32
+ * sectors, where the tree outgrows the array) it falls back to an
+ * array with one uid per sector.
+ */
+static int uid_extents = 1;
+module_param(uid_extents, int, 0);
+static int max_extents = 0;
+module_param(max_extents, int, 0);
+
+/*
+ * How the per-sector array is compared and stamped: -1 lets the
+ * load-time benchmark choose, otherwise an index in sbull_uid_algos.
+ */
+static int uid_algo = -1;
+module_param(uid_algo, int, 0);
+
+/*
+ * Sessions. Keys nobody created a session for get the old behaviour
+ * (uid "key & 1") unless legacy_sessions is 0, in which case they can
+ * neither write nor read anything.
+ */
+static int legacy_sessions = 1;
+module_param(legacy_sessions, int, 0);
+static int session_stats = 1;		/* Once a session exists, read the clock */
+module_param(session_stats, int, 0);
+static int session_hash_bits = 8;
+module_param(session_hash_bits, int, 0);
+
+/*
+ * Where the data lives: one vmalloc'd array (the default), pages
+ * allocated on first write, pages compressed one by one, pages
+ * shared by content (dedup_hash_bits sizes the content table), or a
+ * host file with a RAM cache in front of it. Device sbullX is kept in
+ * the file "<backing_file>X", and dirty pages are written back every
+ * writeback_ms. The huge backing is made of 2 MB physically contiguous
+ * chunks, placed on NUMA nodes according to numa_policy.
+ */
+enum {
+	SBULL_BACKING_FLAT = 0,
+	SBULL_BACKING_SPARSE = 1,
+	SBULL_BACKING_COMPRESSED = 2,
+	SBULL_BACKING_DEDUP = 3,
+	SBULL_BACKING_FILE = 4,
+	SBULL_BACKING_HUGE = 5,
+};
+static int backing = SBULL_BACKING_FLAT;
+module_param(backing, int, 0);
+static int dedup_hash_bits = 14;
+module_param(dedup_hash_bits, int, 0);
+static char *backing_file = "/var/tmp/sbull";
+module_param(backing_file, charp, 0);
+static int writeback_ms = 5000;
+module_param(writeback_ms, int, 0);
+
+/*
+ * Where the huge backing's chunks go: round robin over the online
+ * nodes, all on numa_node (-1: the node we are loaded on), or on the
+ * node of whoever writes them first, which with queue_mode=1 is the
+ * node of the hardware queue.
+ */
+enum {
+	SBULL_NUMA_INTERLEAVE = 0,
+	SBULL_NUMA_NODE = 1,
+	SBULL_NUMA_FIRST_TOUCH = 2,
+};
+static int numa_policy = SBULL_NUMA_INTERLEAVE;
+module_param(numa_policy, int, 0);
+static int numa_node = -1;
+module_param(numa_node, int, 0);
+
+/*
+ * Range locks: the device is cut in regions of lock_region_kb, and
+ * region r is protected by stripe r % nr_stripes. Reads share a
+ * stripe, writes and discards own it.
+ */
+#define SBULL_MAX_STRIPES	256
+static int nr_stripes = 64;
+module_param(nr_stripes, int, 0);
+static int lock_region_kb = 1024;
+module_param(lock_region_kb, int, 0);
+
+/*
+ * Minor number and partition management.
+ */
+#define SBULL_MINORS	16
+#define MINOR_SHIFT	4
+#define DEVNUM(kdevnum)	(MINOR(kdev_t_to_nr(kdevnum)) >> MINOR_SHIFT
+
+/*
+ * We can tweak our hardware sector size, but the kernel talks to us
+ * in terms of small sectors, always.
+ */
+#define KERNEL_SECTOR_SIZE	512
+
+/*
+ * Removable media. With "removable" set, a device opened again after
+ * media_idle_secs with nobody using it sees a media change: it comes
+ * back empty. Off by default, so that a plain disk never loses data.
+ */
+static int removable = 0;
+module_param(removable, int, 0);
+static int media_idle_secs = 30;
+module_param(media_idle_secs, int, 0);
+
+#define DEFAULT_SESSION_KEY 	1234
+
+struct dio;
+
+/*
+ * Who owns each sector. A run of sectors [start, end) written by the
+ * same uid is one extent; sectors not covered by any extent belong to
+ * uid 0, as they do after a reset. If "sector_uids" is set, the map is
+ * in per-sector mode and the tree is empty.
+ */
+struct sbull_extent {
+	struct rb_node node;
+	sector_t start, end;
+	unsigned short uid;
+};
+
+/*
+ * A session created through SBULL_IOCSESSION_CREATE. The table is read
+ * under RCU in the I/O path; changes take session_lock.
+ */
+struct sbull_session {
+	struct hlist_node node;
+	unsigned long key;
+	unsigned short uid;
+	struct rcu_head rcu;
+
+	/* Accounting, see struct sbull_session_stats */
+	atomic64_t ios[2], bytes[2];	/* By data direction */
+	atomic64_t denied;
+	atomic64_t throttled_ns;
+	atomic64_t lat_hist[SBULL_LAT_BUCKETS];
+
+	/*
+	 * Token buckets holding up to a second's worth, kept as the
+	 * time at which each would be full again (GCRA).
+	 */
+	spinlock_t tb_lock;
+	u64 iops, bps;			/* Limits, 0 for none */
+	s64 io_tat, byte_tat;		/* In ns, as ktime_get() */
+};
+
+#define SBULL_UID_NONE		0xffff	/* owns nothing, can't write */
+#define SBULL_UID_FIRST		2	/* 0 and 1 are the legacy uids */
+
+struct sbull_uidmap {
+	rwlock_t lock;
+	struct rb_root root;
+	unsigned long nr_extents;
+	unsigned short *sector_uids;
+};
+
+/*
+ * A hardware queue for QM_MQ mode. Bios are queued here by the
+ * submitting CPU and handled by a work item, which takes the whole
+ * list at once and completes it after the transfers are done.
+ */
+struct sbull_hw_queue {
+	spinlock_t lock;		/* Protects bios, queued and stamp */
+	struct bio_list bios;
+	int queued;
+	ktime_t stamp;			/* When the oldest bio was queued */
+	int cpu;			/* Where the work should run */
+	struct work_struct work;
+	struct sbull_dev *dev;
+};
+
+struct sbull_dev;
+
+/*
+ * The latency model, set through sysfs. A bio completes "ns[dir]"
+ * after it was submitted, plus "qd_ns" for every bio already waiting
+ * to complete, plus a random part of mean "jitter_ns".
+ */
+enum {
+	SBULL_LAT_FIXED = 0,	/* No random part */
+	SBULL_LAT_UNIFORM = 1,	/* Uniform in [0, 2 * jitter_ns) */
+	SBULL_LAT_EXP = 2,	/* Exponential */
+};
+
+struct sbull_latency {
+	u64 ns[2];		/* By data direction */
+	u64 qd_ns;
+	u64 jitter_ns;
+	int dist;
+};
+
+/*
+ * A bio waiting for its completion time.
+ */
+struct sbull_delayed {
+	struct hrtimer timer;
+	struct bio *bio;
+	int error;
+	ktime_t start;
+	struct sbull_dev *dev;
+	struct list_head list;		/* On dev->delayed_done, once fired */
+};
+
+/*
+ * An injected fault: bios touching 512-byte sectors [start, end) in
+ * one of the directions "rw" (bit 0 read, bit 1 write) fail with
+ * "error", "percent" times out of 100. The list is read under RCU.
+ */
+struct sbull_fault {
+	struct list_head list;
+	sector_t start, end;
+	int rw;
+	int error;
+	unsigned int percent;
+	struct rcu_head rcu;
+};
+
+#define SBULL_FAULT_READ	0x01
+#define SBULL_FAULT_WRITE	0x02
+
+/*
+ * One page of the compressed store. "data" holds "size" bytes of LZO
+ * output, or a plain copy of the page if it didn't compress; a page
+ * that is one word repeated keeps just the word.
+ */
+struct sbull_zslot {
+	void *data;
+	unsigned short size;
+	unsigned char flags;
+	unsigned long word;
+};
+
+#define SBULL_ZSAME	0x01	/* Same-filled: "word" is the content */
+#define SBULL_ZRAW	0x02	/* Not compressed */
+
+#define SBULL_ZLOCKS	64	/* Slot locks per device, hashed */
+
+/*
+ * A page of the dedup store, shared by every slot with that content.
+ * It is never written once it is in the table.
+ */
+struct sbull_dpage {
+	struct hlist_node node;
+	u32 hash;
+	unsigned int refs;	/* Slots pointing here */
+	struct page *page;
+};
+
+/*
+ * A chunk of the huge store: 2 MB from the page allocator, on "node",
+ * or from vmalloc if no such block was free. vmalloc pages come from
+ * anywhere, so those have no node (NUMA_NO_NODE).
+ */
+struct sbull_hchunk {
+	void *addr;
+	int node;
+	int huge;
+};
+
+#define SBULL_HORDER	(21 - PAGE_SHIFT)
+#define SBULL_HCHUNK	(PAGE_SIZE << SBULL_HORDER)
+
+/*
+ * A backing store. Offsets and lengths are in bytes and have been
+ * checked against the device size. The caller's buffer is contiguous
+ * in kernel memory but may span several pages, as may the range of
+ * the store. Errors (-ENOMEM, -EIO) fail the bio.
+ */
+struct sbull_backend {
+	const char *name;
+	int (*init)(struct sbull_dev *dev);
+	void (*destroy)(struct sbull_dev *dev);
+	int (*read)(struct sbull_dev *dev, u64 pos, char *buf,
+			unsigned int len);
+	int (*write)(struct sbull_dev *dev, u64 pos, const char *buf,
+			unsigned int len);
+	int (*discard)(struct sbull_dev *dev, u64 pos, u64 len);
+	void (*clear)(struct sbull_dev *dev);	/* Everything back to zero */
+	int (*flush)(struct sbull_dev *dev);	/* Make writes durable */
+	int eager_discard;	/* Discard gives memory back, or persists */
+	int lazy_zero;		/* init() leaves the data uninitialized */
+	int blocking;		/* Waits on other block I/O: workers only */
+};
+
+/*
+ * The internal representation of our device.
+ */
+struct sbull_dev {
+        u64 size;                       /* Device size in bytes */
+	const struct sbull_backend *backend;
+        u8 *data;                       /* The data array (flat) */
+	struct radix_tree_root pages;	/* The data pages (sparse) */
+	spinlock_t pages_lock;		/* Protects changes to pages */
+	atomic_long_t nr_pages;		/* Pages stored (not flat) */
+	struct sbull_zslot *zslots;	/* The compressed pages */
+	struct mutex *zlocks;
+	atomic_long_t compr_bytes;	/* What they take */
+	atomic_long_t same_pages;
+	struct sbull_dpage **dslots;	/* The dedup store, by page */
+	struct hlist_head *dtable;	/* ... and its content table */
+	spinlock_t dlock;		/* Protects dtable and refs */
+	unsigned long unique_pages;
+	atomic64_t hash_ns;		/* Time spent hashing */
+	atomic_long_t hashed_pages;
+	struct file *file;		/* The backing file (file) */
+	unsigned short *fsaved;		/* Owners as the file has them */
+	unsigned short *fsnap;		/* ... and as they are now */
+	struct sbull_fsession *fsess;	/* Sessions, for a checkpoint */
+	u64 fgen;			/* Checkpoints written */
+	atomic_long_t dirty_pages;
+	struct delayed_work writeback;
+	struct sbull_hchunk **hchunks;	/* The huge store */
+	struct sbull_uidmap uids;	/* Sector ownership */
+	struct hlist_head *sessions;	/* Hash of struct sbull_session */
+	spinlock_t session_lock;
+	unsigned short next_uid;	/* For the next session created */
+	int nr_sessions;		/* Live ones; none, no accounting */
+	int limits;			/* Some session was ever limited */
+        short users;                    /* How many users */
+        short media_change;             /* Flag a media change? */
+	unsigned long idle_since;	/* Jiffies at the last close */
+	u16 gen;			/* Media changes so far */
+	u16 *pgens;			/* Generation of each page's data */
+	unsigned long *zeromap;		/* Pages discarded, by page */
+	atomic_long_t zero_pages;	/* Bits set in zeromap */
+        spinlock_t lock;                /* For mutual exclusion */
+        struct request_queue *queue;    /* The device request queue */
+        struct gendisk *gd;             /* The gendisk structure */
+	struct rw_semaphore *stripes;	/* The range locks */
+	struct sbull_hw_queue *hw_queues; /* QM_MQ only */
+	int nr_hw_queues;
+	struct sbull_latency lat;
+	int lat_on;			/* Any of it not zero */
+	atomic_t delayed;		/* Bios waiting on their timers */
+	struct list_head delayed_done;	/* Fired, to be freed */
+	spinlock_t delayed_lock;	/* Protects delayed_done */
+	struct work_struct delayed_reap; /* Frees them */
+	struct list_head faults;	/* struct sbull_fault */
+	spinlock_t fault_lock;		/* Protects changes to faults */
+	int setup_err;			/* What setup_device() returned */
+};
+
+#define SBULL_DEV(blk_dev) (blk_dev->bd_disk->private_data)
+
+static struct sbull_dev *Devices = NULL;
+
+static struct workqueue_struct *sbull_wq;	/* Runs the hardware queues */
+
+static struct kmem_cache *sbull_extent_cache;
+
+/*
+ * Range kernels for the per-sector uid array. "check" tells whether
+ * all of uids[0..n) equal "uid", "stamp" sets them. Like the raid6
+ * code, we time them all at load and keep the fastest.
+ */
+struct sbull_uid_algo {
+	const char *name;
+	int (*check)(const unsigned short *uids, size_t n, unsigned short uid);
+	void (*stamp)(unsigned short *uids, size_t n, unsigned short uid);
+};
+
+static int sbull_uid_check_scalar(const unsigned short *uids, size_t n,
+		unsigned short uid)
+{
+	while (n--)
+		if (*uids++ != uid)
+			return 0;
+	return 1;
+}
+
+static void sbull_uid_stamp_scalar(unsigned short *uids, size_t n,
+		unsigned short uid)
+{
+	while (n--)
+		*uids++ = uid;
+}
+
+/*
+ * Word at a time: 16 uids per loop on 64-bit machines, without
+ * touching the FPU. Head and tail are done one by one.
+ */
+#define SBULL_UID_PATTERN(uid)	((unsigned long) (uid) * (~0UL / 0xffff))
+#define SBULL_UIDS_PER_LONG	(sizeof(unsigned long) / sizeof(unsigned short))
+
+static int sbull_uid_check_long(const unsigned short *uids, size_t n,
+		unsigned short uid)
+{
+	unsigned long pat = SBULL_UID_PATTERN(uid);
+	const unsigned long *p;
+
+	for (; n && !IS_ALIGNED((unsigned long) uids, sizeof(long)); n--)
+		if (*uids++ != uid)
+			return 0;
+	for (p = (const unsigned long *) uids; n >= 4 * SBULL_UIDS_PER_LONG;
+			n -= 4 * SBULL_UIDS_PER_LONG, p += 4)
+		if ((p[0] ^ pat) | (p[1] ^ pat) | (p[2] ^ pat) | (p[3] ^ pat))
+			return 0;
+	return sbull_uid_check_scalar((const unsigned short *) p, n, uid);
+}
+
+static void sbull_uid_stamp_long(unsigned short *uids, size_t n,
+		unsigned short uid)
+{
+	unsigned long pat = SBULL_UID_PATTERN(uid);
+	unsigned long *p;
+
+	for (; n && !IS_ALIGNED((unsigned long) uids, sizeof(long)); n--)
+		*uids++ = uid;
+	for (p = (unsigned long *) uids; n >= 4 * SBULL_UIDS_PER_LONG;
+			n -= 4 * SBULL_UIDS_PER_LONG, p += 4)
+		p[0] = p[1] = p[2] = p[3] = pat;
+	sbull_uid_stamp_scalar((unsigned short *) p, n, uid);
+}
+
+#ifdef CONFIG_X86_64
+/*
+ * SSE2, which every x86-64 has: 32 uids per loop. Saving the FPU state
+ * costs something, so this only pays on long ranges; short ones and
+ * contexts where the FPU can't be used go to the word version.
+ */
+#define SBULL_SSE2_MIN	256
+
+static int sbull_uid_check_sse2(const unsigned short *uids, size_t n,
+		unsigned short uid)
+{
+	unsigned long pat = SBULL_UID_PATTERN(uid);
+	unsigned int mask = 0xffff;
+
+	if (n < SBULL_SSE2_MIN || !irq_fpu_usable())
+		return sbull_uid_check_long(uids, n, uid);
+
+	kernel_fpu_begin();
+	asm volatile("movq %0,%%xmm0\n\t"
+		     "punpcklqdq %%xmm0,%%xmm0" : : "r" (pat) : "xmm0");
+	for (; n >= 32; n -= 32, uids += 32) {
+		asm volatile("movdqu %1,%%xmm1\n\t"
+			     "movdqu %2,%%xmm2\n\t"
+			     "movdqu %3,%%xmm3\n\t"
+			     "movdqu %4,%%xmm4\n\t"
+			     "pcmpeqw %%xmm0,%%xmm1\n\t"
+			     "pcmpeqw %%xmm0,%%xmm2\n\t"
+			     "pcmpeqw %%xmm0,%%xmm3\n\t"
+			     "pcmpeqw %%xmm0,%%xmm4\n\t"
+			     "pand %%xmm2,%%xmm1\n\t"
+			     "pand %%xmm4,%%xmm3\n\t"
+			     "pand %%xmm3,%%xmm1\n\t"
+			     "pmovmskb %%xmm1,%0"
+			     : "=r" (mask)
+			     : "m" (uids[0]), "m" (uids[8]),
+			       "m" (uids[16]), "m" (uids[24])
+			     : "memory", "xmm1", "xmm2", "xmm3", "xmm4");
+		if (mask != 0xffff)
+			break;
+	}
+	kernel_fpu_end();
+	if (mask != 0xffff)
+		return 0;
+	return sbull_uid_check_scalar(uids, n, uid);
+}
+
+static void sbull_uid_stamp_sse2(unsigned short *uids, size_t n,
+		unsigned short uid)
+{
+	unsigned long pat = SBULL_UID_PATTERN(uid);
+
+	if (n < SBULL_SSE2_MIN || !irq_fpu_usable()) {
+		sbull_uid_stamp_long(uids, n, uid);
+		return;
+	}
+
+	kernel_fpu_begin();
+	asm volatile("movq %0,%%xmm0\n\t"
+		     "punpcklqdq %%xmm0,%%xmm0" : : "r" (pat) : "xmm0");
+	for (; n >= 32; n -= 32, uids += 32)
+		asm volatile("movdqu %%xmm0,%0\n\t"
+			     "movdqu %%xmm0,%1\n\t"
+			     "movdqu %%xmm0,%2\n\t"
+			     "movdqu %%xmm0,%3"
+			     : "=m" (uids[0]), "=m" (uids[8]),
+			       "=m" (uids[16]), "=m" (uids[24])
+			     : : "memory");
+	kernel_fpu_end();
+	sbull_uid_stamp_scalar(uids, n, uid);
+}
+#endif /* CONFIG_X86_64 */
+
+static const struct sbull_uid_algo sbull_uid_algos[] = {
+	{ "scalar", sbull_uid_check_scalar, sbull_uid_stamp_scalar },
+	{ "long",   sbull_uid_check_long,   sbull_uid_stamp_long },
+#ifdef CONFIG_X86_64
+	{ "sse2",   sbull_uid_check_sse2,   sbull_uid_stamp_sse2 },
+#endif
+};
+
+static const struct sbull_uid_algo *sbull_uid = &sbull_uid_algos[0];
+
+/*
+ * Time each algorithm on a read (check) and a write (stamp) of 4K,
+ * 64K and 1M, print the results and keep the fastest overall. A
+ * check that succeeds walks the whole range, which is the case that
+ * matters.
+ */
+#define SBULL_UID_BENCH_LOOPS	64
+
+static void sbull_uid_bench(void)
+{
+	static const int sizes[] = { 4 << 10, 64 << 10, 1 << 20 };
+	unsigned short *uids;
+	u64 ns[ARRAY_SIZE(sizes)], total, best_total = ~0ULL;
+	int a, i, loop, n, best = 0;
+	ktime_t t0;
+
+	n = min_t(int, nsectors, (1 << 20) / hardsect_size);
+	uids = vmalloc(n * sizeof(unsigned short));
+	if (!uids)
+		return;
+	for (a = 0; a < ARRAY_SIZE(sbull_uid_algos); a++) {
+		const struct sbull_uid_algo *algo = sbull_uid_algos + a;
+
+		total = 0;
+		for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+			int len = min(n, sizes[i] / hardsect_size);
+
+			t0 = ktime_get();
+			for (loop = 0; loop < SBULL_UID_BENCH_LOOPS; loop++) {
+				algo->stamp(uids, len, loop + 1);
+				if (!algo->check(uids, len, loop + 1))
+					printk(KERN_ERR "sbull: uid algo %s "
+							"is broken\n", algo->name);
+			}
+			ns[i] = ktime_to_ns(ktime_sub(ktime_get(), t0)) /
+				SBULL_UID_BENCH_LOOPS;
+			total += ns[i];
+		}
+		printk(KERN_INFO "sbull: uid %-6s 4K %lluns 64K %lluns 1M %lluns\n",
+				algo->name, ns[0], ns[1], ns[2]);
+		if (total < best_total) {
+			best_total = total;
+			best = a;
+		}
+	}
+	vfree(uids);
+	sbull_uid = sbull_uid_algos + best;
+}
+
+static void sbull_uid_select(void)
+{
+	if (uid_algo >= 0 && uid_algo < ARRAY_SIZE(sbull_uid_algos))
+		sbull_uid = sbull_uid_algos + uid_algo;
+	else
+		sbull_uid_bench();
+	printk(KERN_INFO "sbull: using %s uid compare\n", sbull_uid->name);
+}
+
+/*
+ * The ownership map.
+ */
+
+/*
+ * The first extent that ends after "sector", or NULL.
+ */
+static struct sbull_extent *sbull_extent_after(struct sbull_uidmap *map,
+		sector_t sector)
+{
+	struct rb_node *node = map->root.rb_node;
+	struct sbull_extent *ext, *found = NULL;
+
+	while (node) {
+		ext = rb_entry(node, struct sbull_extent, node);
+		if (ext->end > sector) {
+			found = ext;
+			node = node->rb_left;
+		} else
+			node = node->rb_right;
+	}
+	return found;
+}
+
+static inline struct sbull_extent *sbull_extent_next(struct sbull_extent *ext)
+{
+	struct rb_node *node = rb_next(&ext->node);
+
+	return node ? rb_entry(node, struct sbull_extent, node) : NULL;
+}
+
+static void sbull_extent_insert(struct sbull_uidmap *map,
+		struct sbull_extent *new)
+{
+	struct rb_node **link = &map->root.rb_node, *parent = NULL;
+	struct sbull_extent *ext;
+
+	while (*link) {
+		parent = *link;
+		ext = rb_entry(parent, struct sbull_extent, node);
+		if (new->start < ext->start)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &map->root);
+	map->nr_extents++;
+}
+
+static void sbull_extent_erase(struct sbull_uidmap *map,
+		struct sbull_extent *ext)
+{
+	rb_erase(&ext->node, &map->root);
+	map->nr_extents--;
+	kmem_cache_free(sbull_extent_cache, ext);
+}
+
+/*
+ * Merge "ext" into the extent before it if they touch and agree.
+ */
+static struct sbull_extent *sbull_extent_merge(struct sbull_uidmap *map,
+		struct sbull_extent *ext)
+{
+	struct rb_node *node = rb_prev(&ext->node);
+	struct sbull_extent *prev;
+
+	if (!node)
+		return ext;
+	prev = rb_entry(node, struct sbull_extent, node);
+	if (prev->end != ext->start || prev->uid != ext->uid)
+		return ext;
+	prev->end = ext->end;
+	sbull_extent_erase(map, ext);
+	return prev;
+}
+
+static void sbull_uidmap_clear(struct sbull_uidmap *map)
+{
+	struct rb_node *node;
+
+	while ((node = rb_first(&map->root)) != NULL)
+		sbull_extent_erase(map, rb_entry(node, struct sbull_extent, node));
+	if (map->sector_uids)
+		memset(map->sector_uids, 0, nsectors * sizeof(unsigned short));
+}
+
+/*
+ * Too many extents: move to one uid per sector. If we can't get the
+ * memory, just keep using the tree.
+ */
+static void sbull_uidmap_flatten(struct sbull_uidmap *map)
+{
+	unsigned short *uids;
+	struct sbull_extent *ext;
+	struct rb_node *node;
+	sector_t sector;
+
+	uids = __vmalloc(nsectors * sizeof(unsigned short),
+			GFP_NOIO | __GFP_ZERO, PAGE_KERNEL);
+	if (!uids)
+		return;
+	write_lock(&map->lock);
+	if (map->sector_uids) {
+		write_unlock(&map->lock);
+		vfree(uids);
+		return;
+	}
+	for (node = rb_first(&map->root); node; node = rb_next(node)) {
+		ext = rb_entry(node, struct sbull_extent, node);
+		for (sector = ext->start; sector < ext->end; sector++)
+			uids[sector] = ext->uid;
+	}
+	sbull_uidmap_clear(map);
+	map->sector_uids = uids;
+	write_unlock(&map->lock);
+}
+
+/*
+ * Give sectors [start, end) to "uid". A write can split one extent in
+ * two and add one more, so both nodes are allocated up front.
+ */
+static int sbull_uidmap_set(struct sbull_uidmap *map, sector_t start,
+		sector_t end, unsigned short uid)
+{
+	struct sbull_extent *new = NULL, *split = NULL, *ext, *next;
+	int flatten;
+
+	if (!map->sector_uids) {
+		new = kmem_cache_alloc(sbull_extent_cache, GFP_NOIO);
+		split = kmem_cache_alloc(sbull_extent_cache, GFP_NOIO);
+		if (!new || !split)
+			goto nomem;
+	}
+
+	write_lock(&map->lock);
+	if (map->sector_uids) {
+		sbull_uid->stamp(map->sector_uids + start, end - start, uid);
+		goto out;
+	}
+
+	/* Cut [start, end) out of whatever covers it */
+	for (ext = sbull_extent_after(map, start); ext && ext->start < end;
+			ext = next) {
+		next = sbull_extent_next(ext);
+		if (ext->start < start && ext->end > end) {
+			if (ext->uid == uid)
+				goto out; /* nothing changes */
+			split->start = end;
+			split->end = ext->end;
+			split->uid = ext->uid;
+			ext->end = start;
+			sbull_extent_insert(map, split);
+			split = NULL;
+			break;
+		} else if (ext->start < start)
+			ext->end = start;
+		else if (ext->end > end)
+			ext->start = end;
+		else
+			sbull_extent_erase(map, ext);
+	}
+
+	/* uid 0 is what no extent means */
+	if (uid) {
+		new->start = start;
+		new->end = end;
+		new->uid = uid;
+		sbull_extent_insert(map, new);
+		ext = sbull_extent_merge(map, new);
+		new = NULL;
+		next = sbull_extent_next(ext);
+		if (next)
+			sbull_extent_merge(map, next);
+	}
+
+  out:
+	flatten = map->nr_extents > max_extents;
+	write_unlock(&map->lock);
+	if (new)
+		kmem_cache_free(sbull_extent_cache, new);
+	if (split)
+		kmem_cache_free(sbull_extent_cache, split);
+	if (flatten)
+		sbull_uidmap_flatten(map);
+	return 0;
+
+  nomem:
+	if (new)
+		kmem_cache_free(sbull_extent_cache, new);
+	if (split)
+		kmem_cache_free(sbull_extent_cache, split);
+	return -ENOMEM;
+}
+
+/*
+ * Does "uid" own all of [start, end)?
+ */
+static int sbull_uidmap_check(struct sbull_uidmap *map, sector_t start,
+		sector_t end, unsigned short uid)
+{
+	struct sbull_extent *ext;
+	sector_t pos = start;
+	int ok = 1;
+
+	read_lock(&map->lock);
+	if (map->sector_uids) {
+		ok = sbull_uid->check(map->sector_uids + start, end - start, uid);
+		goto out;
+	}
+	ext = sbull_extent_after(map, start);
+	while (pos < end) {
+		if (!ext || ext->start > pos) {
+			/* a gap, owned by uid 0 */
+			if (uid) {
+				ok = 0;
+				break;
+			}
+			pos = ext ? ext->start : end;
+			continue;
+		}
+		if (ext->uid != uid) {
+			ok = 0;
+			break;
+		}
+		pos = ext->end;
+		ext = sbull_extent_next(ext);
+	}
+  out:
+	read_unlock(&map->lock);
+	return ok;
+}
+
+static int sbull_uidmap_init(struct sbull_uidmap *map)
+{
+	rwlock_init(&map->lock);
+	map->root = RB_ROOT;
+	map->nr_extents = 0;
+	map->sector_uids = NULL;
+	if (uid_extents)
+		return 0;
+	map->sector_uids = vzalloc(nsectors * sizeof(unsigned short));
+	return map->sector_uids ? 0 : -ENOMEM;
+}
+
+static void sbull_uidmap_reset(struct sbull_uidmap *map)
+{
+	write_lock(&map->lock);
+	sbull_uidmap_clear(map);
+	write_unlock(&map->lock);
+}
+
+/*
+ * Copy out the owner of every sector.
+ */
+static void sbull_uidmap_dump(struct sbull_uidmap *map, unsigned short *uids)
+{
+	struct sbull_extent *ext;
+	struct rb_node *node;
+	sector_t sector;
+
+	read_lock(&map->lock);
+	if (map->sector_uids) {
+		memcpy(uids, map->sector_uids, nsectors * sizeof(unsigned short));
+		goto out;
+	}
+	memset(uids, 0, nsectors * sizeof(unsigned short));
+	for (node = rb_first(&map->root); node; node = rb_next(node)) {
+		ext = rb_entry(node, struct sbull_extent, node);
+		for (sector = ext->start; sector < ext->end; sector++)
+			uids[sector] = ext->uid;
+	}
+  out:
+	read_unlock(&map->lock);
+}
+
+/*
+ * The reverse, into an empty map.
+ */
+static int sbull_uidmap_load(struct sbull_uidmap *map,
+		const unsigned short *uids)
+{
+	sector_t start, end;
+
+	for (start = 0; start < nsectors; start = end) {
+		for (end = start + 1; end < nsectors; end++)
+			if (uids[end] != uids[start])
+				break;
+		if (uids[start] &&
+				sbull_uidmap_set(map, start, end, uids[start]))
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Do sectors [start, end) still have the owners in "uids"?
+ */
+static int sbull_uidmap_same(struct sbull_uidmap *map,
+		const unsigned short *uids, sector_t start, sector_t end)
+{
+	sector_t run;
+
+	for (; start < end; start = run) {
+		for (run = start + 1; run < end; run++)
+			if (uids[run] != uids[start])
+				break;
+		if (!sbull_uidmap_check(map, start, run, uids[start]))
+			return 0;
+	}
+	return 1;
+}
+
+static void sbull_uidmap_destroy(struct sbull_uidmap *map)
+{
+	sbull_uidmap_clear(map);
+	if (map->sector_uids)
+		vfree(map->sector_uids);
+	map->sector_uids = NULL;
+}
+
+/*
+ * The flat backend: the whole device in one vmalloc'd array.
+ */
+/*
+ * Not zeroed here: every page starts out marked in the zero bitmap.
+ */
+static int sbull_flat_init(struct sbull_dev *dev)
+{
+	dev->data = vmalloc(dev->size);
+	return dev->data ? 0 : -ENOMEM;
+}
+
+static void sbull_flat_destroy(struct sbull_dev *dev)
+{
+	vfree(dev->data);
+	dev->data = NULL;
+}
+
+static int sbull_flat_read(struct sbull_dev *dev, u64 pos, char *buf,
+		unsigned int len)
+{
+	memcpy(buf, dev->data + pos, len);
+	return 0;
+}
+
+static int sbull_flat_write(struct sbull_dev *dev, u64 pos, const char *buf,
+		unsigned int len)
+{
+	memcpy(dev->data + pos, buf, len);
+	return 0;
+}
+
+static int sbull_flat_discard(struct sbull_dev *dev, u64 pos, u64 len)
+{
+	memset(dev->data + pos, 0, len);
+	return 0;
+}
+
+static void sbull_flat_clear(struct sbull_dev *dev)
+{
+	memset(dev->data, 0, dev->size);
+}
+
+static const struct sbull_backend sbull_flat_backend = {
+	.name    = "flat",
+	.init    = sbull_flat_init,
+	.destroy = sbull_flat_destroy,
+	.read    = sbull_flat_read,
+	.write   = sbull_flat_write,
+	.discard = sbull_flat_discard,
+	.clear   = sbull_flat_clear,
+	.lazy_zero = 1,
+};
+
+/*
+ * The sparse backend, after brd: a radix tree of pages indexed by page
+ * number. A page is allocated the first time something is written to
+ * it; reads of a missing page return zeros. Lookups and copies run
+ * under rcu_read_lock(), so a discard must wait for a grace period
+ * before it frees what it took out of the tree.
+ */
+static struct page *sbull_sparse_lookup(struct sbull_dev *dev, pgoff_t idx)
+{
+	return radix_tree_lookup(&dev->pages, idx);
+}
+
+static struct page *sbull_sparse_insert(struct sbull_dev *dev, pgoff_t idx)
+{
+	struct page *page;
+
+	page = sbull_sparse_lookup(dev, idx);
+	if (page)
+		return page;
+
+	/* GFP_NOIO: we may be writing out someone else's pages */
+	page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO);
+	if (!page)
+		return NULL;
+	if (radix_tree_preload(GFP_NOIO)) {
+		__free_page(page);
+		return NULL;
+	}
+	page->index = idx;
+	spin_lock(&dev->pages_lock);
+	if (radix_tree_insert(&dev->pages, idx, page)) {
+		/* Lost the race */
+		__free_page(page);
+		page = sbull_sparse_lookup(dev, idx);
+	} else
+		atomic_long_inc(&dev->nr_pages);
+	spin_unlock(&dev->pages_lock);
+	radix_tree_preload_end();
+	return page;
+}
+
+static int sbull_sparse_init(struct sbull_dev *dev)
+{
+	INIT_RADIX_TREE(&dev->pages, GFP_ATOMIC);
+	spin_lock_init(&dev->pages_lock);
+	atomic_long_set(&dev->nr_pages, 0);
+	return 0;
+}
+
+/*
+ * Free every page. Nobody is doing I/O: the queue is gone or the media
+ * has been "changed" while the device was closed.
+ */
+#define SBULL_FREE_BATCH	16
+
+static void sbull_sparse_destroy(struct sbull_dev *dev)
+{
+	struct page *pages[SBULL_FREE_BATCH];
+	pgoff_t idx = 0;
+	int n, i;
+
+	do {
+		spin_lock(&dev->pages_lock);
+		n = radix_tree_gang_lookup(&dev->pages, (void **) pages, idx,
+				SBULL_FREE_BATCH);
+		for (i = 0; i < n; i++) {
+			idx = pages[i]->index;
+			radix_tree_delete(&dev->pages, idx);
+		}
+		spin_unlock(&dev->pages_lock);
+		for (i = 0; i < n; i++)
+			__free_page(pages[i]);
+		atomic_long_sub(n, &dev->nr_pages);
+		idx++;
+	} while (n == SBULL_FREE_BATCH);
+}
+
+static int sbull_sparse_read(struct sbull_dev *dev, u64 pos, char *buf,
+		unsigned int len)
+{
+	struct page *page;
+	unsigned int offset, chunk;
+	void *kaddr;
+
+	rcu_read_lock();
+	while (len) {
+		offset = pos & ~PAGE_MASK;
+		chunk = min_t(unsigned int, len, PAGE_SIZE - offset);
+		page = sbull_sparse_lookup(dev, pos >> PAGE_SHIFT);
+		if (page) {
+			kaddr = kmap_atomic(page, KM_USER1);
+			memcpy(buf, kaddr + offset, chunk);
+			kunmap_atomic(kaddr, KM_USER1);
+		} else
+			memset(buf, 0, chunk);
+		buf += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+static int sbull_sparse_write(struct sbull_dev *dev, u64 pos, const char *buf,
+		unsigned int len)
+{
+	struct page *page;
+	unsigned int offset, chunk;
+	void *kaddr;
+
+	while (len) {
+		offset = pos & ~PAGE_MASK;
+		chunk = min_t(unsigned int, len, PAGE_SIZE - offset);
+		rcu_read_lock();
+		page = sbull_sparse_lookup(dev, pos >> PAGE_SHIFT);
+		if (!page) {
+			rcu_read_unlock();
+			page = sbull_sparse_insert(dev, pos >> PAGE_SHIFT);
+			if (!page)
+				return -ENOMEM;
+			rcu_read_lock();
+		}
+		kaddr = kmap_atomic(page, KM_USER1);
+		memcpy(kaddr + offset, buf, chunk);
+		kunmap_atomic(kaddr, KM_USER1);
+		rcu_read_unlock();
+		buf += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * Whole pages go back to the system, partial ones are zeroed.
+ */
+static int sbull_sparse_discard(struct sbull_dev *dev, u64 pos, u64 len)
+{
+	struct page *page;
+	unsigned int offset, chunk;
+	LIST_HEAD(freed);
+	void *kaddr;
+
+	while (len) {
+		offset = pos & ~PAGE_MASK;
+		chunk = min_t(u64, len, PAGE_SIZE - offset);
+		if (chunk == PAGE_SIZE) {
+			spin_lock(&dev->pages_lock);
+			page = radix_tree_delete(&dev->pages, pos >> PAGE_SHIFT);
+			spin_unlock(&dev->pages_lock);
+			if (page) {
+				list_add(&page->lru, &freed);
+				atomic_long_dec(&dev->nr_pages);
+			}
+		} else {
+			rcu_read_lock();
+			page = sbull_sparse_lookup(dev, pos >> PAGE_SHIFT);
+			if (page) {
+				kaddr = kmap_atomic(page, KM_USER1);
+				memset(kaddr + offset, 0, chunk);
+				kunmap_atomic(kaddr, KM_USER1);
+			}
+			rcu_read_unlock();
+		}
+		pos += chunk;
+		len -= chunk;
+	}
+
+	if (list_empty(&freed))
+		return 0;
+	synchronize_rcu();
+	while (!list_empty(&freed)) {
+		page = list_first_entry(&freed, struct page, lru);
+		list_del(&page->lru);
+		__free_page(page);
+	}
+	return 0;
+}
+
+static const struct sbull_backend sbull_sparse_backend = {
+	.name    = "sparse",
+	.init    = sbull_sparse_init,
+	.destroy = sbull_sparse_destroy,
+	.read    = sbull_sparse_read,
+	.write   = sbull_sparse_write,
+	.discard = sbull_sparse_discard,
+	.clear   = sbull_sparse_destroy,
+	.eager_discard = 1,
+};
+
+/*
+ * The compressed backend, after zram: every page of the device has a
+ * slot, and a written page is kept LZO-compressed in a kmalloc'd
+ * buffer. Partial writes decompress, patch and recompress the page.
+ * The compressor's memory is per CPU, and used with preemption off
+ * (see sbull_zslot_write()).
+ */
+struct sbull_zstream {
+	void *wrkmem;
+	u8 *page;	/* A whole uncompressed page */
+	u8 *cbuf;	/* Compressor output */
+};
+
+static struct sbull_zstream __percpu *sbull_zstreams;
+
+#define SBULL_ZMAX	(PAGE_SIZE / 4 * 3)	/* Store raw beyond this */
+
+static void sbull_zstreams_free(void)
+{
+	int cpu;
+
+	if (!sbull_zstreams)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct sbull_zstream *zs = per_cpu_ptr(sbull_zstreams, cpu);
+
+		kfree(zs->wrkmem);
+		kfree(zs->page);
+		kfree(zs->cbuf);
+	}
+	free_percpu(sbull_zstreams);
+	sbull_zstreams = NULL;
+}
+
+static int sbull_zstreams_alloc(void)
+{
+	int cpu;
+
+	sbull_zstreams = alloc_percpu(struct sbull_zstream);
+	if (!sbull_zstreams)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct sbull_zstream *zs = per_cpu_ptr(sbull_zstreams, cpu);
+
+		zs->wrkmem = kmalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+		zs->page = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		zs->cbuf = kmalloc(lzo1x_worst_compress(PAGE_SIZE), GFP_KERNEL);
+		if (!zs->wrkmem || !zs->page || !zs->cbuf) {
+			sbull_zstreams_free();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static inline struct mutex *sbull_zlock(struct sbull_dev *dev, pgoff_t idx)
+{
+	return dev->zlocks + (idx % SBULL_ZLOCKS);
+}
+
+/*
+ * Is the page a single word repeated?
+ */
+static int sbull_same_filled(const void *page, unsigned long *word)
+{
+	const unsigned long *p = page;
+	unsigned int i;
+
+	for (i = 1; i < PAGE_SIZE / sizeof(*p); i++)
+		if (p[i] != p[0])
+			return 0;
+	*word = p[0];
+	return 1;
+}
+
+static void sbull_fill_word(u8 *buf, unsigned int offset, unsigned int len,
+		unsigned long word)
+{
+	const u8 *w = (const u8 *) &word;
+
+	while (len--)
+		*buf++ = w[offset++ % sizeof(word)];
+}
+
+static void sbull_zslot_free(struct sbull_dev *dev, struct sbull_zslot *slot)
+{
+	if (slot->flags & SBULL_ZSAME) {
+		atomic_long_dec(&dev->same_pages);
+		atomic_long_dec(&dev->nr_pages);
+	} else if (slot->data) {
+		atomic_long_sub(slot->size, &dev->compr_bytes);
+		atomic_long_dec(&dev->nr_pages);
+		kfree(slot->data);
+	}
+	memset(slot, 0, sizeof(*slot));
+}
+
+/*
+ * Decompress a slot into "dst" (a whole page). Called with the slot
+ * locked.
+ */
+static int sbull_zslot_load(struct sbull_zslot *slot, u8 *dst)
+{
+	size_t len = PAGE_SIZE;
+
+	if (!slot->data && !(slot->flags & SBULL_ZSAME))
+		memset(dst, 0, PAGE_SIZE);
+	else if (slot->flags & SBULL_ZSAME)
+		sbull_fill_word(dst, 0, PAGE_SIZE, slot->word);
+	else if (slot->flags & SBULL_ZRAW)
+		memcpy(dst, slot->data, PAGE_SIZE);
+	else if (lzo1x_decompress_safe(slot->data, slot->size, dst, &len) !=
+			LZO_E_OK || len != PAGE_SIZE) {
+		printk_ratelimited(KERN_ERR "sbull: corrupted compressed page\n");
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Write "len" bytes at "offset" into the slot's page. Called with the
+ * slot locked. The compressor's buffers are per CPU and only ours
+ * with preemption off, so the memory for the result is first asked
+ * for without sleeping; if there is none, we give the CPU back,
+ * allocate with GFP_NOIO, and do it all again with somewhere to put
+ * it. The page can't change meanwhile: the slot is locked.
+ */
+static int sbull_zslot_write(struct sbull_dev *dev, struct sbull_zslot *slot,
+		const u8 *buf, unsigned int offset, unsigned int len)
+{
+	struct sbull_zslot new;
+	struct sbull_zstream *zs;
+	size_t clen, mem_len = 0;
+	void *mem = NULL;
+	const u8 *src;
+	int ret;
+
+  again:
+	memset(&new, 0, sizeof(new));
+	zs = get_cpu_ptr(sbull_zstreams);
+	src = buf;
+	if (len != PAGE_SIZE) {
+		ret = sbull_zslot_load(slot, zs->page);
+		if (ret)
+			goto out;
+		memcpy(zs->page + offset, buf, len);
+		src = zs->page;
+	}
+
+	if (sbull_same_filled(src, &new.word)) {
+		new.flags = SBULL_ZSAME;
+		sbull_zslot_free(dev, slot);
+		if (new.word) { /* an all-zero page needs nothing at all */
+			*slot = new;
+			atomic_long_inc(&dev->same_pages);
+			atomic_long_inc(&dev->nr_pages);
+		}
+		ret = 0;
+		goto out;
+	}
+
+	ret = -EIO;
+	if (lzo1x_1_compress(src, PAGE_SIZE, zs->cbuf, &clen, zs->wrkmem) !=
+			LZO_E_OK)
+		goto out;
+	if (clen > SBULL_ZMAX) {
+		new.flags = SBULL_ZRAW;
+		clen = PAGE_SIZE;
+	} else
+		src = zs->cbuf;
+	if (mem && mem_len < clen) {
+		kfree(mem);
+		mem = NULL;
+	}
+	if (!mem) {
+		mem = kmalloc(clen, GFP_NOWAIT | __GFP_NOWARN);
+		mem_len = clen;
+	}
+	if (!mem) {
+		put_cpu_ptr(sbull_zstreams);
+		mem = kmalloc(clen, GFP_NOIO);
+		if (!mem)
+			return -ENOMEM;
+		goto again;
+	}
+	memcpy(mem, src, clen);
+	new.data = mem;
+	new.size = clen;
+	mem = NULL;
+
+	sbull_zslot_free(dev, slot);
+	*slot = new;
+	atomic_long_add(clen, &dev->compr_bytes);
+	atomic_long_inc(&dev->nr_pages);
+	ret = 0;
+  out:
+	put_cpu_ptr(sbull_zstreams);
+	kfree(mem);
+	return ret;
+}
+
+static int sbull_compressed_init(struct sbull_dev *dev)
+{
+	size_t nr = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+	int i;
+
+	dev->zslots = vzalloc(nr * sizeof(struct sbull_zslot));
+	dev->zlocks = kmalloc(SBULL_ZLOCKS * sizeof(struct mutex), GFP_KERNEL);
+	if (!dev->zslots || !dev->zlocks) {
+		vfree(dev->zslots);
+		kfree(dev->zlocks);
+		dev->zslots = NULL;
+		dev->zlocks = NULL;
+		return -ENOMEM;
+	}
+	for (i = 0; i < SBULL_ZLOCKS; i++)
+		mutex_init(dev->zlocks + i);
+	atomic_long_set(&dev->nr_pages, 0);
+	atomic_long_set(&dev->compr_bytes, 0);
+	atomic_long_set(&dev->same_pages, 0);
+	return 0;
+}
+
+static void sbull_compressed_clear(struct sbull_dev *dev)
+{
+	size_t i, nr = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+
+	for (i = 0; i < nr; i++)
+		sbull_zslot_free(dev, dev->zslots + i);
+}
+
+static void sbull_compressed_destroy(struct sbull_dev *dev)
+{
+	if (!dev->zslots)
+		return;
+	sbull_compressed_clear(dev);
+	vfree(dev->zslots);
+	kfree(dev->zlocks);
+	dev->zslots = NULL;
+	dev->zlocks = NULL;
+}
+
+static int sbull_compressed_read(struct sbull_dev *dev, u64 pos, char *buf,
+		unsigned int len)
+{
+	struct sbull_zslot *slot;
+	struct sbull_zstream *zs;
+	unsigned int offset, chunk;
+	pgoff_t idx;
+	int ret = 0;
+
+	while (len) {
+		idx = pos >> PAGE_SHIFT;
+		offset = pos & ~PAGE_MASK;
+		chunk = min_t(unsigned int, len, PAGE_SIZE - offset);
+		slot = dev->zslots + idx;
+
+		mutex_lock(sbull_zlock(dev, idx));
+		if (slot->flags & SBULL_ZSAME)
+			sbull_fill_word(buf, offset, chunk, slot->word);
+		else if (!slot->data)
+			memset(buf, 0, chunk);
+		else if (chunk == PAGE_SIZE)
+			ret = sbull_zslot_load(slot, buf);
+		else {
+			zs = get_cpu_ptr(sbull_zstreams);
+			ret = sbull_zslot_load(slot, zs->page);
+			if (!ret)
+				memcpy(buf, zs->page + offset, chunk);
+			put_cpu_ptr(sbull_zstreams);
+		}
+		mutex_unlock(sbull_zlock(dev, idx));
+		if (ret)
+			return ret;
+
+		buf += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static int sbull_compressed_write(struct sbull_dev *dev, u64 pos,
+		const char *buf, unsigned int len)
+{
+	struct sbull_zslot *slot;
+	unsigned int offset, chunk;
+	pgoff_t idx;
+	int ret = 0;
+
+	while (len) {
+		idx = pos >> PAGE_SHIFT;
+		offset = pos & ~PAGE_MASK;
+		chunk = min_t(unsigned int, len, PAGE_SIZE - offset);
+		slot = dev->zslots + idx;
+
+		mutex_lock(sbull_zlock(dev, idx));
+		ret = sbull_zslot_write(dev, slot, buf, offset, chunk);
+		mutex_unlock(sbull_zlock(dev, idx));
+		if (ret)
+			return ret;
+
+		buf += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static int sbull_compressed_discard(struct sbull_dev *dev, u64 pos, u64 len)
+{
+	const char *zeros = page_address(ZERO_PAGE(0));
+	unsigned int offset, chunk;
+	pgoff_t idx;
+	int ret;
+
+	while (len) {
+		idx = pos >> PAGE_SHIFT;
+		offset = pos & ~PAGE_MASK;
+		chunk = min_t(u64, len, PAGE_SIZE - offset);
+		if (chunk == PAGE_SIZE) {
+			mutex_lock(sbull_zlock(dev, idx));
+			sbull_zslot_free(dev, dev->zslots + idx);
+			mutex_unlock(sbull_zlock(dev, idx));
+		} else {
+			ret = sbull_compressed_write(dev, pos, zeros, chunk);
+			if (ret)
+				return ret;
+		}
+		pos += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static const struct sbull_backend sbull_compressed_backend = {
+	.name    = "compressed",
+	.init    = sbull_compressed_init,
+	.destroy = sbull_compressed_destroy,
+	.read    = sbull_compressed_read,
+	.write   = sbull_compressed_write,
+	.discard = sbull_compressed_discard,
+	.clear   = sbull_compressed_clear,
+	.eager_discard = 1,
+};
+
+/*
+ * The dedup backend. Each page of the device points to a shared,
+ * read-only content page, found by its crc32c and a full compare.
+ * Writing a page builds the new content in a fresh page and looks
+ * that up in turn, so sharing is copy-on-write by construction; the
+ * uid map stays per sector, so sharing data never shares access to
+ * it. All-zero pages point to nothing. The slot locks are the same as
+ * in the compressed store.
+ */
+static inline struct hlist_head *sbull_dbucket(struct sbull_dev *dev, u32 hash)
+{
+	return dev->dtable + hash_32(hash, dedup_hash_bits);
+}
+
+static void sbull_dpage_put(struct sbull_dev *dev, struct sbull_dpage *dp)
+{
+	spin_lock(&dev->dlock);
+	if (--dp->refs) {
+		spin_unlock(&dev->dlock);
+		return;
+	}
+	hlist_del(&dp->node);
+	dev->unique_pages--;
+	spin_unlock(&dev->dlock);
+	__free_page(dp->page);
+	kfree(dp);
+}
+
+/*
+ * Find a page with this content or add "page" as a new one; either way
+ * the caller gets a reference. "page" is freed if it wasn't needed.
+ */
+static struct sbull_dpage *sbull_dpage_get(struct sbull_dev *dev,
+		struct page *page)
+{
+	struct sbull_dpage *dp, *new;
+	struct hlist_node *pos;
+	void *addr = page_address(page);
+	ktime_t t0;
+	u32 hash;
+
+	t0 = ktime_get();
+	hash = crc32c(~0, addr, PAGE_SIZE);
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), t0)), &dev->hash_ns);
+	atomic_long_inc(&dev->hashed_pages);
+
+	new = kmalloc(sizeof(*new), GFP_NOIO);
+	if (!new)
+		return NULL;
+
+	spin_lock(&dev->dlock);
+	hlist_for_each_entry(dp, pos, sbull_dbucket(dev, hash), node)
+		if (dp->hash == hash &&
+				!memcmp(page_address(dp->page), addr, PAGE_SIZE)) {
+			dp->refs++;
+			spin_unlock(&dev->dlock);
+			kfree(new);
+			__free_page(page);
+			return dp;
+		}
+	new->hash = hash;
+	new->refs = 1;
+	new->page = page;
+	hlist_add_head(&new->node, sbull_dbucket(dev, hash));
+	dev->unique_pages++;
+	spin_unlock(&dev->dlock);
+	return new;
+}
+
+/*
+ * Point slot "idx" to "dp" (which may be NULL), dropping what was
+ * there. Called with the slot locked.
+ */
+static void sbull_dslot_set(struct sbull_dev *dev, pgoff_t idx,
+		struct sbull_dpage *dp)
+{
+	struct sbull_dpage *old = dev->dslots[idx];
+
+	dev->dslots[idx] = dp;
+	if (dp && !old)
+		atomic_long_inc(&dev->nr_pages);
+	else if (!dp && old)
+		atomic_long_dec(&dev->nr_pages);
+	if (old)
+		sbull_dpage_put(dev, old);
+}
+
+static int sbull_dedup_init(struct sbull_dev *dev)
+{
+	size_t nr = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+	int i;
+
+	dev->dslots = vzalloc(nr * sizeof(struct sbull_dpage *));
+	dev->dtable = vmalloc(sizeof(struct hlist_head) << dedup_hash_bits);
+	dev->zlocks = kmalloc(SBULL_ZLOCKS * sizeof(struct mutex), GFP_KERNEL);
+	if (!dev->dslots || !dev->dtable || !dev->zlocks) {
+		vfree(dev->dslots);
+		vfree(dev->dtable);
+		kfree(dev->zlocks);
+		dev->dslots = NULL;
+		return -ENOMEM;
+	}
+	for (i = 0; i < (1 << dedup_hash_bits); i++)
+		INIT_HLIST_HEAD(dev->dtable + i);
+	for (i = 0; i < SBULL_ZLOCKS; i++)
+		mutex_init(dev->zlocks + i);
+	spin_lock_init(&dev->dlock);
+	dev->unique_pages = 0;
+	atomic_long_set(&dev->nr_pages, 0);
+	atomic64_set(&dev->hash_ns, 0);
+	atomic_long_set(&dev->hashed_pages, 0);
+	return 0;
+}
+
+static void sbull_dedup_clear(struct sbull_dev *dev)
+{
+	size_t i, nr = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+
+	for (i = 0; i < nr; i++)
+		if (dev->dslots[i])
+			sbull_dslot_set(dev, i, NULL);
+}
+
+static void sbull_dedup_destroy(struct sbull_dev *dev)
+{
+	if (!dev->dslots)
+		return;
+	sbull_dedup_clear(dev);
+	vfree(dev->dslots);
+	vfree(dev->dtable);
+	kfree(dev->zlocks);
+	dev->dslots = NULL;
+	dev->zlocks = NULL;
+}
+
+static int sbull_dedup_read(struct sbull_dev *dev, u64 pos, char *buf,
+		unsigned int len)
+{
+	struct sbull_dpage *dp;
+	unsigned int offset, chunk;
+	pgoff_t idx;
+
+	while (len) {
+		idx = pos >> PAGE_SHIFT;
+		offset = pos & ~PAGE_MASK;
+		chunk = min_t(unsigned int, len, PAGE_SIZE - offset);
+
+		mutex_lock(sbull_zlock(dev, idx));
+		dp = dev->dslots[idx];
+		if (dp)
+			memcpy(buf, page_address(dp->page) + offset, chunk);
+		else
+			memset(buf, 0, chunk);
+		mutex_unlock(sbull_zlock(dev, idx));
+
+		buf += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static int sbull_dedup_write(struct sbull_dev *dev, u64 pos, const char *buf,
+		unsigned int len)
+{
+	struct sbull_dpage *dp, *old;
+	unsigned int offset, chunk;
+	unsigned long word;
+	struct page *page;
+	void *addr;
+	pgoff_t idx;
+
+	while (len) {
+		idx = pos >> PAGE_SHIFT;
+		offset = pos & ~PAGE_MASK;
+		chunk = min_t(unsigned int, len, PAGE_SIZE - offset);
+
+		page = alloc_page(GFP_NOIO);
+		if (!page)
+			return -ENOMEM;
+		addr = page_address(page);
+
+		mutex_lock(sbull_zlock(dev, idx));
+		if (chunk != PAGE_SIZE) {
+			old = dev->dslots[idx];
+			if (old)
+				memcpy(addr, page_address(old->page), PAGE_SIZE);
+			else
+				memset(addr, 0, PAGE_SIZE);
+		}
+		memcpy(addr + offset, buf, chunk);
+
+		if (sbull_same_filled(addr, &word) && !word) {
+			__free_page(page);
+			dp = NULL;
+		} else {
+			dp = sbull_dpage_get(dev, page);
+			if (!dp) {
+				mutex_unlock(sbull_zlock(dev, idx));
+				__free_page(page);
+				return -ENOMEM;
+			}
+		}
+		sbull_dslot_set(dev, idx, dp);
+		mutex_unlock(sbull_zlock(dev, idx));
+
+		buf += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static int sbull_dedup_discard(struct sbull_dev *dev, u64 pos, u64 len)
+{
+	const char *zeros = page_address(ZERO_PAGE(0));
+	unsigned int offset, chunk;
+	pgoff_t idx;
+	int ret;
+
+	while (len) {
+		idx = pos >> PAGE_SHIFT;
+		offset = pos & ~PAGE_MASK;
+		chunk = min_t(u64, len, PAGE_SIZE - offset);
+		if (chunk == PAGE_SIZE) {
+			mutex_lock(sbull_zlock(dev, idx));
+			sbull_dslot_set(dev, idx, NULL);
+			mutex_unlock(sbull_zlock(dev, idx));
+		} else {
+			ret = sbull_dedup_write(dev, pos, zeros, chunk);
+			if (ret)
+				return ret;
+		}
+		pos += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static const struct sbull_backend sbull_dedup_backend = {
+	.name    = "dedup",
+	.init    = sbull_dedup_init,
+	.destroy = sbull_dedup_destroy,
+	.read    = sbull_dedup_read,
+	.write   = sbull_dedup_write,
+	.discard = sbull_dedup_discard,
+	.clear   = sbull_dedup_clear,
+	.eager_discard = 1,
+};
+
+/*
+ * The huge backend. Unlike vmalloc memory, a chunk is reached through
+ * the kernel's direct mapping, which uses large pages, so a big
+ * transfer takes a TLB miss every 2 MB instead of every page. Chunks
+ * are allocated at load, or on first write with first-touch placement
+ * (reads of a missing chunk give zeros); a chunk that can't be had as
+ * a huge page comes from vmalloc instead. Like the flat store, chunks
+ * aren't zeroed: the zero bitmap covers them.
+ */
+static int sbull_nth_node(unsigned long n)
+{
+	int node = first_online_node;
+
+	n %= num_online_nodes();
+	while (n--)
+		node = next_online_node(node);
+	return node;
+}
+
+static struct sbull_hchunk *sbull_hchunk_alloc(int node, gfp_t gfp)
+{
+	struct sbull_hchunk *chunk;
+	struct page *page;
+
+	chunk = kmalloc_node(sizeof(*chunk), gfp, node);
+	if (!chunk)
+		return NULL;
+	page = alloc_pages_node(node, gfp | __GFP_NOWARN, SBULL_HORDER);
+	if (page) {
+		chunk->addr = page_address(page);
+		chunk->huge = 1;
+		chunk->node = node;
+	} else {
+		chunk->addr = __vmalloc(SBULL_HCHUNK, gfp | __GFP_HIGHMEM,
+				PAGE_KERNEL);
+		chunk->huge = 0;
+		chunk->node = NUMA_NO_NODE;
+	}
+	if (!chunk->addr) {
+		kfree(chunk);
+		return NULL;
+	}
+	return chunk;
+}
+
+static void sbull_hchunk_free(struct sbull_hchunk *chunk)
+{
+	if (chunk->huge)
+		free_pages((unsigned long) chunk->addr, SBULL_HORDER);
+	else
+		vfree(chunk->addr);
+	kfree(chunk);
+}
+
+static void sbull_huge_destroy(struct sbull_dev *dev)
+{
+	size_t i, nr = DIV_ROUND_UP(dev->size, SBULL_HCHUNK);
+
+	if (!dev->hchunks)
+		return;
+	for (i = 0; i < nr; i++)
+		if (dev->hchunks[i])
+			sbull_hchunk_free(dev->hchunks[i]);
+	vfree(dev->hchunks);
+	dev->hchunks = NULL;
+}
+
+static int sbull_huge_init(struct sbull_dev *dev)
+{
+	size_t i, nr = DIV_ROUND_UP(dev->size, SBULL_HCHUNK);
+	int node;
+
+	dev->hchunks = vzalloc(nr * sizeof(struct sbull_hchunk *));
+	if (!dev->hchunks)
+		return -ENOMEM;
+	if (numa_policy == SBULL_NUMA_FIRST_TOUCH)
+		return 0;
+	for (i = 0; i < nr; i++) {
+		node = numa_policy == SBULL_NUMA_NODE ? numa_node :
+			sbull_nth_node(i);
+		dev->hchunks[i] = sbull_hchunk_alloc(node, GFP_KERNEL);
+		if (!dev->hchunks[i]) {
+			sbull_huge_destroy(dev);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The chunk holding "pos", placed now if this is its first write.
+ * Two first writers may race: the loser frees its chunk.
+ */
+static struct sbull_hchunk *sbull_hchunk(struct sbull_dev *dev, u64 pos,
+		int write)
+{
+	struct sbull_hchunk **slot = dev->hchunks + div_u64(pos, SBULL_HCHUNK);
+	struct sbull_hchunk *chunk = ACCESS_ONCE(*slot);
+
+	smp_read_barrier_depends();
+	if (chunk || !write)
+		return chunk;
+	chunk = sbull_hchunk_alloc(numa_node_id(), GFP_NOIO);
+	if (!chunk)
+		return NULL;
+	if (cmpxchg(slot, NULL, chunk)) {
+		sbull_hchunk_free(chunk);
+		chunk = *slot;
+	}
+	return chunk;
+}
+
+static int sbull_huge_read(struct sbull_dev *dev, u64 pos, char *buf,
+		unsigned int len)
+{
+	struct sbull_hchunk *chunk;
+	unsigned int offset, count;
+
+	while (len) {
+		offset = pos & (SBULL_HCHUNK - 1);
+		count = min_t(unsigned int, len, SBULL_HCHUNK - offset);
+		chunk = sbull_hchunk(dev, pos, 0);
+		if (chunk)
+			memcpy(buf, chunk->addr + offset, count);
+		else
+			memset(buf, 0, count);
+		buf += count;
+		pos += count;
+		len -= count;
+	}
+	return 0;
+}
+
+static int sbull_huge_write(struct sbull_dev *dev, u64 pos, const char *buf,
+		unsigned int len)
+{
+	struct sbull_hchunk *chunk;
+	unsigned int offset, count;
+
+	while (len) {
+		offset = pos & (SBULL_HCHUNK - 1);
+		count = min_t(unsigned int, len, SBULL_HCHUNK - offset);
+		chunk = sbull_hchunk(dev, pos, 1);
+		if (!chunk)
+			return -ENOMEM;
+		memcpy(chunk->addr + offset, buf, count);
+		buf += count;
+		pos += count;
+		len -= count;
+	}
+	return 0;
+}
+
+static int sbull_huge_discard(struct sbull_dev *dev, u64 pos, u64 len)
+{
+	struct sbull_hchunk *chunk;
+	unsigned int offset, count;
+
+	while (len) {
+		offset = pos & (SBULL_HCHUNK - 1);
+		count = min_t(u64, len, SBULL_HCHUNK - offset);
+		chunk = sbull_hchunk(dev, pos, 0);
+		if (chunk)
+			memset(chunk->addr + offset, 0, count);
+		pos += count;
+		len -= count;
+	}
+	return 0;
+}
+
+static void sbull_huge_clear(struct sbull_dev *dev)
+{
+	sbull_huge_discard(dev, 0, dev->size);
+}
+
+static const struct sbull_backend sbull_huge_backend = {
+	.name    = "huge",
+	.init    = sbull_huge_init,
+	.destroy = sbull_huge_destroy,
+	.read    = sbull_huge_read,
+	.write   = sbull_huge_write,
+	.discard = sbull_huge_discard,
+	.clear   = sbull_huge_clear,
+	.lazy_zero = 1,
+};
+
+/*
+ * Session management.
+ */
+static inline struct hlist_head *sbull_session_bucket(struct sbull_dev *dev,
+		unsigned long key)
+{
+	return dev->sessions + hash_long(key, session_hash_bits);
+}
+
+/*
+ * Caller holds rcu_read_lock() or session_lock.
+ */
+static struct sbull_session *sbull_session_find(struct sbull_dev *dev,
+		unsigned long key)
+{
+	struct sbull_session *sess;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry_rcu(sess, pos, sbull_session_bucket(dev, key), node)
+		if (sess->key == key)
+			return sess;
+	return NULL;
+}
+
+/*
+ * The uid behind a session key: no lock taken.
+ */
+static unsigned short sbull_session_uid(struct sbull_dev *dev,
+		unsigned long key)
+{
+	struct sbull_session *sess;
+	unsigned short uid;
+
+	rcu_read_lock();
+	sess = sbull_session_find(dev, key);
+	if (sess)
+		uid = sess->uid;
+	else
+		uid = legacy_sessions ? key & 1 : SBULL_UID_NONE;
+	rcu_read_unlock();
+	return uid;
+}
+
+/*
+ * Add a session for "key" with uid "*uid", or with the next free one
+ * if that is SBULL_UID_NONE. Sessions from a checkpoint come back with
+ * their old uids (see sbull_file_restore()).
+ */
+static int sbull_session_add(struct sbull_dev *dev, unsigned long key,
+		unsigned short *uid)
+{
+	struct sbull_session *sess;
+
+	sess = kzalloc(sizeof(*sess), GFP_KERNEL);
+	if (!sess)
+		return -ENOMEM;
+	sess->key = key;
+	spin_lock_init(&sess->tb_lock);
+
+	spin_lock(&dev->session_lock);
+	if (sbull_session_find(dev, sess->key)) {
+		spin_unlock(&dev->session_lock);
+		kfree(sess);
+		return -EEXIST;
+	}
+	/*
+	 * Uids are never reused: sectors keep their owner after the
+	 * session is gone, and a new session mustn't inherit them.
+	 */
+	if (*uid == SBULL_UID_NONE && dev->next_uid == SBULL_UID_NONE) {
+		spin_unlock(&dev->session_lock);
+		kfree(sess);
+		return -ENOSPC;
+	}
+	if (*uid == SBULL_UID_NONE)
+		*uid = dev->next_uid++;
+	sess->uid = *uid;
+	hlist_add_head_rcu(&sess->node, sbull_session_bucket(dev, sess->key));
+	dev->nr_sessions++;
+	spin_unlock(&dev->session_lock);
+	return 0;
+}
+
+static int sbull_session_create(struct sbull_dev *dev,
+		struct sbull_session_req *req)
+{
+	unsigned short uid = SBULL_UID_NONE;
+	int ret;
+
+	ret = sbull_session_add(dev, req->key, &uid);
+	if (!ret)
+		req->uid = uid;
+	return ret;
+}
+
+static int sbull_session_revoke(struct sbull_dev *dev, unsigned long key)
+{
+	struct sbull_session *sess;
+
+	spin_lock(&dev->session_lock);
+	sess = sbull_session_find(dev, key);
+	if (sess) {
+		hlist_del_rcu(&sess->node);
+		dev->nr_sessions--;
+	}
+	spin_unlock(&dev->session_lock);
+	if (!sess)
+		return -ENOENT;
+	kfree_rcu(sess, rcu);
+	return 0;
+}
+
+/*
+ * Per-session accounting and limits. A key without a session of its
+ * own is neither counted nor limited.
+ */
+static void sbull_session_denied(struct sbull_dev *dev, unsigned long key)
+{
+	struct sbull_session *sess;
+
+	rcu_read_lock();
+	sess = sbull_session_find(dev, key);
+	if (sess)
+		atomic64_inc(&sess->denied);
+	rcu_read_unlock();
+}
+
+/*
+ * At completion; "start" is when the bio was submitted, or zero.
+ */
+static void sbull_session_account(struct sbull_dev *dev, struct bio *bio,
+		ktime_t start)
+{
+	struct sbull_session *sess;
+	int dir = bio_data_dir(bio);
+	s64 ns;
+
+	if (!session_stats || !ACCESS_ONCE(dev->nr_sessions))
+		return;
+	rcu_read_lock();
+	sess = sbull_session_find(dev, bio->bi_session_key);
+	if (sess) {
+		atomic64_inc(&sess->ios[dir]);
+		atomic64_add(bio->bi_size, &sess->bytes[dir]);
+		if (ktime_to_ns(start)) {
+			ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+			atomic64_inc(&sess->lat_hist[ns > 0 ? min_t(int,
+					ilog2(ns), SBULL_LAT_BUCKETS - 1) : 0]);
+		}
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * Charge "cost" ns to a bucket, and return how long to wait until it
+ * would have been allowed.
+ */
+static u64 sbull_tb_charge(s64 *tat, s64 now, u64 cost)
+{
+	*tat = max_t(s64, *tat, now - NSEC_PER_SEC) + cost;
+	return *tat > now ? *tat - now : 0;
+}
+
+/*
+ * Hold the submitter back while the session is over its limits. The
+ * wait is charged up front, so concurrent submitters queue up behind
+ * each other rather than all waking at once.
+ */
+static void sbull_session_throttle(struct sbull_dev *dev, struct bio *bio)
+{
+	struct sbull_session *sess;
+	u64 wait = 0;
+	s64 now;
+
+	if (!dev->limits)
+		return;
+	rcu_read_lock();
+	sess = sbull_session_find(dev, bio->bi_session_key);
+	if (sess && (sess->iops || sess->bps)) {
+		spin_lock(&sess->tb_lock);
+		now = ktime_to_ns(ktime_get());
+		if (sess->iops)
+			wait = sbull_tb_charge(&sess->io_tat, now,
+					div64_u64(NSEC_PER_SEC, sess->iops));
+		if (sess->bps)
+			wait = max(wait, sbull_tb_charge(&sess->byte_tat, now,
+					div64_u64((u64) bio->bi_size *
+						NSEC_PER_SEC, sess->bps)));
+		spin_unlock(&sess->tb_lock);
+		if (wait)
+			atomic64_add(wait, &sess->throttled_ns);
+	}
+	rcu_read_unlock();
+	if (wait >= NSEC_PER_USEC)
+		usleep_range(div_u64(wait, NSEC_PER_USEC),
+				div_u64(wait, NSEC_PER_USEC) + 50);
+}
+
+static int sbull_session_set_limit(struct sbull_dev *dev,
+		struct sbull_session_limit *lim)
+{
+	struct sbull_session *sess;
+
+	rcu_read_lock();
+	sess = sbull_session_find(dev, lim->key);
+	if (sess) {
+		spin_lock(&sess->tb_lock);
+		sess->iops = lim->iops;
+		sess->bps = lim->bps;
+		sess->io_tat = sess->byte_tat = 0;
+		spin_unlock(&sess->tb_lock);
+		dev->limits = 1;
+	}
+	rcu_read_unlock();
+	return sess ? 0 : -ENOENT;
+}
+
+static int sbull_session_get_stats(struct sbull_dev *dev,
+		struct sbull_session_stats *st)
+{
+	struct sbull_session *sess;
+	int i;
+
+	rcu_read_lock();
+	sess = sbull_session_find(dev, st->key);
+	if (sess) {
+		st->reads = atomic64_read(&sess->ios[READ]);
+		st->writes = atomic64_read(&sess->ios[WRITE]);
+		st->read_bytes = atomic64_read(&sess->bytes[READ]);
+		st->write_bytes = atomic64_read(&sess->bytes[WRITE]);
+		st->denied = atomic64_read(&sess->denied);
+		st->throttled_ns = atomic64_read(&sess->throttled_ns);
+		for (i = 0; i < SBULL_LAT_BUCKETS; i++)
+			st->lat_hist[i] = atomic64_read(&sess->lat_hist[i]);
+	}
+	rcu_read_unlock();
+	return sess ? 0 : -ENOENT;
+}
+
+static int sbull_sessions_init(struct sbull_dev *dev)
+{
+	int i;
+
+	dev->sessions = kmalloc(sizeof(struct hlist_head) << session_hash_bits,
+			GFP_KERNEL);
+	if (!dev->sessions)
+		return -ENOMEM;
+	for (i = 0; i < (1 << session_hash_bits); i++)
+		INIT_HLIST_HEAD(dev->sessions + i);
+	spin_lock_init(&dev->session_lock);
+	dev->next_uid = SBULL_UID_FIRST;
+	dev->nr_sessions = 0;
+	dev->limits = 0;
+	return 0;
+}
+
+/*
+ * At unload: nobody can be looking any more.
+ */
+static void sbull_sessions_destroy(struct sbull_dev *dev)
+{
+	struct sbull_session *sess;
+	struct hlist_node *pos, *n;
+	int i;
+
+	if (!dev->sessions)
+		return;
+	for (i = 0; i < (1 << session_hash_bits); i++)
+		hlist_for_each_entry_safe(sess, pos, n, dev->sessions + i, node)
+			kfree(sess);
+	kfree(dev->sessions);
+	dev->sessions = NULL;
+}
+
+/*
+ * Check a request against the device and its owners, once for the
+ * whole bio. For a write, stamp the range with the session's uid.
+ * Returns 1 if a read must see zeros instead of the data.
+ */
+static int sbull_access(struct sbull_dev *dev, u64 offset, u64 nbytes,
+		int write, unsigned long session_key)
+{
+	unsigned short session_uid;
+	sector_t start, end;
+
+	if ((offset + nbytes) > dev->size) {
+		printk_ratelimited(KERN_NOTICE "sbull: beyond-end %s (%llu %llu)\n",
+				write ? "write" : "read", offset, nbytes);
+		return -EIO;
+	}
+	
+	session_uid = sbull_session_uid(dev, session_key);
+	start = offset / hardsect_size;
+	end = DIV_ROUND_UP(offset + nbytes, hardsect_size);
+	if (write) {
+		if (session_uid == SBULL_UID_NONE) {
+			printk_ratelimited(KERN_WARNING "sbull: unknown session "
+					"%lu denied write at %llu\n",
+					session_key, offset);
+			return -EACCES;
+		}
+		// assign new uids
+		if (sbull_uidmap_set(&dev->uids, start, end, session_uid))
+			return -ENOMEM;
+	}
+	else if (session_uid == SBULL_UID_NONE)
+		return 1; /* owns nothing, not even what nobody owns */
+	else {
+		// check uids
+		if (!sbull_uidmap_check(&dev->uids, start, end, session_uid)) {
+			printk_ratelimited(KERN_WARNING "sbull: session %lu "
+					"denied read at %llu\n", session_key,
+					offset);
+			sbull_session_denied(dev, session_key);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Zero a range lazily: whole pages are only marked in the zero bitmap
+ * (and given to the backend if it frees or persists discards), partial
+ * ones are zeroed in the backing store. Called with the range locked.
+ */
+static int sbull_zero_range(struct sbull_dev *dev, u64 pos, u64 len)
+{
+	u64 end = pos + len;
+	u64 first = PAGE_ALIGN(pos), last = end & PAGE_MASK;
+	pgoff_t idx;
+	int ret = 0;
+
+	if (first >= last)
+		return dev->backend->discard(dev, pos, len);
+	if (pos < first)
+		ret = dev->backend->discard(dev, pos, first - pos);
+	if (ret)
+		return ret;
+	if (last < end && end != dev->size)
+		ret = dev->backend->discard(dev, last, end - last);
+	else if (last < end)
+		last = PAGE_ALIGN(end);	/* The device's partial last page */
+	if (ret)
+		return ret;
+	for (idx = first >> PAGE_SHIFT; idx < last >> PAGE_SHIFT; idx++)
+		if (!test_and_set_bit(idx, dev->zeromap))
+			atomic_long_inc(&dev->zero_pages);
+	if (dev->backend->eager_discard)
+		ret = dev->backend->discard(dev, first, min(last, end) - first);
+	return ret;
+}
+
+/*
+ * Discard: the range reads back as zeros, and belongs to whoever
+ * discarded it, as if it had been written.
+ */
+static int sbull_discard(struct sbull_dev *dev, u64 offset, u64 nbytes,
+		unsigned long session_key)
+{
+	unsigned short session_uid;
+
+	if (offset + nbytes > dev->size) {
+		printk_ratelimited(KERN_NOTICE "sbull: beyond-end discard "
+				"(%llu %llu)\n", offset, nbytes);
+		return -EIO;
+	}
+	session_uid = sbull_session_uid(dev, session_key);
+	if (session_uid == SBULL_UID_NONE)
+		return -EACCES;
+	if (sbull_uidmap_set(&dev->uids, offset / hardsect_size,
+			DIV_ROUND_UP(offset + nbytes, hardsect_size), session_uid))
+		return -ENOMEM;
+	return sbull_zero_range(dev, offset, nbytes);
+}
+
+/*
+ * Range locking. The stripes covering [offset, offset + nbytes) are
+ * taken in ascending order, so two requests can't deadlock whatever
+ * their ranges; a range spanning more regions than there are stripes
+ * just takes them all.
+ */
+static void sbull_stripes(struct sbull_dev *dev, u64 offset, u64 nbytes,
+		unsigned long *map)
+{
+	u64 region = (u64) lock_region_kb << 10;
+	u64 first = div64_u64(offset, region);
+	u64 last = div64_u64(offset + max_t(u64, nbytes, 1) - 1, region);
+
+	bitmap_zero(map, SBULL_MAX_STRIPES);
+	if (last - first + 1 >= nr_stripes)
+		bitmap_fill(map, nr_stripes);
+	else
+		for (; first <= last; first++) {
+			u64 r = first;
+
+			set_bit(do_div(r, nr_stripes), map);
+		}
+}
+
+static void sbull_lock_range(struct sbull_dev *dev, unsigned long *map,
+		int write)
+{
+	int i;
+
+	for_each_set_bit(i, map, nr_stripes) {
+		if (write)
+			down_write(dev->stripes + i);
+		else
+			down_read(dev->stripes + i);
+	}
+}
+
+static void sbull_unlock_range(struct sbull_dev *dev, unsigned long *map,
+		int write)
+{
+	int i;
+
+	for_each_set_bit(i, map, nr_stripes) {
+		if (write)
+			up_write(dev->stripes + i);
+		else
+			up_read(dev->stripes + i);
+	}
+}
+
+static int sbull_stripes_init(struct sbull_dev *dev)
+{
+	int i;
+
+	dev->stripes = kmalloc(nr_stripes * sizeof(struct rw_semaphore),
+			GFP_KERNEL);
+	if (!dev->stripes)
+		return -ENOMEM;
+	for (i = 0; i < nr_stripes; i++)
+		init_rwsem(dev->stripes + i);
+	return 0;
+}
+
+/*
+ * The whole device, for checkpoints.
+ */
+static void sbull_lock_all(struct sbull_dev *dev)
+{
+	DECLARE_BITMAP(map, SBULL_MAX_STRIPES);
+
+	bitmap_fill(map, nr_stripes);
+	sbull_lock_range(dev, map, 1);
+}
+
+static void sbull_unlock_all(struct sbull_dev *dev)
+{
+	DECLARE_BITMAP(map, SBULL_MAX_STRIPES);
+
+	bitmap_fill(map, nr_stripes);
+	sbull_unlock_range(dev, map, 1);
+}
+
+/*
+ * The file backend: the sparse store's radix tree becomes a write-back
+ * cache of the file, filled a page at a time on first use. Pages stay
+ * cached until unload, so nothing is freed under a reader. Dirty pages
+ * are tagged in the tree.
+ *
+ * The file holds the data, then two slots for the uid map and the
+ * sessions that own the uids (without them nobody could read their
+ * data after a reload). A flush is a checkpoint: the data is written
+ * and synced, then the map and sessions go to the older slot, with a
+ * generation and a checksum, and are synced; at load the newest good
+ * slot wins, and its sessions are created again. Data must never reach the file under
+ * an owner it didn't have, so sectors that changed hands since the
+ * last checkpoint are first written out as owned by SBULL_UID_NONE:
+ * after a crash they read back as zeros for everyone. Checkpoints hold
+ * every range lock.
+ *
+ * The writeback work in between only writes pages whose sectors still
+ * have the owners on file, each under its range lock, and leaves the
+ * rest to a checkpoint.
+ */
+#define SBULL_FMAGIC	0x53424632U	/* "SBF2" */
+#define SBULL_DIRTY	0		/* Radix tree tag */
+
+struct sbull_fhdr {
+	__le32 magic;
+	__le32 crc;			/* crc32c of the map and sessions */
+	__le64 gen;
+	__le64 nsectors;
+	__le32 sector_size;
+	__le16 next_uid;
+	__le16 pad;
+	__le32 nr_sessions;
+	__le32 pad2;
+};
+
+/* After the map; every uid a session may have, at most */
+struct sbull_fsession {
+	__le64 key;
+	__le16 uid;
+	__le16 pad[3];
+};
+
+#define SBULL_FSESSIONS	(SBULL_UID_NONE - SBULL_UID_FIRST)
+
+static inline loff_t sbull_fslot(struct sbull_dev *dev, u64 gen)
+{
+	size_t len = PAGE_ALIGN(sizeof(struct sbull_fhdr) +
+			nsectors * sizeof(__le16) +
+			SBULL_FSESSIONS * sizeof(struct sbull_fsession));
+
+	return dev->size + (gen & 1) * len;
+}
+
+/*
+ * Plain reads and writes of the file. Reading past its end gives
+ * zeros: a new file is an empty disk.
+ */
+static int sbull_file_io(struct sbull_dev *dev, void *buf, size_t len,
+		loff_t pos, int write)
+{
+	mm_segment_t old_fs = get_fs();
+	ssize_t n = 0;
+
+	set_fs(KERNEL_DS);
+	while (len) {
+		if (write)
+			n = vfs_write(dev->file, (const char __user *) buf, len,
+					&pos);
+		else
+			n = vfs_read(dev->file, (char __user *) buf, len, &pos);
+		if (n <= 0)
+			break;
+		buf += n;
+		len -= n;
+	}
+	set_fs(old_fs);
+	if (n < 0)
+		return n;
+	if (len && write)
+		return -EIO;
+	if (len)
+		memset(buf, 0, len);
+	return 0;
+}
+
+static int sbull_file_sync(struct sbull_dev *dev)
+{
+	return vfs_fsync(dev->file, 0);
+}
+
+/*
+ * Page "idx" of the cache, read in from the file unless the caller is
+ * about to overwrite all of it; an ERR_PTR() if it can't be had.
+ */
+static struct page *sbull_file_page(struct sbull_dev *dev, pgoff_t idx,
+		int fill)
+{
+	loff_t pos = (loff_t) idx << PAGE_SHIFT;
+	struct page *page;
+	int err = 0;
+
+	rcu_read_lock();
+	page = sbull_sparse_lookup(dev, idx);
+	rcu_read_unlock();
+	if (page)
+		return page;
+
+	page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO);
+	if (!page)
+		return ERR_PTR(-ENOMEM);
+	if (fill) {
+		err = sbull_file_io(dev, kmap(page), min_t(u64, PAGE_SIZE,
+				dev->size - pos), pos, 0);
+		kunmap(page);
+	}
+	if (!err)
+		err = radix_tree_preload(GFP_NOIO);
+	if (err) {
+		__free_page(page);
+		return ERR_PTR(err);
+	}
+	page->index = idx;
+	spin_lock(&dev->pages_lock);
+	if (radix_tree_insert(&dev->pages, idx, page)) {
+		__free_page(page);
+		page = sbull_sparse_lookup(dev, idx);
+	} else
+		atomic_long_inc(&dev->nr_pages);
+	spin_unlock(&dev->pages_lock);
+	radix_tree_preload_end();
+	return page;
+}
+
+static void sbull_file_dirty(struct sbull_dev *dev, struct page *page)
+{
+	if (radix_tree_tag_get(&dev->pages, page->index, SBULL_DIRTY))
+		return;
+	spin_lock(&dev->pages_lock);
+	if (!radix_tree_tag_get(&dev->pages, page->index, SBULL_DIRTY)) {
+		radix_tree_tag_set(&dev->pages, page->index, SBULL_DIRTY);
+		atomic_long_inc(&dev->dirty_pages);
+	}
+	spin_unlock(&dev->pages_lock);
+}
+
+/*
+ * Write one dirty page to the file. The tag goes first, so a write
+ * that comes in meanwhile dirties the page again.
+ */
+static int sbull_file_clean(struct sbull_dev *dev, struct page *page)
+{
+	loff_t pos = (loff_t) page->index << PAGE_SHIFT;
+	int err;
+
+	spin_lock(&dev->pages_lock);
+	radix_tree_tag_clear(&dev->pages, page->index, SBULL_DIRTY);
+	spin_unlock(&dev->pages_lock);
+	atomic_long_dec(&dev->dirty_pages);
+
+	err = sbull_file_io(dev, kmap(page), min_t(u64, PAGE_SIZE,
+			dev->size - pos), pos, 1);
+	kunmap(page);
+	if (err)
+		sbull_file_dirty(dev, page);
+	return err;
+}
+
+/*
+ * Write back the dirty pages. With "locked" the caller holds every
+ * range lock; otherwise take each page's, and skip pages with new
+ * owners. Returns how many were skipped, or an error. A discard may
+ * drop a page while we don't hold its lock, so only the index is kept
+ * from the lookup and the page is looked up again under the lock.
+ */
+static int sbull_file_writeback(struct sbull_dev *dev, int locked)
+{
+	DECLARE_BITMAP(stripes, SBULL_MAX_STRIPES);
+	struct page *pages[SBULL_FREE_BATCH];
+	pgoff_t idxs[SBULL_FREE_BATCH];
+	int n, i, err = 0, skipped = 0;
+	struct page *page;
+	pgoff_t idx = 0;
+	sector_t start;
+
+	do {
+		rcu_read_lock();
+		n = radix_tree_gang_lookup_tag(&dev->pages, (void **) pages,
+				idx, SBULL_FREE_BATCH, SBULL_DIRTY);
+		for (i = 0; i < n; i++)
+			idxs[i] = pages[i]->index;
+		rcu_read_unlock();
+		for (i = 0; i < n && !err; i++) {
+			idx = idxs[i];
+			if (!locked) {
+				sbull_stripes(dev, (u64) idx << PAGE_SHIFT,
+						PAGE_SIZE, stripes);
+				sbull_lock_range(dev, stripes, 0);
+			}
+			rcu_read_lock();
+			page = sbull_sparse_lookup(dev, idx);
+			rcu_read_unlock();
+			start = ((u64) idx << PAGE_SHIFT) / hardsect_size;
+			if (!page)
+				;	/* Discarded meanwhile */
+			else if (locked || sbull_uidmap_same(&dev->uids,
+					dev->fsaved, start, min_t(sector_t,
+					nsectors, start +
+					PAGE_SIZE / hardsect_size)))
+				err = sbull_file_clean(dev, page);
+			else
+				skipped++;
+			if (!locked)
+				sbull_unlock_range(dev, stripes, 0);
+		}
+		idx++;
+	} while (n == SBULL_FREE_BATCH && !err);
+	return err ? err : skipped;
+}
+
+/*
+ * The sessions as they are now, into dev->fsess; returns how many.
+ */
+static unsigned int sbull_file_sessions(struct sbull_dev *dev,
+		unsigned short *next_uid)
+{
+	struct sbull_session *sess;
+	struct hlist_node *pos;
+	unsigned int i, n = 0;
+
+	spin_lock(&dev->session_lock);
+	for (i = 0; i < (1 << session_hash_bits); i++)
+		hlist_for_each_entry(sess, pos, dev->sessions + i, node) {
+			dev->fsess[n].key = cpu_to_le64(sess->key);
+			dev->fsess[n].uid = cpu_to_le16(sess->uid);
+			memset(dev->fsess[n].pad, 0, sizeof(dev->fsess[n].pad));
+			n++;
+		}
+	*next_uid = dev->next_uid;
+	spin_unlock(&dev->session_lock);
+	return n;
+}
+
+/*
+ * Write "uids" and the sessions as checkpoint number dev->fgen + 1.
+ * The sessions are taken after the map, so every uid in it that has
+ * a session is there.
+ */
+static int sbull_file_write_map(struct sbull_dev *dev, unsigned short *uids)
+{
+	struct sbull_fhdr hdr;
+	__le16 *buf;
+	loff_t pos = sbull_fslot(dev, dev->fgen + 1) + sizeof(hdr);
+	unsigned int n, i, per = PAGE_SIZE / sizeof(__le16);
+	unsigned short next_uid;
+	sector_t sector;
+	u32 crc = ~0;
+	int err = 0;
+
+	buf = (__le16 *) __get_free_page(GFP_NOIO);
+	if (!buf)
+		return -ENOMEM;
+	for (sector = 0; sector < nsectors && !err; sector += n) {
+		n = min_t(sector_t, per, nsectors - sector);
+		for (i = 0; i < n; i++)
+			buf[i] = cpu_to_le16(uids[sector + i]);
+		crc = crc32c(crc, buf, n * sizeof(__le16));
+		err = sbull_file_io(dev, buf, n * sizeof(__le16), pos, 1);
+		pos += n * sizeof(__le16);
+	}
+	free_page((unsigned long) buf);
+	if (err)
+		return err;
+
+	n = sbull_file_sessions(dev, &next_uid);
+	crc = crc32c(crc, dev->fsess, n * sizeof(struct sbull_fsession));
+	err = sbull_file_io(dev, dev->fsess, n * sizeof(struct sbull_fsession),
+			pos, 1);
+	if (err)
+		return err;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = cpu_to_le32(SBULL_FMAGIC);
+	hdr.crc = cpu_to_le32(crc);
+	hdr.gen = cpu_to_le64(dev->fgen + 1);
+	hdr.nsectors = cpu_to_le64(nsectors);
+	hdr.sector_size = cpu_to_le32(hardsect_size);
+	hdr.next_uid = cpu_to_le16(next_uid);
+	hdr.nr_sessions = cpu_to_le32(n);
+	err = sbull_file_io(dev, &hdr, sizeof(hdr),
+			sbull_fslot(dev, dev->fgen + 1), 1);
+	if (!err)
+		err = sbull_file_sync(dev);
+	if (!err)
+		dev->fgen++;
+	return err;
+}
+
+/*
+ * Read the map in checkpoint "gen", and its sessions into dev->fsess;
+ * 0 if it's good.
+ */
+static int sbull_file_read_map(struct sbull_dev *dev, u64 gen,
+		unsigned short *uids, unsigned short *next_uid,
+		unsigned int *nr_sessions)
+{
+	struct sbull_fhdr hdr;
+	__le16 *buf;
+	loff_t pos = sbull_fslot(dev, gen);
+	unsigned int n, i, per = PAGE_SIZE / sizeof(__le16);
+	sector_t sector;
+	u32 crc = ~0;
+	int err;
+
+	err = sbull_file_io(dev, &hdr, sizeof(hdr), pos, 0);
+	if (err)
+		return err;
+	if (le32_to_cpu(hdr.magic) != SBULL_FMAGIC ||
+			le64_to_cpu(hdr.gen) != gen ||
+			le64_to_cpu(hdr.nsectors) != nsectors ||
+			le32_to_cpu(hdr.sector_size) != hardsect_size ||
+			le32_to_cpu(hdr.nr_sessions) > SBULL_FSESSIONS)
+		return -EINVAL;
+
+	buf = (__le16 *) __get_free_page(GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	pos += sizeof(hdr);
+	for (sector = 0; sector < nsectors && !err; sector += n) {
+		n = min_t(sector_t, per, nsectors - sector);
+		err = sbull_file_io(dev, buf, n * sizeof(__le16), pos, 0);
+		crc = crc32c(crc, buf, n * sizeof(__le16));
+		for (i = 0; i < n; i++)
+			uids[sector + i] = le16_to_cpu(buf[i]);
+		pos += n * sizeof(__le16);
+	}
+	free_page((unsigned long) buf);
+	if (err)
+		return err;
+
+	*nr_sessions = le32_to_cpu(hdr.nr_sessions);
+	err = sbull_file_io(dev, dev->fsess, *nr_sessions *
+			sizeof(struct sbull_fsession), pos, 0);
+	crc = crc32c(crc, dev->fsess, *nr_sessions *
+			sizeof(struct sbull_fsession));
+	if (!err && crc != le32_to_cpu(hdr.crc))
+		err = -EINVAL;
+	*next_uid = le16_to_cpu(hdr.next_uid);
+	return err;
+}
+
+/*
+ * A checkpoint. Called with every range lock held.
+ */
+static int sbull_file_checkpoint(struct sbull_dev *dev)
+{
+	unsigned short *tmp;
+	sector_t i;
+	int fence = 0, err;
+
+	sbull_uidmap_dump(&dev->uids, dev->fsnap);
+	for (i = 0; i < nsectors; i++)
+		if (dev->fsnap[i] != dev->fsaved[i]) {
+			dev->fsaved[i] = SBULL_UID_NONE;
+			fence = 1;
+		}
+	if (fence) {
+		err = sbull_file_write_map(dev, dev->fsaved);
+		if (err)
+			return err;
+	}
+
+	err = sbull_file_writeback(dev, 1);
+	if (!err)
+		err = sbull_file_sync(dev);
+	if (err || !fence)
+		return err;
+
+	err = sbull_file_write_map(dev, dev->fsnap);
+	if (err)
+		return err;
+	tmp = dev->fsaved;
+	dev->fsaved = dev->fsnap;
+	dev->fsnap = tmp;
+	return 0;
+}
+
+static int sbull_file_flush(struct sbull_dev *dev)
+{
+	int err;
+
+	sbull_lock_all(dev);
+	err = sbull_file_checkpoint(dev);
+	sbull_unlock_all(dev);
+	if (err)
+		printk_ratelimited(KERN_WARNING "sbull: checkpoint failed "
+				"(%d)\n", err);
+	return err;
+}
+
+static void sbull_file_writeback_work(struct work_struct *work)
+{
+	struct sbull_dev *dev = container_of(to_delayed_work(work),
+			struct sbull_dev, writeback);
+
+	if (sbull_file_writeback(dev, 0) > 0)
+		sbull_file_flush(dev);
+	schedule_delayed_work(&dev->writeback,
+			msecs_to_jiffies(writeback_ms));
+}
+
+/*
+ * Like the loop driver, keep the file's page cache from recursing into
+ * I/O while we are doing I/O. The I/O itself is only ever done by the
+ * hardware queue workers (see sbull_init), the writeback work, or at
+ * open, close and unload: never in make_request.
+ */
+static int sbull_file_init(struct sbull_dev *dev)
+{
+	char name[256];
+	int err;
+
+	snprintf(name, sizeof(name), "%s%c", backing_file,
+			'a' + (int) (dev - Devices));
+	dev->file = filp_open(name, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (IS_ERR(dev->file)) {
+		err = PTR_ERR(dev->file);
+		dev->file = NULL;
+		printk(KERN_NOTICE "sbull: can't open %s (%d)\n", name, err);
+		return err;
+	}
+	if (!S_ISREG(dev->file->f_path.dentry->d_inode->i_mode)) {
+		printk(KERN_NOTICE "sbull: %s is not a regular file\n", name);
+		filp_close(dev->file, NULL);
+		dev->file = NULL;
+		return -EINVAL;
+	}
+	mapping_set_gfp_mask(dev->file->f_mapping,
+			mapping_gfp_mask(dev->file->f_mapping) &
+			~(__GFP_IO | __GFP_FS));
+
+	dev->fsaved = vzalloc(nsectors * sizeof(unsigned short));
+	dev->fsnap = vmalloc(nsectors * sizeof(unsigned short));
+	dev->fsess = vmalloc(SBULL_FSESSIONS * sizeof(struct sbull_fsession));
+	if (!dev->fsaved || !dev->fsnap || !dev->fsess) {
+		vfree(dev->fsaved);
+		vfree(dev->fsnap);
+		vfree(dev->fsess);
+		filp_close(dev->file, NULL);
+		dev->file = NULL;
+		return -ENOMEM;
+	}
+	sbull_sparse_init(dev);
+	atomic_long_set(&dev->dirty_pages, 0);
+	INIT_DELAYED_WORK(&dev->writeback, sbull_file_writeback_work);
+	return 0;
+}
+
+/*
+ * Once the uid map and the sessions are set up: take the owners and
+ * their sessions from the newest good checkpoint, and start the
+ * writeback.
+ */
+static int sbull_file_restore(struct sbull_dev *dev)
+{
+	unsigned short next_uid, uid;
+	unsigned int n, nr_sessions;
+	struct sbull_fhdr hdr;
+	u64 gen[2];
+	int i, err;
+
+	for (i = 0; i < 2; i++) {
+		gen[i] = 0;
+		if (!sbull_file_io(dev, &hdr, sizeof(hdr), sbull_fslot(dev, i), 0)
+				&& le32_to_cpu(hdr.magic) == SBULL_FMAGIC)
+			gen[i] = le64_to_cpu(hdr.gen);
+	}
+	if (gen[0] < gen[1])
+		swap(gen[0], gen[1]);
+	for (i = 0; i < 2 && gen[i]; i++)
+		if (!sbull_file_read_map(dev, gen[i], dev->fsaved, &next_uid,
+				&nr_sessions))
+			break;
+	if (i < 2 && gen[i]) {
+		dev->fgen = gen[i];
+		/* Old owners keep their uids; new sessions must not get them */
+		dev->next_uid = max_t(unsigned short, next_uid, SBULL_UID_FIRST);
+		err = sbull_uidmap_load(&dev->uids, dev->fsaved);
+		if (err)
+			return err;
+		for (n = 0; n < nr_sessions; n++) {
+			uid = le16_to_cpu(dev->fsess[n].uid);
+			if (uid < SBULL_UID_FIRST || uid >= dev->next_uid)
+				continue;
+			err = sbull_session_add(dev,
+					le64_to_cpu(dev->fsess[n].key), &uid);
+			if (err && err != -EEXIST)
+				return err;
+		}
+	} else
+		memset(dev->fsaved, 0, nsectors * sizeof(unsigned short));
+
+	if (writeback_ms > 0)
+		schedule_delayed_work(&dev->writeback,
+				msecs_to_jiffies(writeback_ms));
+	return 0;
+}
+
+/*
+ * At unload, after a last flush, or when setting up failed.
+ */
+static void sbull_file_destroy(struct sbull_dev *dev)
+{
+	if (!dev->file)
+		return;
+	cancel_delayed_work_sync(&dev->writeback);
+	sbull_sparse_destroy(dev);
+	vfree(dev->fsaved);
+	vfree(dev->fsnap);
+	vfree(dev->fsess);
+	filp_close(dev->file, NULL);
+	dev->file = NULL;
+}
+
+static int sbull_file_read(struct sbull_dev *dev, u64 pos, char *buf,
+		unsigned int len)
+{
+	struct page *page;
+	unsigned int offset, chunk;
+	void *kaddr;
+
+	while (len) {
+		offset = pos & ~PAGE_MASK;
+		chunk = min_t(unsigned int, len, PAGE_SIZE - offset);
+		page = sbull_file_page(dev, pos >> PAGE_SHIFT, 1);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		kaddr = kmap_atomic(page, KM_USER1);
+		memcpy(buf, kaddr + offset, chunk);
+		kunmap_atomic(kaddr, KM_USER1);
+		buf += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static int sbull_file_write(struct sbull_dev *dev, u64 pos, const char *buf,
+		unsigned int len)
+{
+	struct page *page;
+	unsigned int offset, chunk;
+	void *kaddr;
+
+	while (len) {
+		offset = pos & ~PAGE_MASK;
+		chunk = min_t(unsigned int, len, PAGE_SIZE - offset);
+		page = sbull_file_page(dev, pos >> PAGE_SHIFT,
+				chunk != PAGE_SIZE);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		kaddr = kmap_atomic(page, KM_USER1);
+		memcpy(kaddr + offset, buf, chunk);
+		kunmap_atomic(kaddr, KM_USER1);
+		sbull_file_dirty(dev, page);
+		buf += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * Discard whole pages: drop them from the cache, dirty or not, and
+ * punch them out of the file, which then reads them back as zeros.
+ * Called with the range locked, which keeps readers and
+ * sbull_file_writeback() off these pages.
+ */
+static int sbull_file_punch(struct sbull_dev *dev, u64 pos, u64 len)
+{
+	struct file *file = dev->file;
+	struct page *page;
+	LIST_HEAD(freed);
+	pgoff_t idx;
+
+	if (!file->f_op->fallocate)
+		return -EOPNOTSUPP;
+	for (idx = pos >> PAGE_SHIFT; idx < (pos + len) >> PAGE_SHIFT; idx++) {
+		spin_lock(&dev->pages_lock);
+		if (radix_tree_tag_get(&dev->pages, idx, SBULL_DIRTY))
+			atomic_long_dec(&dev->dirty_pages);
+		page = radix_tree_delete(&dev->pages, idx);
+		spin_unlock(&dev->pages_lock);
+		if (page) {
+			list_add(&page->lru, &freed);
+			atomic_long_dec(&dev->nr_pages);
+		}
+	}
+	if (!list_empty(&freed)) {
+		synchronize_rcu();
+		while (!list_empty(&freed)) {
+			page = list_first_entry(&freed, struct page, lru);
+			list_del(&page->lru);
+			__free_page(page);
+		}
+	}
+	return file->f_op->fallocate(file, FALLOC_FL_PUNCH_HOLE |
+			FALLOC_FL_KEEP_SIZE, pos, len);
+}
+
+static int sbull_file_zero(struct sbull_dev *dev, u64 pos, u64 len)
+{
+	const char *zeros = page_address(ZERO_PAGE(0));
+	unsigned int chunk;
+	int ret;
+
+	while (len) {
+		chunk = min_t(u64, len, PAGE_SIZE - (pos & ~PAGE_MASK));
+		ret = sbull_file_write(dev, pos, zeros, chunk);
+		if (ret)
+			return ret;
+		pos += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * The whole pages are punched out; like loop, we only fall back to
+ * writing zeros if the file can't do that. Partial pages at either end
+ * get zeros written.
+ */
+static int sbull_file_discard(struct sbull_dev *dev, u64 pos, u64 len)
+{
+	u64 first = PAGE_ALIGN(pos), last = (pos + len) & PAGE_MASK;
+	int ret;
+
+	if (first >= last)
+		return sbull_file_zero(dev, pos, len);
+	ret = sbull_file_punch(dev, first, last - first);
+	if (ret == -EOPNOTSUPP)
+		ret = sbull_file_zero(dev, first, last - first);
+	if (!ret && pos < first)
+		ret = sbull_file_zero(dev, pos, first - pos);
+	if (!ret && last < pos + len)
+		ret = sbull_file_zero(dev, last, pos + len - last);
+	return ret;
+}
+
+/*
+ * The medium is the file, and it doesn't go away.
+ */
+static void sbull_file_clear(struct sbull_dev *dev)
+{
+}
+
+static const struct sbull_backend sbull_file_backend = {
+	.name    = "file",
+	.init    = sbull_file_init,
+	.destroy = sbull_file_destroy,
+	.read    = sbull_file_read,
+	.write   = sbull_file_write,
+	.discard = sbull_file_discard,
+	.clear   = sbull_file_clear,
+	.flush   = sbull_file_flush,
+	.eager_discard = 1,
+	.blocking = 1,
+};
+
+/*
+ * Fault injection. The check is one list_empty() while no fault is
+ * set up.
+ */
+static int sbull_fault(struct sbull_dev *dev, struct bio *bio)
+{
+	struct sbull_fault *f;
+	sector_t end = bio->bi_sector + max_t(sector_t, bio_sectors(bio), 1);
+	int rw = bio_data_dir(bio) == WRITE ? SBULL_FAULT_WRITE :
+		SBULL_FAULT_READ;
+	int error = 0;
+
+	if (list_empty(&dev->faults))
+		return 0;
+	rcu_read_lock();
+	list_for_each_entry_rcu(f, &dev->faults, list)
+		if ((f->rw & rw) && f->start < end && f->end > bio->bi_sector &&
+				(f->percent >= 100 ||
+				 random32() % 100 < f->percent)) {
+			error = f->error;
+			break;
+		}
+	rcu_read_unlock();
+	return error;
+}
+
+static void sbull_faults_clear(struct sbull_dev *dev)
+{
+	struct sbull_fault *f, *n;
+
+	spin_lock(&dev->fault_lock);
+	list_for_each_entry_safe(f, n, &dev->faults, list) {
+		list_del_rcu(&f->list);
+		kfree_rcu(f, rcu);
+	}
+	spin_unlock(&dev->fault_lock);
+}
+
+/*
+ * An exponentially distributed delay, -mean * ln(U), without floating
+ * point: log2 of the random number in 16.16 fixed point, linear
+ * between powers of two, is close enough for a test device.
+ */
+static u64 sbull_exp_ns(u64 mean)
+{
+	u32 r = random32() | 1;
+	int k = ilog2(r);
+	u32 l = (k << 16) | (u32) (((u64) (r - (1U << k)) << 16) >> k);
+	u64 x = (u64) ((32 << 16) - l) * 45426 >> 16;	/* times ln 2 */
+
+	return mean * x >> 16;
+}
+
+static u64 sbull_service_time(struct sbull_dev *dev, struct bio *bio)
+{
+	struct sbull_latency *lat = &dev->lat;
+	u64 ns;
+
+	ns = lat->ns[bio_data_dir(bio)] + lat->qd_ns * atomic_read(&dev->delayed);
+	switch (lat->dist) {
+	case SBULL_LAT_UNIFORM:
+		/* 2 * jitter * r / 2^32, in 64 bits: jitter < 2^32 */
+		ns += (lat->jitter_ns * (random32() >> 1)) >> 30;
+		break;
+	case SBULL_LAT_EXP:
+		ns += sbull_exp_ns(lat->jitter_ns);
+		break;
+	}
+	return ns;
+}
+
+/*
+ * The timer can't free itself: the hrtimer code still touches it after
+ * the callback returns. Fired ones wait on delayed_done for this, and
+ * hrtimer_cancel() makes sure their callback is really over.
+ */
+static void sbull_delayed_reap(struct work_struct *work)
+{
+	struct sbull_dev *dev = container_of(work, struct sbull_dev,
+			delayed_reap);
+	struct sbull_delayed *d, *n;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&dev->delayed_lock, flags);
+	list_splice_init(&dev->delayed_done, &done);
+	spin_unlock_irqrestore(&dev->delayed_lock, flags);
+	list_for_each_entry_safe(d, n, &done, list) {
+		hrtimer_cancel(&d->timer);
+		kfree(d);
+	}
+}
+
+static enum hrtimer_restart sbull_delayed_fire(struct hrtimer *timer)
+{
+	struct sbull_delayed *d = container_of(timer, struct sbull_delayed,
+			timer);
+	struct sbull_dev *dev = d->dev;
+	unsigned long flags;
+
+	trace_sbull_bio_complete(dev->gd, d->bio, d->error, d->start);
+	sbull_session_account(dev, d->bio, d->start);
+	bio_endio(d->bio, d->error);
+	spin_lock_irqsave(&dev->delayed_lock, flags);
+	list_add_tail(&d->list, &dev->delayed_done);
+	spin_unlock_irqrestore(&dev->delayed_lock, flags);
+	schedule_work(&dev->delayed_reap);
+	atomic_dec(&dev->delayed);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * End a bio, now or when the latency model says; "start" is when it
+ * was submitted. If we can't get the memory to wait, it's now.
  */
-#define SBULL_MINORS	16
-#define MINOR_SHIFT	4
-#define DEVNUM(kdevnum)	(MINOR(kdev_t_to_nr(kdevnum)) >> MINOR_SHIFT
+static void sbull_complete(struct sbull_dev *dev, struct bio *bio, int error,
+		ktime_t start)
+{
+	struct sbull_delayed *d;
+	ktime_t due;
+
+	if (dev->lat_on && ktime_to_ns(start)) {
+		due = ktime_add_ns(start, sbull_service_time(dev, bio));
+		if (ktime_to_ns(ktime_sub(due, ktime_get())) > 0 &&
+				(d = kmalloc(sizeof(*d), GFP_NOIO)) != NULL) {
+			d->bio = bio;
+			d->error = error;
+			d->start = start;
+			d->dev = dev;
+			hrtimer_init(&d->timer, CLOCK_MONOTONIC,
+					HRTIMER_MODE_ABS);
+			d->timer.function = sbull_delayed_fire;
+			atomic_inc(&dev->delayed);
+			hrtimer_start(&d->timer, due, HRTIMER_MODE_ABS);
+			return;
+		}
+	}
+	trace_sbull_bio_complete(dev->gd, bio, error, start);
+	sbull_session_account(dev, bio, start);
+	bio_endio(bio, error);
+}
 
 /*
- * We can tweak our hardware sector size, but the kernel talks to us
- * in terms of small sectors, always.
+ * Transfer a single BIO.
  */
-#define KERNEL_SECTOR_SIZE	512
 
 /*
- * After this much idle time, the driver will simulate a media change.
+ * Move "len" bytes at "buf" to or from the backing store at "pos".
  */
-#define INVALIDATE_DELAY	30*HZ
-
-#define DEFAULT_SESSION_KEY 	1234
+static int sbull_copy_lazy(struct sbull_dev *dev, u64 pos, char *buf,
+		unsigned int len, int write);
 
-struct dio;
+static inline int sbull_copy(struct sbull_dev *dev, u64 pos, char *buf,
+		unsigned int len, int write)
+{
+	if (dev->pgens || atomic_long_read(&dev->zero_pages))
+		return sbull_copy_lazy(dev, pos, buf, len, write);
+	if (write)
+		return dev->backend->write(dev, pos, buf, len);
+	return dev->backend->read(dev, pos, buf, len);
+}
 
 /*
- * The internal representation of our device.
+ * Pages the backing store doesn't have right: discarded ones, and with
+ * removable media those whose generation isn't the device's (data
+ * from an earlier medium). They read as zeros, and are zeroed in the
+ * backing store before a partial write; a media change is then just a
+ * new generation. Pages never straddle range locks (see sbull_init),
+ * so this can't race with other I/O to the page.
  */
-struct sbull_dev {
-        int size;                       /* Device size in sectors */
-        u8 *data;                       /* The data array */
-	unsigned short *sector_uids;
-	unsigned short *sessions;
-        short users;                    /* How many users */
-        short media_change;             /* Flag a media change? */
-        spinlock_t lock;                /* For mutual exclusion */
-        struct request_queue *queue;    /* The device request queue */
-        struct gendisk *gd;             /* The gendisk structure */
-        struct timer_list timer;        /* For simulated media changes */
-};
-
-#define SBULL_DEV(blk_dev) (blk_dev->bd_disk->private_data)
+static inline int sbull_page_stale(struct sbull_dev *dev, pgoff_t idx)
+{
+	return test_bit(idx, dev->zeromap) ||
+		(dev->pgens && dev->pgens[idx] != dev->gen);
+}
 
-static struct sbull_dev *Devices = NULL;
+static int sbull_copy_lazy(struct sbull_dev *dev, u64 pos, char *buf,
+		unsigned int len, int write)
+{
+	unsigned int chunk;
+	pgoff_t idx;
+	u64 start;
+	int res;
 
-#define sbull_for_each_sector(sector, pos, start, end)	\
-	for(pos = start, sector = start % hardsect_size;	\
-		pos < end; pos += hardsect_size, 		\
-		sector = pos % hardsect_size)	
+	while (len) {
+		idx = pos >> PAGE_SHIFT;
+		chunk = min_t(unsigned int, len, PAGE_SIZE - (pos & ~PAGE_MASK));
+		start = (u64) idx << PAGE_SHIFT;
+		if (sbull_page_stale(dev, idx)) {
+			if (!write) {
+				memset(buf, 0, chunk);
+				goto next;
+			}
+			if (chunk != min_t(u64, PAGE_SIZE, dev->size - start)) {
+				res = dev->backend->discard(dev, start,
+					min_t(u64, PAGE_SIZE, dev->size - start));
+				if (res)
+					return res;
+			}
+			if (dev->pgens)
+				dev->pgens[idx] = dev->gen;
+			if (test_and_clear_bit(idx, dev->zeromap))
+				atomic_long_dec(&dev->zero_pages);
+		}
+		if (write)
+			res = dev->backend->write(dev, pos, buf, chunk);
+		else
+			res = dev->backend->read(dev, pos, buf, chunk);
+		if (res)
+			return res;
+	  next:
+		buf += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
 
 /*
- * Handle an I/O request.
+ * The access check is done once for the whole bio, then the segments
+ * are streamed to or from the backing store. Segments that follow each
+ * other in the kernel's direct mapping are merged into one copy; only
+ * highmem pages need kmap(), which may sleep like the store itself.
+ * Called with the range locked.
  */
-static int sbull_transfer(struct sbull_dev *dev, unsigned long offset,
-		unsigned long nbytes, char *buffer, int write, 
-		unsigned long session_key)
+static int sbull_do_bio(struct sbull_dev *dev, struct bio *bio)
 {
-	unsigned short session_uid;
-	unsigned long start, end, pos;
-	int sector;
-	int invalid_access = 0;
+	int i;
+	struct bio_vec *bvec;
+	u64 offset = (u64) bio->bi_sector * KERNEL_SECTOR_SIZE;
+	int write = bio_data_dir(bio) == WRITE;
+	char *run = NULL, *buffer;
+	unsigned int run_len = 0;
+	int res;
 
-	if ((offset + nbytes) > dev->size) {
-		printk (KERN_NOTICE "Beyond-end write (%ld %ld)\n", offset, nbytes);
-		return 1;
+	if (bio->bi_rw & REQ_DISCARD)
+		return sbull_discard(dev, offset, bio->bi_size,
+				bio->bi_session_key);
+
+	res = sbull_access(dev, offset, bio->bi_size, write,
+			bio->bi_session_key);
+	if (res < 0)
+		return res;
+	if (res) {
+		zero_fill_bio(bio); /* Not yours to read */
+		return 0;
 	}
-	
-	session_uid = dev->sessions[session_key & 1];
-	start = offset; end = start + nbytes;
-	if (write) {
-		// assign new uids
-		sbull_for_each_sector(sector, pos, start, end) {
-			dev->sector_uids[sector] = session_uid;
+
+	bio_for_each_segment(bvec, bio, i) {
+		buffer = PageHighMem(bvec->bv_page) ? NULL :
+			page_address(bvec->bv_page) + bvec->bv_offset;
+		if (run && run + run_len == buffer) {
+			run_len += bvec->bv_len;
+			continue;
 		}
-		memcpy(dev->data + offset, buffer, nbytes);
-	}
-	else {
-		// check uids
-		sbull_for_each_sector(sector, pos, start, end) {
-			if(dev->sector_uids[sector] != session_uid) {
-				invalid_access = 1;
-				break;
-			}
+		if (run) {
+			res = sbull_copy(dev, offset, run, run_len, write);
+			if (res)
+				return res;
+			offset += run_len;
+			run = NULL;
 		}
-		if(invalid_access)
-			memset(buffer, 0, nbytes);
-		else
-			memcpy(buffer, dev->data + offset, nbytes);
+		if (!buffer) {
+			buffer = kmap(bvec->bv_page) + bvec->bv_offset;
+			res = sbull_copy(dev, offset, buffer, bvec->bv_len, write);
+			kunmap(bvec->bv_page);
+			if (res)
+				return res;
+			offset += bvec->bv_len;
+			continue;
+		}
+		run = buffer;
+		run_len = bvec->bv_len;
 	}
+	if (run)
+		return sbull_copy(dev, offset, run, run_len, write);
 	return 0;
 }
 
 /*
- * The simple form of the request function.
- */
-/*
- * Transfer a single BIO.
+ * REQ_FLUSH comes before the data and REQ_FUA after it; both are a
+ * full flush, which takes every range lock, so they are done outside
+ * the bio's own range. They only reach us if the backend has a flush.
  */
 static int sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio)
 {
-	int i;
-	struct bio_vec *bvec;
-  	unsigned long offset = bio->bi_sector * hardsect_size; /* not sure */ 
-  	char *buffer;
+	DECLARE_BITMAP(stripes, SBULL_MAX_STRIPES);
+	int write = bio_data_dir(bio) == WRITE; /* discards too */
 	int res;
 
-	/* Do each segment independently. */
-	bio_for_each_segment(bvec, bio, i) {
-    		bio->bi_idx = i;
-		buffer = __bio_kmap_atomic(bio, i, KM_USER0);
-		res = sbull_transfer(dev, offset, bio_cur_bytes(bio),
-				buffer, bio_data_dir(bio) == WRITE,
-				bio->bi_session_key);
-		if (res) return 1;
-		offset += bio_cur_bytes(bio);
-		__bio_kunmap_atomic(bio, KM_USER0);
+	res = sbull_fault(dev, bio);
+	if (res)
+		return res;
+	if (bio->bi_rw & REQ_FLUSH) {
+		res = dev->backend->flush(dev);
+		if (res || !bio->bi_size)
+			return res;
 	}
-	return 0; /* Always "succeed" */
+	sbull_stripes(dev, (u64) bio->bi_sector * KERNEL_SECTOR_SIZE,
+			bio->bi_size, stripes);
+	sbull_lock_range(dev, stripes, write);
+	res = sbull_do_bio(dev, bio);
+	sbull_unlock_range(dev, stripes, write);
+	if (!res && (bio->bi_rw & REQ_FUA))
+		res = dev->backend->flush(dev);
+	return res;
+}
+
+/*
+ * trace_*_enabled() came after 3.2: look at the tracepoint's jump
+ * label directly, so that with tracing and the latency model off, and
+ * no session to account to, we don't read the clock.
+ */
+static inline ktime_t sbull_trace_stamp(struct sbull_dev *dev)
+{
+	if (static_branch(&__tracepoint_sbull_bio_complete.key) ||
+			dev->lat_on ||
+			(session_stats && ACCESS_ONCE(dev->nr_sessions)))
+		return ktime_get();
+	return ktime_set(0, 0);
 }
 
 /*
@@ -155,12 +3453,112 @@ static int sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio)
 static void sbull_make_request(struct request_queue *q, struct bio *bio)
 {
 	struct sbull_dev *dev = q->queuedata;
+	ktime_t start;
 	int status;
 
-	printk(">>>>> sbull_make_request: session_key = %lu\n", bio->bi_session_key);
+	sbull_session_throttle(dev, bio);
+	start = sbull_trace_stamp(dev);
+	trace_sbull_bio_submit(dev->gd, bio);
 	status = sbull_xfer_bio(dev, bio);
-	bio_endio(bio, status);
-	printk("<<<<<<< sbull_make_request\n");
+	sbull_complete(dev, bio, status, start);
+}
+
+/*
+ * The multiqueue version. Each CPU submits to its own hardware queue,
+ * so submitters don't share a lock, and a queue is run as one batch.
+ */
+static void sbull_run_hw_queue(struct sbull_hw_queue *hwq)
+{
+	struct bio_list bios, done;
+	struct bio *bio;
+	unsigned long flags;
+	ktime_t start;
+	int err;
+
+	bio_list_init(&bios);
+	bio_list_init(&done);
+	spin_lock_irqsave(&hwq->lock, flags);
+	bio_list_merge(&bios, &hwq->bios);
+	bio_list_init(&hwq->bios);
+	hwq->queued = 0;
+	start = hwq->stamp;
+	spin_unlock_irqrestore(&hwq->lock, flags);
+
+	/*
+	 * Complete the batch only after all the copying is over; a bio
+	 * that failed ends right away, with its own error. The latency
+	 * traced (and modelled) is that of the oldest bio in the batch.
+	 */
+	while ((bio = bio_list_pop(&bios)) != NULL) {
+		err = sbull_xfer_bio(hwq->dev, bio);
+		if (err)
+			sbull_complete(hwq->dev, bio, err, start);
+		else
+			bio_list_add(&done, bio);
+	}
+	while ((bio = bio_list_pop(&done)) != NULL)
+		sbull_complete(hwq->dev, bio, 0, start);
+}
+
+static void sbull_hw_queue_work(struct work_struct *work)
+{
+	sbull_run_hw_queue(container_of(work, struct sbull_hw_queue, work));
+}
+
+static void sbull_mq_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct sbull_dev *dev = q->queuedata;
+	struct sbull_hw_queue *hwq;
+	unsigned long flags;
+	int cpu, full;
+
+	sbull_session_throttle(dev, bio);
+	trace_sbull_bio_submit(dev->gd, bio);
+	cpu = get_cpu();
+	hwq = dev->hw_queues + cpu % dev->nr_hw_queues;
+	spin_lock_irqsave(&hwq->lock, flags);
+	if (bio_list_empty(&hwq->bios))
+		hwq->stamp = sbull_trace_stamp(dev);
+	bio_list_add(&hwq->bios, bio);
+	full = ++hwq->queued >= queue_depth;
+	spin_unlock_irqrestore(&hwq->lock, flags);
+	put_cpu();
+
+	/*
+	 * A full queue is run by the submitter, which throttles it the
+	 * way running out of tags would; otherwise kick the worker. A
+	 * backend that does block I/O of its own can't be run here: the
+	 * bios it submits would only be sent once we return.
+	 */
+	if (full && !dev->backend->blocking)
+		sbull_run_hw_queue(hwq);
+	else
+		queue_work_on(hwq->cpu, sbull_wq, &hwq->work);
+}
+
+static int sbull_init_hw_queues(struct sbull_dev *dev)
+{
+	int i, cpu;
+
+	dev->nr_hw_queues = nr_hw_queues > 0 ? nr_hw_queues : nr_cpu_ids;
+	dev->hw_queues = kzalloc(dev->nr_hw_queues *
+			sizeof(struct sbull_hw_queue), GFP_KERNEL);
+	if (!dev->hw_queues)
+		return -ENOMEM;
+	cpu = cpumask_first(cpu_online_mask);
+	for (i = 0; i < dev->nr_hw_queues; i++) {
+		struct sbull_hw_queue *hwq = dev->hw_queues + i;
+
+		spin_lock_init(&hwq->lock);
+		bio_list_init(&hwq->bios);
+		INIT_WORK(&hwq->work, sbull_hw_queue_work);
+		hwq->dev = dev;
+		hwq->cpu = cpu;
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+	return 0;
 }
 
 /*
@@ -169,13 +3567,16 @@ static void sbull_make_request(struct request_queue *q, struct bio *bio)
 static int sbull_open(struct block_device *blk_dev, fmode_t mod)
 {
 	struct sbull_dev *dev = SBULL_DEV(blk_dev);
+	int first;
 
-	del_timer_sync(&dev->timer);
 	spin_lock(&dev->lock);
-	if (! dev->users) 
-		check_disk_change(blk_dev);
-	dev->users++;
+	first = !dev->users++;
+	if (first && dev->pgens && time_after(jiffies,
+			dev->idle_since + media_idle_secs * HZ))
+		dev->media_change = 1;
 	spin_unlock(&dev->lock);
+	if (first && dev->media_change)
+		check_disk_change(blk_dev);
 	return 0;
 }
 
@@ -184,12 +3585,8 @@ static int sbull_release(struct gendisk* gd, fmode_t mod)
 	struct sbull_dev *dev = gd->private_data;
 
 	spin_lock(&dev->lock);
-	dev->users--;
-
-	if (!dev->users) {
-		dev->timer.expires = jiffies + INVALIDATE_DELAY;
-		add_timer(&dev->timer);
-	}
+	if (!--dev->users)
+		dev->idle_since = jiffies;
 	spin_unlock(&dev->lock);
 
 	return 0;
@@ -206,8 +3603,12 @@ int sbull_media_changed(struct gendisk *gd)
 }
 
 /*
- * Revalidate.  WE DO NOT TAKE THE LOCK HERE, for fear of deadlocking
- * with open.  That needs to be reevaluated.
+ * Revalidate: a new, empty medium. Nobody else has the device open.
+ * Stores that only hold what was written (sparse, compressed, dedup)
+ * are just cleared, which gives their memory back. The flat and huge
+ * stores would have to be memset: there the data is forgotten by
+ * moving to a new generation, and only when the generations wrap
+ * around is it really cleared.
  */
 int sbull_revalidate(struct gendisk *gd)
 {
@@ -215,27 +3616,20 @@ int sbull_revalidate(struct gendisk *gd)
 	
 	if (dev->media_change) {
 		dev->media_change = 0;
-		memset (dev->data, 0, dev->size);
+		if (dev->backend->flush)
+			return 0; /* Same medium, back in */
+		if (!dev->backend->lazy_zero)
+			dev->backend->clear(dev);
+		else if (++dev->gen == 0) {
+			dev->backend->clear(dev);
+			memset(dev->pgens, 0, DIV_ROUND_UP(dev->size,
+					PAGE_SIZE) * sizeof(u16));
+		}
+		sbull_uidmap_reset(&dev->uids);
 	}
 	return 0;
 }
 
-/*
- * The "invalidate" function runs out of the device timer; it sets
- * a flag to simulate the removal of the media.
- */
-void sbull_invalidate(unsigned long ldev)
-{
-	struct sbull_dev *dev = (struct sbull_dev *) ldev;
-
-	spin_lock(&dev->lock);
-	if (dev->users || !dev->data) 
-		printk (KERN_WARNING "sbull: timer sanity check failed\n");
-	else
-		dev->media_change = 1;
-	spin_unlock(&dev->lock);
-}
-
 /*
  * The ioctl() implementation
  */
@@ -245,6 +3639,11 @@ int sbull_ioctl (struct block_device * blk_dev, fmode_t mod,
 {
 	long size;
 	struct hd_geometry geo;
+	struct sbull_session_req req;
+	struct sbull_session_limit lim;
+	struct sbull_session_stats st;
+	__u64 key;
+	int ret;
 	struct sbull_dev *dev = SBULL_DEV(blk_dev);
 
 	switch(cmd) {
@@ -255,7 +3654,7 @@ int sbull_ioctl (struct block_device * blk_dev, fmode_t mod,
 		 * and calculate the corresponding number of cylinders.  We set the
 		 * start of data at sector four.
 		 */
-		size = dev->size*(hardsect_size/KERNEL_SECTOR_SIZE);
+		size = dev->size / KERNEL_SECTOR_SIZE;
 		geo.cylinders = (size & ~0x3f) >> 6;
 		geo.heads = 4;
 		geo.sectors = 16;
@@ -263,6 +3662,46 @@ int sbull_ioctl (struct block_device * blk_dev, fmode_t mod,
 		if (copy_to_user((void __user *) arg, &geo, sizeof(geo)))
 			return -EFAULT;
 		return 0;
+
+	  case SBULL_IOCSESSION_CREATE:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&req, (void __user *) arg, sizeof(req)))
+			return -EFAULT;
+		ret = sbull_session_create(dev, &req);
+		if (ret)
+			return ret;
+		if (copy_to_user((void __user *) arg, &req, sizeof(req))) {
+			sbull_session_revoke(dev, req.key);
+			return -EFAULT;
+		}
+		return 0;
+
+	  case SBULL_IOCSESSION_REVOKE:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&key, (void __user *) arg, sizeof(key)))
+			return -EFAULT;
+		return sbull_session_revoke(dev, key);
+
+	  case SBULL_IOCSESSION_LIMIT:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&lim, (void __user *) arg, sizeof(lim)))
+			return -EFAULT;
+		return sbull_session_set_limit(dev, &lim);
+
+	  case SBULL_IOCSESSION_STATS:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&st, (void __user *) arg, sizeof(st.key)))
+			return -EFAULT;
+		ret = sbull_session_get_stats(dev, &st);
+		if (ret)
+			return ret;
+		if (copy_to_user((void __user *) arg, &st, sizeof(st)))
+			return -EFAULT;
+		return 0;
 	}
 
 	return -ENOTTY; /* unknown command */
@@ -284,42 +3723,432 @@ static struct block_device_operations sbull_ops = {
 
 
 /*
- * Set up our internal device.
+ * Statistics and test knobs in /sys/block/sbullX/sbull/. Byte counts
+ * are what the backing store holds for the data, not counting its own
+ * metadata.
+ */
+static struct sbull_dev *sbull_dev_of(struct device *d)
+{
+	return dev_to_disk(d)->private_data;
+}
+
+static ssize_t sbull_show_backing(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", sbull_dev_of(d)->backend->name);
+}
+
+static ssize_t sbull_show_orig_data_size(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct sbull_dev *dev = sbull_dev_of(d);
+
+	size_t i, placed = 0;
+
+	if (dev->backend == &sbull_flat_backend)
+		return sprintf(buf, "%llu\n", dev->size);
+	if (dev->backend == &sbull_huge_backend) {
+		for (i = 0; i < DIV_ROUND_UP(dev->size, SBULL_HCHUNK); i++)
+			if (ACCESS_ONCE(dev->hchunks[i]))
+				placed++;
+		return sprintf(buf, "%llu\n", (u64) placed * SBULL_HCHUNK);
+	}
+	return sprintf(buf, "%lu\n",
+			atomic_long_read(&dev->nr_pages) << PAGE_SHIFT);
+}
+
+static ssize_t sbull_show_compr_data_size(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct sbull_dev *dev = sbull_dev_of(d);
+
+	if (dev->backend == &sbull_dedup_backend)
+		return sprintf(buf, "%lu\n", dev->unique_pages << PAGE_SHIFT);
+	if (dev->backend != &sbull_compressed_backend)
+		return sbull_show_orig_data_size(d, attr, buf);
+	return sprintf(buf, "%lu\n", atomic_long_read(&dev->compr_bytes));
+}
+
+static ssize_t sbull_show_zero_pages(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n",
+			atomic_long_read(&sbull_dev_of(d)->zero_pages));
+}
+
+static ssize_t sbull_show_same_pages(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n",
+			atomic_long_read(&sbull_dev_of(d)->same_pages));
+}
+
+/*
+ * File: cached pages not yet written back.
+ */
+static ssize_t sbull_show_dirty_pages(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n",
+			atomic_long_read(&sbull_dev_of(d)->dirty_pages));
+}
+
+/*
+ * Dedup: pages written over pages actually stored, and the mean cost
+ * of hashing a page.
+ */
+static ssize_t sbull_show_dedup_ratio(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct sbull_dev *dev = sbull_dev_of(d);
+	unsigned long logical = atomic_long_read(&dev->nr_pages);
+	unsigned long unique = dev->unique_pages;
+
+	if (!unique)
+		return sprintf(buf, "1.00\n");
+	return sprintf(buf, "%lu.%02lu\n", logical / unique,
+			logical % unique * 100 / unique);
+}
+
+static ssize_t sbull_show_hash_ns(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct sbull_dev *dev = sbull_dev_of(d);
+	unsigned long pages = atomic_long_read(&dev->hashed_pages);
+
+	return sprintf(buf, "%llu\n", pages ? div64_u64(
+			atomic64_read(&dev->hash_ns), pages) : 0ULL);
+}
+
+/*
+ * The latency model: a time in ns for each of reads, writes, the
+ * queue depth term and the random part, and the distribution of the
+ * latter ("fixed", "uniform" or "exp").
+ */
+static void sbull_lat_update(struct sbull_dev *dev)
+{
+	struct sbull_latency *lat = &dev->lat;
+
+	dev->lat_on = lat->ns[READ] || lat->ns[WRITE] || lat->qd_ns ||
+		(lat->jitter_ns && lat->dist != SBULL_LAT_FIXED);
+}
+
+#define SBULL_LAT_ATTR(_name, _field)					\
+static ssize_t sbull_show_##_name(struct device *d,			\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	return sprintf(buf, "%llu\n", sbull_dev_of(d)->lat._field);	\
+}									\
+									\
+static ssize_t sbull_store_##_name(struct device *d,			\
+		struct device_attribute *attr, const char *buf,		\
+		size_t count)						\
+{									\
+	struct sbull_dev *dev = sbull_dev_of(d);			\
+	unsigned long long ns;						\
+									\
+	if (kstrtoull(buf, 0, &ns) || ns > UINT_MAX)			\
+		return -EINVAL;						\
+	dev->lat._field = ns;						\
+	sbull_lat_update(dev);						\
+	return count;							\
+}									\
+static DEVICE_ATTR(_name, S_IRUGO | S_IWUSR, sbull_show_##_name,	\
+		sbull_store_##_name)
+
+SBULL_LAT_ATTR(latency_read_ns, ns[READ]);
+SBULL_LAT_ATTR(latency_write_ns, ns[WRITE]);
+SBULL_LAT_ATTR(latency_qd_ns, qd_ns);
+SBULL_LAT_ATTR(latency_jitter_ns, jitter_ns);
+
+static const char *sbull_lat_dists[] = { "fixed", "uniform", "exp" };
+
+static ssize_t sbull_show_latency_dist(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", sbull_lat_dists[sbull_dev_of(d)->lat.dist]);
+}
+
+static ssize_t sbull_store_latency_dist(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct sbull_dev *dev = sbull_dev_of(d);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sbull_lat_dists); i++)
+		if (sysfs_streq(buf, sbull_lat_dists[i])) {
+			dev->lat.dist = i;
+			sbull_lat_update(dev);
+			return count;
+		}
+	return -EINVAL;
+}
+
+/*
+ * The fault table, one fault per line:
+ *
+ *	add <start> <end> <r|w|rw> [<errno> [<percent>]]
+ *	del <start>
+ *	clear
+ *
+ * Sectors are 512-byte ones, [start, end); errno defaults to EIO and
+ * percent to 100.
+ */
+static ssize_t sbull_show_faults(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct sbull_dev *dev = sbull_dev_of(d);
+	struct sbull_fault *f;
+	ssize_t len = 0;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(f, &dev->faults, list) {
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				"%llu %llu %s%s %d %u\n",
+				(unsigned long long) f->start,
+				(unsigned long long) f->end,
+				f->rw & SBULL_FAULT_READ ? "r" : "",
+				f->rw & SBULL_FAULT_WRITE ? "w" : "",
+				-f->error, f->percent);
+		if (len >= PAGE_SIZE - 1)
+			break;
+	}
+	rcu_read_unlock();
+	return len;
+}
+
+static ssize_t sbull_store_faults(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct sbull_dev *dev = sbull_dev_of(d);
+	unsigned long long start, end;
+	struct sbull_fault *f, *n;
+	int error = EIO, found = 0;
+	unsigned int percent = 100;
+	char rw[3];
+
+	if (sysfs_streq(buf, "clear")) {
+		sbull_faults_clear(dev);
+		return count;
+	}
+	if (sscanf(buf, "del %llu", &start) == 1) {
+		spin_lock(&dev->fault_lock);
+		list_for_each_entry_safe(f, n, &dev->faults, list)
+			if (f->start == start) {
+				list_del_rcu(&f->list);
+				kfree_rcu(f, rcu);
+				found = 1;
+			}
+		spin_unlock(&dev->fault_lock);
+		return found ? count : -ENOENT;
+	}
+	if (sscanf(buf, "add %llu %llu %2s %d %u", &start, &end, rw, &error,
+			&percent) < 3 || start >= end || error <= 0 ||
+			error >= MAX_ERRNO)
+		return -EINVAL;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+	f->start = start;
+	f->end = end;
+	if (strchr(rw, 'r'))
+		f->rw |= SBULL_FAULT_READ;
+	if (strchr(rw, 'w'))
+		f->rw |= SBULL_FAULT_WRITE;
+	f->error = -error;
+	f->percent = percent;
+	if (!f->rw) {
+		kfree(f);
+		return -EINVAL;
+	}
+	spin_lock(&dev->fault_lock);
+	list_add_tail_rcu(&f->list, &dev->faults);
+	spin_unlock(&dev->fault_lock);
+	return count;
+}
+
+/*
+ * Huge: huge chunks on each node, as "node<N> <chunks>" lines, then
+ * the chunks that fell back to vmalloc, whose node we don't know, and
+ * the chunks not placed yet.
+ */
+static ssize_t sbull_show_numa_placement(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct sbull_dev *dev = sbull_dev_of(d);
+	size_t i, nr = DIV_ROUND_UP(dev->size, SBULL_HCHUNK);
+	unsigned long huge, small = 0, missing = 0;
+	struct sbull_hchunk *chunk;
+	ssize_t len = 0;
+	int node;
+
+	if (!dev->hchunks)
+		return sprintf(buf, "none\n");
+	for (i = 0; i < nr; i++) {
+		chunk = ACCESS_ONCE(dev->hchunks[i]);
+		if (!chunk)
+			missing++;
+		else if (!chunk->huge)
+			small++;
+	}
+	for_each_online_node(node) {
+		huge = 0;
+		for (i = 0; i < nr; i++) {
+			chunk = ACCESS_ONCE(dev->hchunks[i]);
+			if (chunk && chunk->huge && chunk->node == node)
+				huge++;
+		}
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				"node%d %lu\n", node, huge);
+	}
+	len += scnprintf(buf + len, PAGE_SIZE - len,
+			"vmalloc %lu\nunplaced %lu\n", small, missing);
+	return len;
+}
+
+static DEVICE_ATTR(backing, S_IRUGO, sbull_show_backing, NULL);
+static DEVICE_ATTR(orig_data_size, S_IRUGO, sbull_show_orig_data_size, NULL);
+static DEVICE_ATTR(compr_data_size, S_IRUGO, sbull_show_compr_data_size, NULL);
+static DEVICE_ATTR(same_pages, S_IRUGO, sbull_show_same_pages, NULL);
+static DEVICE_ATTR(zero_pages, S_IRUGO, sbull_show_zero_pages, NULL);
+static DEVICE_ATTR(numa_placement, S_IRUGO, sbull_show_numa_placement, NULL);
+static DEVICE_ATTR(latency_dist, S_IRUGO | S_IWUSR, sbull_show_latency_dist,
+		sbull_store_latency_dist);
+static DEVICE_ATTR(faults, S_IRUGO | S_IWUSR, sbull_show_faults,
+		sbull_store_faults);
+static DEVICE_ATTR(dirty_pages, S_IRUGO, sbull_show_dirty_pages, NULL);
+static DEVICE_ATTR(dedup_ratio, S_IRUGO, sbull_show_dedup_ratio, NULL);
+static DEVICE_ATTR(hash_ns_per_page, S_IRUGO, sbull_show_hash_ns, NULL);
+
+static struct attribute *sbull_attrs[] = {
+	&dev_attr_backing.attr,
+	&dev_attr_orig_data_size.attr,
+	&dev_attr_compr_data_size.attr,
+	&dev_attr_same_pages.attr,
+	&dev_attr_zero_pages.attr,
+	&dev_attr_dedup_ratio.attr,
+	&dev_attr_hash_ns_per_page.attr,
+	&dev_attr_dirty_pages.attr,
+	&dev_attr_numa_placement.attr,
+	&dev_attr_latency_read_ns.attr,
+	&dev_attr_latency_write_ns.attr,
+	&dev_attr_latency_qd_ns.attr,
+	&dev_attr_latency_jitter_ns.attr,
+	&dev_attr_latency_dist.attr,
+	&dev_attr_faults.attr,
+	NULL,
+};
+
+static struct attribute_group sbull_attr_group = {
+	.name  = "sbull",
+	.attrs = sbull_attrs,
+};
+
+/*
+ * Set up our internal device. On failure, whatever was built is torn
+ * down again and the device is left empty for sbull_exit().
  */
-static void setup_device(struct sbull_dev *dev, int which)
+static int setup_device(struct sbull_dev *dev, int which)
 {
+	int err;
+
 	/*
 	 * Get some memory.
 	 */
 	memset (dev, 0, sizeof (struct sbull_dev));
-	dev->size = nsectors*hardsect_size;
-	dev->data = vmalloc(dev->size);
-	memset(dev->data, 0, dev->size);
-	dev->sector_uids = kmalloc(sizeof(unsigned short) * nsectors, GFP_KERNEL);
-	memset(dev->sector_uids, 0, sizeof(unsigned short) * nsectors);
-	dev->sessions = kmalloc(sizeof(unsigned short) * 2, GFP_KERNEL);
-	dev->sessions[0] = 0;
-	dev->sessions[1] = 1;
-	if (dev->data == NULL) {
-		printk (KERN_NOTICE "vmalloc failure.\n");
-		return;
+	dev->size = (u64) nsectors*hardsect_size;
+	INIT_LIST_HEAD(&dev->delayed_done);
+	spin_lock_init(&dev->delayed_lock);
+	INIT_WORK(&dev->delayed_reap, sbull_delayed_reap);
+	switch (backing) {
+	case SBULL_BACKING_SPARSE:
+		dev->backend = &sbull_sparse_backend;
+		break;
+	case SBULL_BACKING_COMPRESSED:
+		dev->backend = &sbull_compressed_backend;
+		break;
+	case SBULL_BACKING_DEDUP:
+		dev->backend = &sbull_dedup_backend;
+		break;
+	case SBULL_BACKING_FILE:
+		dev->backend = &sbull_file_backend;
+		break;
+	case SBULL_BACKING_HUGE:
+		dev->backend = &sbull_huge_backend;
+		break;
+	default:
+		dev->backend = &sbull_flat_backend;
+	}
+	err = dev->backend->init(dev);
+	if (err) {
+		printk (KERN_NOTICE "sbull: %s backing failure.\n",
+				dev->backend->name);
+		dev->backend = NULL;
+		return err;
+	}
+	err = -ENOMEM;
+	if (sbull_uidmap_init(&dev->uids)) {
+		printk (KERN_NOTICE "sbull: can't allocate the uid array.\n");
+		goto out_backend;
+	}
+	if (sbull_sessions_init(dev)) {
+		printk (KERN_NOTICE "sbull: can't allocate the session table.\n");
+		goto out_uids;
 	}
+	if (sbull_stripes_init(dev)) {
+		printk (KERN_NOTICE "sbull: can't allocate the range locks.\n");
+		goto out_sessions;
+	}
+	if (dev->backend == &sbull_file_backend &&
+			(err = sbull_file_restore(dev)) != 0) {
+		printk (KERN_NOTICE "sbull: can't restore the uid map.\n");
+		goto out_stripes;
+	}
+	err = -ENOMEM;
 	spin_lock_init(&dev->lock);
-	
-	/*
-	 * The timer which "invalidates" the device.
-	 */
-	init_timer(&dev->timer);
-	dev->timer.data = (unsigned long) dev;
-	dev->timer.function = sbull_invalidate;
+	INIT_LIST_HEAD(&dev->faults);
+	spin_lock_init(&dev->fault_lock);
+	dev->zeromap = vzalloc(BITS_TO_LONGS(DIV_ROUND_UP(dev->size,
+			PAGE_SIZE)) * sizeof(long));
+	if (!dev->zeromap)
+		goto out_stripes;
+	if (dev->backend->lazy_zero) {
+		bitmap_fill(dev->zeromap, DIV_ROUND_UP(dev->size, PAGE_SIZE));
+		atomic_long_set(&dev->zero_pages,
+				DIV_ROUND_UP(dev->size, PAGE_SIZE));
+	}
+	if (removable) {
+		dev->pgens = vzalloc(DIV_ROUND_UP(dev->size, PAGE_SIZE) *
+				sizeof(u16));
+		if (!dev->pgens)
+			goto out_zeromap;
+		dev->idle_since = jiffies;
+	}
 	
   dev->queue = blk_alloc_queue(GFP_KERNEL);
   if (dev->queue == NULL)
-    goto out_vfree;
-  blk_queue_make_request(dev->queue, sbull_make_request);
-  /* This function is no longer available in Linux 2.6.32.
-   * A possible replacement is blk_queue_physical_block_size()
-   * blk_queue_hardsect_size(dev->queue, hardsect_size); */
+    goto out_pgens;
+  if (queue_mode == QM_MQ) {
+	if (sbull_init_hw_queues(dev))
+		goto out_queue;
+	blk_queue_make_request(dev->queue, sbull_mq_make_request);
+  } else
+	blk_queue_make_request(dev->queue, sbull_make_request);
+	/* Discarded sectors read back as zeros, whatever the backing */
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, dev->queue);
+	dev->queue->limits.discard_granularity = PAGE_SIZE;
+	dev->queue->limits.discard_zeroes_data = 1;
+	blk_queue_max_discard_sectors(dev->queue, UINT_MAX);
+	if (dev->backend->flush)
+		blk_queue_flush(dev->queue, REQ_FLUSH | REQ_FUA);
+	blk_queue_logical_block_size(dev->queue, hardsect_size);
+	blk_queue_physical_block_size(dev->queue, physical_block_size);
+	blk_queue_io_min(dev->queue, physical_block_size);
+	if (io_opt)
+		blk_queue_io_opt(dev->queue, io_opt);
+	blk_queue_max_hw_sectors(dev->queue, max_sectors);
+	blk_queue_max_segments(dev->queue, max_segments);
 	dev->queue->queuedata = dev;
 	/*
 	 * And the gendisk structure.
@@ -327,28 +4156,70 @@ static void setup_device(struct sbull_dev *dev, int which)
 	dev->gd = alloc_disk(SBULL_MINORS);
 	if (! dev->gd) {
 		printk (KERN_NOTICE "alloc_disk failure\n");
-		goto out_vfree;
+		goto out_hw_queues;
 	}
 	dev->gd->major = sbull_major;
 	dev->gd->first_minor = which*SBULL_MINORS;
 	dev->gd->fops = &sbull_ops;
 	dev->gd->queue = dev->queue;
 	dev->gd->private_data = dev;
+	if (removable)
+		dev->gd->flags |= GENHD_FL_REMOVABLE;
 	snprintf (dev->gd->disk_name, DISK_NAME_LEN, "sbull%c", which + 'a');
-	set_capacity(dev->gd, nsectors*(hardsect_size/KERNEL_SECTOR_SIZE));
+	set_capacity(dev->gd, (sector_t) nsectors*(hardsect_size/KERNEL_SECTOR_SIZE));
 	add_disk(dev->gd);
-	return;
+	if (sysfs_create_group(&disk_to_dev(dev->gd)->kobj, &sbull_attr_group))
+		printk (KERN_NOTICE "sbull: can't create the sysfs attributes\n");
+	return 0;
 
-  out_vfree:
-	if (dev->data)
-		vfree(dev->data);
+  out_hw_queues:
+	kfree(dev->hw_queues);
+	dev->hw_queues = NULL;
+  out_queue:
+	blk_put_queue(dev->queue);
+	dev->queue = NULL;
+  out_pgens:
+	vfree(dev->pgens);
+	dev->pgens = NULL;
+  out_zeromap:
+	vfree(dev->zeromap);
+	dev->zeromap = NULL;
+  out_stripes:
+	kfree(dev->stripes);
+	dev->stripes = NULL;
+  out_sessions:
+	sbull_sessions_destroy(dev);
+  out_uids:
+	sbull_uidmap_destroy(&dev->uids);
+  out_backend:
+	dev->backend->destroy(dev);
+	dev->backend = NULL;
+	return err;
 }
 
 
 
+/*
+ * The devices are set up in parallel: with big disks most of the time
+ * goes into allocating their memory.
+ */
+static LIST_HEAD(sbull_async_domain);
+
+static void sbull_setup_async(void *data, async_cookie_t cookie)
+{
+	struct sbull_dev *dev = data;
+	int which = dev - Devices;
+	int err = setup_device(dev, which);
+
+	dev->setup_err = err;
+	if (err)
+		printk(KERN_WARNING "sbull: can't set up sbull%c (%d)\n",
+				which + 'a', err);
+}
+
 static int __init sbull_init(void)
 {
-	int i;
+	int i, up, err = -ENOMEM;
 
 #ifndef CONFIG_FS_TSSD
 	printk(KERN_WARNING "sbull: TrustedSSD is not enabled");
@@ -364,19 +4235,86 @@ static int __init sbull_init(void)
 		return -EBUSY;
 	}
 	/*
-	 * Allocate the device array, and initialize each one.
+	 * Allocate the device array, and initialize each one. The file
+	 * backing reads and writes the host file, and that I/O can't
+	 * complete while we are inside make_request (it would wait on
+	 * current->bio_list): like loop, it is only done by the workers.
 	 */
+	if (backing == SBULL_BACKING_FILE)
+		queue_mode = QM_MQ;
+	if (queue_mode == QM_MQ) {
+		sbull_wq = alloc_workqueue("sbull", WQ_HIGHPRI | WQ_CPU_INTENSIVE |
+				WQ_MEM_RECLAIM, 0);
+		if (sbull_wq == NULL)
+			goto out_unregister;
+	}
+	/*
+	 * Block sizes are powers of two from 512 to a page, since the
+	 * backends work a page at a time.
+	 */
+	if (hardsect_size < KERNEL_SECTOR_SIZE || hardsect_size > PAGE_SIZE ||
+			!is_power_of_2(hardsect_size))
+		hardsect_size = KERNEL_SECTOR_SIZE;
+	if (physical_block_size < hardsect_size ||
+			physical_block_size > PAGE_SIZE ||
+			!is_power_of_2(physical_block_size))
+		physical_block_size = hardsect_size;
+	if (max_sectors < PAGE_SIZE / KERNEL_SECTOR_SIZE)
+		max_sectors = 1024;
+	if (max_segments < 1)
+		max_segments = 128;
+	if (io_opt < 0 || io_opt % physical_block_size)
+		io_opt = 0;
+	if (ndevices < 1 || ndevices > 26)
+		ndevices = 1;
+	if (max_extents <= 0)
+		max_extents = nsectors / 32;
+	if (nr_stripes < 1 || nr_stripes > SBULL_MAX_STRIPES)
+		nr_stripes = 64;
+	if (lock_region_kb < 1)
+		lock_region_kb = 1024;
+	/* Whole pages per region, for sbull_copy_lazy() */
+	lock_region_kb = roundup(lock_region_kb, PAGE_SIZE >> 10);
+	if (dedup_hash_bits < 4 || dedup_hash_bits > 24)
+		dedup_hash_bits = 14;
+	if (numa_node < 0 || numa_node >= MAX_NUMNODES ||
+			!node_online(numa_node))
+		numa_node = numa_node_id();
+	sbull_uid_select();
+	sbull_extent_cache = KMEM_CACHE(sbull_extent, 0);
+	if (sbull_extent_cache == NULL)
+		goto out_destroy;
+	if (backing == SBULL_BACKING_COMPRESSED && sbull_zstreams_alloc())
+		goto out_destroy;
 	Devices = kmalloc(ndevices*sizeof (struct sbull_dev), GFP_KERNEL);
 	if (Devices == NULL)
-		goto out_unregister;
-	for (i = 0; i < ndevices; i++) 
-		setup_device(Devices + i, i);
+		goto out_destroy;
+	for (i = 0; i < ndevices; i++)
+		async_schedule_domain(sbull_setup_async, Devices + i,
+				&sbull_async_domain);
+	async_synchronize_full_domain(&sbull_async_domain);
+	for (i = up = 0; i < ndevices; i++)
+		if (!Devices[i].setup_err)
+			up++;
+	if (!up) {
+		/* Each one already undid its own setup */
+		err = Devices[0].setup_err;
+		kfree(Devices);
+		Devices = NULL;
+		goto out_destroy;
+	}
     
 	return 0;
 
+  out_destroy:
+	sbull_zstreams_free();
+	if (sbull_extent_cache)
+		kmem_cache_destroy(sbull_extent_cache);
+	if (sbull_wq)
+		destroy_workqueue(sbull_wq);
   out_unregister:
-	unregister_blkdev(sbull_major, "sbd");
-	return -ENOMEM;
+	unregister_blkdev(sbull_major, "sbull");
+	return err;
 }
 
 static void sbull_exit(void)
@@ -386,19 +4324,45 @@ static void sbull_exit(void)
 	for (i = 0; i < ndevices; i++) {
 		struct sbull_dev *dev = Devices + i;
 
-		del_timer_sync(&dev->timer);
 		if (dev->gd) {
+			sysfs_remove_group(&disk_to_dev(dev->gd)->kobj,
+					&sbull_attr_group);
 			del_gendisk(dev->gd);
 			put_disk(dev->gd);
 		}
+		if (dev->hw_queues) {
+			flush_workqueue(sbull_wq);
+			kfree(dev->hw_queues);
+		}
+		/*
+		 * Bios still waiting for the latency model; then free
+		 * the timers, which waits out any callback still running.
+		 */
+		while (atomic_read(&dev->delayed))
+			msleep(1);
+		cancel_work_sync(&dev->delayed_reap);
+		sbull_delayed_reap(&dev->delayed_reap);
+		if (dev->backend)
+			sbull_faults_clear(dev);
 		if (dev->queue) {
       blk_put_queue(dev->queue);
 		}
-		if (dev->data)
-			vfree(dev->data);
+		if (dev->backend && dev->backend->flush && dev->gd)
+			dev->backend->flush(dev);
+		if (dev->backend)
+			dev->backend->destroy(dev);
+		sbull_uidmap_destroy(&dev->uids);
+		sbull_sessions_destroy(dev);
+		kfree(dev->stripes);
+		vfree(dev->pgens);
+		vfree(dev->zeromap);
 	}
 	unregister_blkdev(sbull_major, "sbull");
 	kfree(Devices);
+	kmem_cache_destroy(sbull_extent_cache);
+	sbull_zstreams_free();
+	if (sbull_wq)
+		destroy_workqueue(sbull_wq);
 }
 	
 module_init(sbull_init);
@@ -16,7 +16,66 @@
  */
 
 
+#ifndef _SBULL_H_
+#define _SBULL_H_
+
 #include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Ioctl definitions. They are issued on the block device; the ones
+ * that change state need CAP_SYS_ADMIN.
+ */
+
+/* Use 'B' as magic number */
+#define SBULL_IOC_MAGIC  'B'
+
+/*
+ * Sessions: a session key (what the filesystem puts in
+ * bio->bi_session_key) is bound to a uid, which owns the sectors
+ * written under that key. Create fills in the uid it picked. With the
+ * file backing, sessions are kept in the file's checkpoints and are
+ * there again after a reload (create then fails with EEXIST).
+ */
+struct sbull_session_req {
+	__u64 key;
+	__u16 uid;
+};
+
+/*
+ * Limits on what a session may do per second; 0 is no limit. I/O over
+ * the limit is delayed, not failed.
+ */
+struct sbull_session_limit {
+	__u64 key;
+	__u64 iops;
+	__u64 bps;		/* bytes per second */
+};
+
+/*
+ * What a session did since it was created. Latencies, from submission
+ * to completion, are counted in power-of-two buckets: lat_hist[i]
+ * holds those in [2^i, 2^(i+1)) ns, the last bucket anything longer.
+ */
+#define SBULL_LAT_BUCKETS	32
+
+struct sbull_session_stats {
+	__u64 key;		/* In */
+	__u64 reads, writes;
+	__u64 read_bytes, write_bytes;
+	__u64 denied;		/* Reads zero-filled: not its sectors */
+	__u64 throttled_ns;	/* Time spent waiting for the limits */
+	__u64 lat_hist[SBULL_LAT_BUCKETS];
+};
+
+#define SBULL_IOCSESSION_CREATE	_IOWR(SBULL_IOC_MAGIC, 1, struct sbull_session_req)
+#define SBULL_IOCSESSION_REVOKE	_IOW(SBULL_IOC_MAGIC,  2, __u64)
+#define SBULL_IOCSESSION_LIMIT	_IOW(SBULL_IOC_MAGIC,  3, struct sbull_session_limit)
+#define SBULL_IOCSESSION_STATS	_IOWR(SBULL_IOC_MAGIC, 4, struct sbull_session_stats)
+
+#define SBULL_IOC_MAXNR 4
+
+#ifdef __KERNEL__
 
 /* Multiqueue only works on 2.4 */
 #ifdef SBULL_MULTIQUEUE
@@ -69,3 +128,7 @@ typedef struct Sbull_Dev {
    int busy;
 #endif
 }              Sbull_Dev;
+
+#endif /* __KERNEL__ */
+
+#endif /* _SBULL_H_ */
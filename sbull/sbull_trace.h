@@ -0,0 +1,91 @@
+/*
+ * sbull_trace.h -- tracepoints for the sbull block driver
+ *
+ * They cost a not-taken branch while disabled; turn them on with
+ *
+ *	echo 1 > /sys/kernel/debug/tracing/events/sbull/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sbull
+
+#if !defined(_SBULL_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _SBULL_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include <linux/bio.h>
+
+TRACE_EVENT(sbull_bio_submit,
+
+	TP_PROTO(struct gendisk *gd, struct bio *bio),
+
+	TP_ARGS(gd, bio),
+
+	TP_STRUCT__entry(
+		__array(char, disk, DISK_NAME_LEN)
+		__field(sector_t, sector)
+		__field(unsigned int, size)
+		__field(int, write)
+		__field(unsigned long, session_key)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->disk, gd->disk_name, DISK_NAME_LEN);
+		__entry->sector = bio->bi_sector;
+		__entry->size = bio->bi_size;
+		__entry->write = bio_data_dir(bio) == WRITE;
+		__entry->session_key = bio->bi_session_key;
+	),
+
+	TP_printk("%s %c sector=%llu size=%u session=%lu",
+		__entry->disk, __entry->write ? 'W' : 'R',
+		(unsigned long long) __entry->sector, __entry->size,
+		__entry->session_key)
+);
+
+/*
+ * Fired just before bio_endio(). "start" is when the bio was
+ * submitted, or zero if the event was off at that time.
+ */
+TRACE_EVENT(sbull_bio_complete,
+
+	TP_PROTO(struct gendisk *gd, struct bio *bio, int error, ktime_t start),
+
+	TP_ARGS(gd, bio, error, start),
+
+	TP_STRUCT__entry(
+		__array(char, disk, DISK_NAME_LEN)
+		__field(sector_t, sector)
+		__field(unsigned int, size)
+		__field(int, write)
+		__field(unsigned long, session_key)
+		__field(int, error)
+		__field(s64, latency)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->disk, gd->disk_name, DISK_NAME_LEN);
+		__entry->sector = bio->bi_sector;
+		__entry->size = bio->bi_size;
+		__entry->write = bio_data_dir(bio) == WRITE;
+		__entry->session_key = bio->bi_session_key;
+		__entry->error = error;
+		__entry->latency = ktime_to_ns(start) ?
+			ktime_to_ns(ktime_sub(ktime_get(), start)) : 0;
+	),
+
+	TP_printk("%s %c sector=%llu size=%u session=%lu error=%d latency=%lldns",
+		__entry->disk, __entry->write ? 'W' : 'R',
+		(unsigned long long) __entry->sector, __entry->size,
+		__entry->session_key, __entry->error,
+		(long long) __entry->latency)
+);
+
+#endif /* _SBULL_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sbull_trace
+#include <trace/define_trace.h>
@@ -1,62 +1,897 @@
+/*
+ * test.cc -- exercise sbull sessions from user space
+ *
+ *   test read <dev> [key]            dump the device, as seen by "key"
+ *   test write <dev> <text> [key]    write "text" at offset 0
+ *   test bench [options] <dev>       measure, then check isolation
+ *   test stress [options] <dev>      check isolation under contention
+ *
+ * The session key of an open file is set with CMD_SESSION_KEY; every
+ * bio submitted through that file carries it. "bench" runs one job per
+ * key, each with its own file, in its own slice of the device, and
+ * prints one line of JSON:
+ *
+ *   -e engine    sync, libaio or io_uring           (default libaio)
+ *                (sync always has just one I/O in flight)
+ *   -q depth     I/Os in flight per job              (default 16)
+ *   -b bsize     bytes per I/O                       (default 4096)
+ *   -m percent   reads out of 100                    (default 70)
+ *   -t seconds   how long to run                     (default 10)
+ *   -k keys      comma-separated session keys        (default 1)
+ *   -s size      bytes of the device to use          (default all)
+ *   -S           create sessions for the keys first (needs root)
+ *   -V           afterwards, check that no key reads another's data
+ *
+ * Without -S the keys are legacy ones: only keys of different parity
+ * are isolated from each other, and -V expects just that.
+ *
+ * "stress" runs threads that share one range block by block and
+ * checks every block they read back (see stress_worker()):
+ *
+ *   -n threads   how many, with keys 1 to n          (default 4)
+ *   -k keys      or these keys, one thread each
+ *   -b bsize     bytes per block                     (default 4096)
+ *   -s size      bytes of the device to use          (default 64M)
+ *   -r rounds    write/read passes over the range    (default 10)
+ *   -S           as for bench
+ */
+
 #include <string.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <new>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <linux/fs.h>		/* BLKGETSIZE64 */
+#include <linux/aio_abi.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#include <new>
+#include <vector>
+#include <algorithm>
+
+#include "../sbull/sbull.h"
+
 #define CMD_SESSION_KEY      _IOW('f', 20, unsigned long)
 
 #define BUF_SIZE 512
+#define ALIGN 4096
 
-int normal_read(int argc, char** argv) {
-    if(argc < 2) return -1;
-    int fd = open(argv[1], O_RDONLY | O_DIRECT);
-    ioctl(fd, CMD_SESSION_KEY, 1);
-    
-    ///char buf[BUF_SIZE] = {0};
-    void* mem;
-    char* buf;
-    posix_memalign(&mem, 512, BUF_SIZE);
-    buf = new(mem) char[BUF_SIZE];
-
-    int cnt = read(fd, buf, BUF_SIZE);
-    if(cnt < 0) {
-	    printf("failed to read!\n");
-	    return 1;
-    }
-    printf("before while: cnt = %d\n", cnt);
-	    
-    while(cnt)
-    {
-	buf[cnt] = 0;
-        printf("%s", buf);
-	cnt = read(fd, buf, BUF_SIZE);
+static int set_key(int fd, unsigned long key)
+{
+    if (ioctl(fd, CMD_SESSION_KEY, key) < 0) {
+        fprintf(stderr, "CMD_SESSION_KEY %lu: %s\n", key, strerror(errno));
+        return -1;
     }
     return 0;
 }
 
-int user1_write(int argc, char** argv) {
-    if(argc < 3) return -1;
+static int open_key(const char *dev, int flags, unsigned long key)
+{
+    int fd = open(dev, flags);
 
-    int fd = open(argv[1], O_DIRECT | O_RDWR | O_CREAT);
-    ioctl(fd, CMD_SESSION_KEY, 1);
-   
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", dev, strerror(errno));
+        return -1;
+    }
+    if (set_key(fd, key)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static char *alloc_buf(size_t len)
+{
     void *mem;
-    char* buf;
-    posix_memalign(&mem, 512, BUF_SIZE);
-    buf = new(mem) char[BUF_SIZE];
-    strcpy(buf, argv[2]);
-    int cnt = write(fd, buf, strlen(argv[2]));
-    if(cnt > 0) return 0;
 
-    return -1;
+    if (posix_memalign(&mem, ALIGN, len))
+        return NULL;
+    return new(mem) char[len];
+}
+
+int normal_read(const char *dev, unsigned long key) {
+    int fd = open_key(dev, O_RDONLY | O_DIRECT, key);
+    char *buf = alloc_buf(BUF_SIZE + 1);
+    int cnt = -1;
+
+    if (fd < 0 || !buf)
+        goto out;
+    while ((cnt = read(fd, buf, BUF_SIZE)) > 0) {
+        buf[cnt] = 0;
+        printf("%s", buf);
+    }
+    if (cnt < 0)
+        printf("failed to read: %s\n", strerror(errno));
+  out:
+    free(buf);
+    if (fd >= 0)
+        close(fd);
+    return cnt < 0;
+}
+
+int user1_write(const char *dev, const char *text, unsigned long key) {
+    int fd = open_key(dev, O_DIRECT | O_RDWR, key);
+    char *buf = alloc_buf(BUF_SIZE);
+    int cnt = -1;
+
+    if (fd < 0 || !buf)
+        goto out;
+    /* O_DIRECT: always a whole block */
+    memset(buf, 0, BUF_SIZE);
+    strncpy(buf, text, BUF_SIZE);
+    cnt = write(fd, buf, BUF_SIZE);
+    if (cnt < 0)
+        printf("failed to write: %s\n", strerror(errno));
+  out:
+    free(buf);
+    if (fd >= 0)
+        close(fd);
+    return cnt != BUF_SIZE;
+}
+
+
+/*
+ * The benchmark.
+ */
+static const char *engine_name = "libaio";
+static int depth = 16;
+static long bsize = 4096;
+static int read_pct = 70;
+static double seconds = 10;
+static long long size;
+static std::vector<unsigned long> keys;
+static bool create_sessions, verify;
+static const char *dev;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct io {
+    char *buf;
+    long long off;
+    int write;
+    uint64_t t0;
+    long res;
+    struct iovec iov;
+    struct iocb cb;
+};
+
+/*
+ * Something that moves I/Os: submit() starts them, reap() waits for
+ * at least "min" of them to end and hands them back.
+ */
+class engine {
+public:
+    virtual ~engine() {}
+    virtual int init(int fd, int depth) = 0;
+    virtual int submit(io **ios, int n) = 0;
+    virtual int reap(io **done, int min, int max) = 0;
+};
+
+/* pread/pwrite: the I/O is over by the time submit() returns */
+class sync_engine : public engine {
+    int fd;
+    std::vector<io *> over;
+public:
+    int init(int f, int) { fd = f; return 0; }
+    int submit(io **ios, int n) {
+        for (int i = 0; i < n; i++) {
+            io *o = ios[i];
+            o->res = o->write ? pwrite(fd, o->buf, bsize, o->off) :
+                pread(fd, o->buf, bsize, o->off);
+            if (o->res < 0)
+                o->res = -errno;
+            over.push_back(o);
+        }
+        return 0;
+    }
+    int reap(io **done, int, int max) {
+        int n = std::min<int>(max, over.size());
+
+        std::copy(over.begin(), over.begin() + n, done);
+        over.erase(over.begin(), over.begin() + n);
+        return n;
+    }
+};
+
+/* Linux AIO, through the system calls so that libaio isn't needed */
+class aio_engine : public engine {
+    int fd;
+    aio_context_t ctx;
+    std::vector<io_event> events;
+public:
+    aio_engine() : ctx(0) {}
+    ~aio_engine() { if (ctx) syscall(__NR_io_destroy, ctx); }
+    int init(int f, int d) {
+        fd = f;
+        events.resize(d);
+        return syscall(__NR_io_setup, d, &ctx) < 0 ? -errno : 0;
+    }
+    int submit(io **ios, int n) {
+        std::vector<iocb *> cbs(n);
+
+        for (int i = 0; i < n; i++) {
+            io *o = ios[i];
+            memset(&o->cb, 0, sizeof(o->cb));
+            o->cb.aio_fildes = fd;
+            o->cb.aio_lio_opcode = o->write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+            o->cb.aio_buf = (uintptr_t) o->buf;
+            o->cb.aio_nbytes = bsize;
+            o->cb.aio_offset = o->off;
+            o->cb.aio_data = (uintptr_t) o;
+            cbs[i] = &o->cb;
+        }
+        for (int done = 0; done < n; ) {
+            long r = syscall(__NR_io_submit, ctx, n - done, &cbs[done]);
+            if (r < 0 && errno != EAGAIN && errno != EINTR)
+                return -errno;
+            if (r > 0)
+                done += r;
+        }
+        return 0;
+    }
+    int reap(io **done, int min, int max) {
+        long n;
+
+        do
+            n = syscall(__NR_io_getevents, ctx, min, max, &events[0], NULL);
+        while (n < 0 && errno == EINTR);
+        if (n < 0)
+            return -errno;
+        for (long i = 0; i < n; i++) {
+            done[i] = (io *) (uintptr_t) events[i].data;
+            done[i]->res = events[i].res;
+        }
+        return n;
+    }
+};
+
+#ifdef HAVE_IO_URING
+/* io_uring, also by hand: readv/writev, which every version has */
+class uring_engine : public engine {
+    int fd, ring;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+public:
+    uring_engine() : ring(-1) {}
+    ~uring_engine() { if (ring >= 0) close(ring); }
+    int init(int f, int d) {
+        io_uring_params p;
+        char *sq, *cq;
+        size_t sq_len, cq_len;
+
+        fd = f;
+        memset(&p, 0, sizeof(p));
+        ring = syscall(__NR_io_uring_setup, d, &p);
+        if (ring < 0)
+            return -errno;
+        sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        sq = (char *) mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        cq = (char *) mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        sqes = (io_uring_sqe *) mmap(NULL, p.sq_entries * sizeof(io_uring_sqe),
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring,
+                                     IORING_OFF_SQES);
+        if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+            return -errno;
+        sq_head = (unsigned *) (sq + p.sq_off.head);
+        sq_tail = (unsigned *) (sq + p.sq_off.tail);
+        sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+        sq_array = (unsigned *) (sq + p.sq_off.array);
+        cq_head = (unsigned *) (cq + p.cq_off.head);
+        cq_tail = (unsigned *) (cq + p.cq_off.tail);
+        cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe *) (cq + p.cq_off.cqes);
+        return 0;
+    }
+    int submit(io **ios, int n) {
+        unsigned tail = *sq_tail;
+
+        for (int i = 0; i < n; i++, tail++) {
+            io *o = ios[i];
+            unsigned idx = tail & *sq_mask;
+            io_uring_sqe *sqe = &sqes[idx];
+
+            o->iov.iov_base = o->buf;
+            o->iov.iov_len = bsize;
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = o->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t) &o->iov;
+            sqe->len = 1;
+            sqe->off = o->off;
+            sqe->user_data = (uintptr_t) o;
+            sq_array[idx] = idx;
+        }
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        for (int done = 0; done < n; ) {
+            long r = syscall(__NR_io_uring_enter, ring, n - done, 0, 0, NULL, 0);
+            if (r < 0 && errno != EINTR && errno != EAGAIN)
+                return -errno;
+            if (r > 0)
+                done += r;
+        }
+        return 0;
+    }
+    int reap(io **done, int min, int max) {
+        unsigned head = *cq_head;
+        int n = 0;
+
+        for (;;) {
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+            while (head != tail && n < max) {
+                io_uring_cqe *cqe = &cqes[head & *cq_mask];
+                done[n] = (io *) (uintptr_t) cqe->user_data;
+                done[n++]->res = cqe->res;
+                head++;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            if (n >= min)
+                return n;
+            if (syscall(__NR_io_uring_enter, ring, 0, min - n,
+                        IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                return -errno;
+        }
+    }
+};
+#endif
+
+static engine *new_engine(const char *name)
+{
+    if (!strcmp(name, "sync"))
+        return new sync_engine;
+    if (!strcmp(name, "libaio"))
+        return new aio_engine;
+#ifdef HAVE_IO_URING
+    if (!strcmp(name, "io_uring"))
+        return new uring_engine;
+#endif
+    return NULL;
+}
+
+/*
+ * What each block written holds: the key and the offset, so that a
+ * read can tell whose data it got.
+ */
+static void fill(char *buf, long len, unsigned long key, long long off)
+{
+    uint64_t *w = (uint64_t *) buf;
+
+    for (long i = 0; i < len / 8; i += 2) {
+        w[i] = key;
+        w[i + 1] = off + i * 8;
+    }
+}
+
+struct job {
+    unsigned long key;
+    long long start, len;	/* this job's slice */
+    std::vector<uint64_t> lat;	/* ns, one per I/O */
+    long long bytes;
+    long errors;
+    int err;
+};
+
+static void *bench_job(void *arg)
+{
+    job *j = (job *) arg;
+    long long nblocks = j->len / bsize;
+    unsigned int seed = j->key * 2654435761u;
+    uint64_t deadline;
+    std::vector<io> ios(depth);
+    std::vector<io *> batch(depth), done(depth);
+    engine *e = new_engine(engine_name);
+    int fd, i, n, inflight;
+
+    fd = open_key(dev, O_RDWR | O_DIRECT, j->key);
+    if (fd < 0 || !e || (j->err = e->init(fd, depth))) {
+        if (!j->err)
+            j->err = -EINVAL;
+        goto out;
+    }
+    for (i = 0; i < depth; i++) {
+        ios[i].buf = alloc_buf(bsize);
+        if (!ios[i].buf) {
+            j->err = -ENOMEM;
+            goto release;
+        }
+        fill(ios[i].buf, bsize, j->key, 0);
+        batch[i] = &ios[i];
+    }
+
+    /*
+     * Keep "depth" I/Os in flight: whatever ends is sent out again,
+     * somewhere else, until the time is up.
+     */
+    n = depth;
+    inflight = 0;
+    deadline = now_ns() + (uint64_t) (seconds * 1e9);
+    for (;;) {
+        uint64_t t = now_ns();
+
+        if (t < deadline) {
+            for (i = 0; i < n; i++) {
+                io *o = batch[i];
+                o->off = j->start +
+                    (long long) (rand_r(&seed) % nblocks) * bsize;
+                o->write = (int) (rand_r(&seed) % 100) >= read_pct;
+                o->t0 = t;
+            }
+            if ((j->err = e->submit(&batch[0], n)))
+                break;
+            inflight += n;
+        } else if (!inflight) {
+            break;
+        }
+        n = e->reap(&done[0], 1, depth);
+        if (n < 0) {
+            j->err = n;
+            break;
+        }
+        inflight -= n;
+        t = now_ns();
+        for (i = 0; i < n; i++) {
+            io *o = done[i];
+            j->lat.push_back(t - o->t0);
+            if (o->res == bsize)
+                j->bytes += bsize;
+            else
+                j->errors++;
+            batch[i] = o;
+        }
+    }
+    /* Don't free buffers the kernel may still be using */
+    if (j->err && inflight)
+        goto out;
+  release:
+    for (i = 0; i < depth; i++)
+        free(ios[i].buf);
+  out:
+    delete e;
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/*
+ * Whether one key must not see what another wrote: real sessions own
+ * their blocks, legacy keys only get uid "key & 1".
+ */
+static bool isolated_keys(unsigned long a, unsigned long b)
+{
+    return a != b && (create_sessions || ((a ^ b) & 1));
+}
+
+static uint64_t percentile(std::vector<uint64_t> &lat, double p)
+{
+    if (lat.empty())
+        return 0;
+    return lat[std::min(lat.size() - 1, (size_t) (p * lat.size()))];
+}
+
+/*
+ * Every key writes a block at the start of its slice; then every key
+ * reads every block. Its own must come back as written, the others as
+ * zeros where the keys are isolated.
+ */
+static int check_isolation(std::vector<job> &jobs)
+{
+    char *buf = alloc_buf(bsize), *want = alloc_buf(bsize);
+    long checked = 0, failures = 0;
+    size_t i, k;
+    int fd, ret = -1;
+
+    if (!buf || !want) {
+        fprintf(stderr, "isolation: out of memory\n");
+        goto out;
+    }
+    for (i = 0; i < jobs.size(); i++) {
+        fd = open_key(dev, O_RDWR | O_DIRECT, jobs[i].key);
+        if (fd < 0)
+            goto out;
+        fill(buf, bsize, jobs[i].key, jobs[i].start);
+        if (pwrite(fd, buf, bsize, jobs[i].start) != bsize) {
+            fprintf(stderr, "isolation: write: %s\n", strerror(errno));
+            close(fd);
+            goto out;
+        }
+        close(fd);
+    }
+    for (k = 0; k < jobs.size(); k++) {
+        fd = open_key(dev, O_RDONLY | O_DIRECT, jobs[k].key);
+        if (fd < 0)
+            goto out;
+        for (i = 0; i < jobs.size(); i++) {
+            bool isolated = i != k && isolated_keys(jobs[i].key, jobs[k].key);
+
+            if (pread(fd, buf, bsize, jobs[i].start) != bsize) {
+                fprintf(stderr, "isolation: read: %s\n", strerror(errno));
+                failures++;
+                continue;
+            }
+            if (isolated)
+                memset(want, 0, bsize);
+            else
+                fill(want, bsize, jobs[i].key, jobs[i].start);
+            checked++;
+            if (memcmp(buf, want, bsize)) {
+                fprintf(stderr, "isolation: key %lu reading key %lu's block "
+                        "got %s\n", jobs[k].key, jobs[i].key,
+                        isolated ? "data" : "something else");
+                failures++;
+            }
+        }
+        close(fd);
+    }
+    printf("{\"test\": \"isolation\", \"dev\": \"%s\", \"sessions\": %zu, "
+           "\"checked\": %li, \"failures\": %li}\n", dev, jobs.size(),
+           checked, failures);
+    ret = failures ? 1 : 0;
+  out:
+    free(buf);
+    free(want);
+    return ret;
+}
+
+static int sessions(int create)
+{
+    int fd = open(dev, O_RDONLY), ret = 0;
+
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", dev, strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < keys.size(); i++) {
+        struct sbull_session_req req;
+        __u64 key = keys[i];
+
+        memset(&req, 0, sizeof(req));
+        req.key = key;
+        if (create ? ioctl(fd, SBULL_IOCSESSION_CREATE, &req) :
+                ioctl(fd, SBULL_IOCSESSION_REVOKE, &key)) {
+            fprintf(stderr, "session %lu: %s\n", keys[i], strerror(errno));
+            ret = -1;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+/*
+ * Cap "size" at what the device has.
+ */
+static int dev_size(void)
+{
+    long long total;
+    int fd = open(dev, O_RDONLY);
+
+    if (fd < 0 || ioctl(fd, BLKGETSIZE64, &total) < 0) {
+        fprintf(stderr, "%s: %s\n", dev, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    if (!size || size > total)
+        size = total;
+    return 0;
+}
+
+static void parse_keys(char *arg)
+{
+    keys.clear();
+    for (char *k = strtok(arg, ","); k; k = strtok(NULL, ","))
+        keys.push_back(strtoul(k, NULL, 0));
+}
+
+static int bench(int argc, char **argv)
+{
+    std::vector<uint64_t> lat;
+    std::vector<pthread_t> tids;
+    std::vector<job> jobs;
+    long long bytes = 0, slice;
+    long errors = 0;
+    uint64_t t0, usec;
+    engine *probe;
+    int c, ret = 0;
+
+    keys.push_back(1);
+    while ((c = getopt(argc, argv, "e:q:b:m:t:k:s:SV")) != -1) {
+        switch (c) {
+        case 'e': engine_name = optarg; break;
+        case 'q': depth = atoi(optarg); break;
+        case 'b': bsize = strtol(optarg, NULL, 0); break;
+        case 'm': read_pct = atoi(optarg); break;
+        case 't': seconds = atof(optarg); break;
+        case 'k': parse_keys(optarg); break;
+        case 's': size = strtoll(optarg, NULL, 0); break;
+        case 'S': create_sessions = true; break;
+        case 'V': verify = true; break;
+        default: optind = argc; /* usage */
+        }
+    }
+    probe = new_engine(engine_name);
+    if (optind != argc - 1 || depth < 1 || bsize < 512 || bsize % 512 ||
+            keys.empty() || !probe) {
+        fprintf(stderr, "Usage: %s bench [-e sync|libaio|io_uring] [-q depth] "
+                "[-b bsize] [-m read%%] [-t seconds] [-k key,...] [-s size] "
+                "[-S] [-V] <device>\n", argv[0]);
+        return 1;
+    }
+    delete probe;
+    if (!strcmp(engine_name, "sync"))
+        depth = 1;		/* there is nothing else to have */
+    dev = argv[optind];
+    if (dev_size())
+        return 1;
+    slice = size / keys.size() / bsize * bsize;
+    if (slice < bsize) {
+        fprintf(stderr, "%s: too small for %zu jobs\n", dev, keys.size());
+        return 1;
+    }
+    if (create_sessions && sessions(1))
+        return 1;
+
+    jobs.resize(keys.size());
+    tids.resize(keys.size());
+    t0 = now_ns();
+    for (size_t i = 0; i < jobs.size(); i++) {
+        jobs[i].key = keys[i];
+        jobs[i].start = i * slice;
+        jobs[i].len = slice;
+        jobs[i].bytes = jobs[i].errors = jobs[i].err = 0;
+        pthread_create(&tids[i], NULL, bench_job, &jobs[i]);
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        pthread_join(tids[i], NULL);
+        if (jobs[i].err) {
+            fprintf(stderr, "key %lu: %s\n", jobs[i].key,
+                    strerror(-jobs[i].err));
+            ret = 1;
+        }
+        lat.insert(lat.end(), jobs[i].lat.begin(), jobs[i].lat.end());
+        bytes += jobs[i].bytes;
+        errors += jobs[i].errors;
+    }
+    usec = (now_ns() - t0) / 1000;
+    std::sort(lat.begin(), lat.end());
+
+    printf("{\"test\": \"bench\", \"dev\": \"%s\", \"engine\": \"%s\", "
+           "\"depth\": %d, \"bsize\": %li, \"read_pct\": %d, "
+           "\"sessions\": %zu, \"ios\": %zu, \"errors\": %li, "
+           "\"iops\": %.0f, \"MBps\": %.2f, \"lat_us\": {\"p50\": %.1f, "
+           "\"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}}\n",
+           dev, engine_name, depth, bsize, read_pct, jobs.size(), lat.size(),
+           errors, usec ? lat.size() * 1e6 / usec : 0.0,
+           usec ? (double) bytes / usec : 0.0,
+           percentile(lat, 0.50) / 1e3, percentile(lat, 0.90) / 1e3,
+           percentile(lat, 0.99) / 1e3, percentile(lat, 0.999) / 1e3,
+           lat.empty() ? 0.0 : lat.back() / 1e3);
+    fflush(stdout);
+
+    if (verify && check_isolation(jobs))
+        ret = 1;
+    if (create_sessions)
+        sessions(0);
+    return ret;
+}
+
+/*
+ * The stress test: N threads, one key each, sharing a range block by
+ * block (block b belongs to thread b % N), so that neighbouring
+ * blocks of different owners keep meeting in the same locks and uid
+ * extents. Every round, each thread writes all its blocks, then, once
+ * everybody has written, reads them back together with those of the
+ * next thread: its own must hold this round's pattern, the neighbour's
+ * must be zeros where the keys are isolated.
+ */
+static int rounds = 10;
+static long long stress_size = 64 << 20;
+static pthread_barrier_t phase;
+
+struct stress_job {
+    int nr, nthreads;
+    unsigned long key;
+    long long bytes;
+    long own_checked, cross_checked, failures;
+    int err;
+};
+
+static void *stress_worker(void *arg)
+{
+    stress_job *j = (stress_job *) arg;
+    long long nblocks = size / bsize, b, off;
+    int next = (j->nr + 1) % j->nthreads;
+    unsigned long next_key = keys[next];
+    bool isolated = isolated_keys(j->key, next_key);
+    char *buf = alloc_buf(bsize), *want = alloc_buf(bsize);
+    int fd, r;
+
+    fd = open_key(dev, O_RDWR | O_DIRECT, j->key);
+    if (fd < 0)
+        j->err = -EINVAL;
+    else if (!buf || !want)
+        j->err = -ENOMEM;
+    /* even failed, keep meeting the others at the barriers */
+    for (r = 0; r < rounds; r++) {
+        /* the round goes into the pattern: stale data must not pass */
+        unsigned long tag = j->key | (unsigned long) r << 32;
+
+        for (b = j->nr; b < nblocks && !j->err; b += j->nthreads) {
+            off = b * bsize;
+            fill(buf, bsize, tag, off);
+            if (pwrite(fd, buf, bsize, off) != bsize)
+                j->err = -errno;
+            else
+                j->bytes += bsize;
+        }
+        pthread_barrier_wait(&phase);
+
+        for (b = j->nr; b < nblocks && !j->err; b += j->nthreads) {
+            off = b * bsize;
+            fill(want, bsize, tag, off);
+            if (pread(fd, buf, bsize, off) != bsize) {
+                j->err = -errno;
+                break;
+            }
+            j->bytes += bsize;
+            j->own_checked++;
+            if (memcmp(buf, want, bsize)) {
+                fprintf(stderr, "stress: key %lu lost its block %lli\n",
+                        j->key, b);
+                j->failures++;
+            }
+            if (next == j->nr || b - j->nr + next >= nblocks)
+                continue;
+            /* the neighbour's block, only meaningful when isolated */
+            off = (b - j->nr + next) * bsize;
+            if (pread(fd, buf, bsize, off) != bsize) {
+                j->err = -errno;
+                break;
+            }
+            j->bytes += bsize;
+            if (!isolated)
+                continue;
+            memset(want, 0, bsize);
+            j->cross_checked++;
+            if (memcmp(buf, want, bsize)) {
+                fprintf(stderr, "stress: key %lu read key %lu's block %lli\n",
+                        j->key, next_key, b - j->nr + next);
+                j->failures++;
+            }
+        }
+        /* nobody writes the next round before everybody has read */
+        pthread_barrier_wait(&phase);
+    }
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    free(want);
+    return NULL;
+}
+
+static int stress(int argc, char **argv)
+{
+    std::vector<stress_job> jobs;
+    std::vector<pthread_t> tids;
+    long own = 0, cross = 0, failures = 0;
+    long long bytes = 0;
+    int c, nthreads = 4, ret = 0;
+    uint64_t t0, usec;
+
+    size = stress_size;
+    while ((c = getopt(argc, argv, "n:b:s:r:k:S")) != -1) {
+        switch (c) {
+        case 'n': nthreads = atoi(optarg); break;
+        case 'b': bsize = strtol(optarg, NULL, 0); break;
+        case 's': size = strtoll(optarg, NULL, 0); break;
+        case 'r': rounds = atoi(optarg); break;
+        case 'k': parse_keys(optarg); break;
+        case 'S': create_sessions = true; break;
+        default: optind = argc; /* usage */
+        }
+    }
+    if (keys.empty())
+        for (int i = 0; i < nthreads; i++)
+            keys.push_back(i + 1);
+    nthreads = keys.size();
+    if (optind != argc - 1 || nthreads < 1 || bsize < 512 || bsize % 512 ||
+            rounds < 1) {
+        fprintf(stderr, "Usage: %s stress [-n threads | -k key,...] "
+                "[-b bsize] [-s size] [-r rounds] [-S] <device>\n", argv[0]);
+        return 1;
+    }
+    dev = argv[optind];
+    if (dev_size())
+        return 1;
+    if (size / bsize < nthreads) {
+        fprintf(stderr, "%s: too small for %i threads\n", dev, nthreads);
+        return 1;
+    }
+    if (create_sessions && sessions(1))
+        return 1;
+
+    jobs.resize(nthreads);
+    tids.resize(nthreads);
+    pthread_barrier_init(&phase, NULL, nthreads);
+    t0 = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].nr = i;
+        jobs[i].nthreads = nthreads;
+        jobs[i].key = keys[i];
+        pthread_create(&tids[i], NULL, stress_worker, &jobs[i]);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+        if (jobs[i].err) {
+            fprintf(stderr, "key %lu: %s\n", jobs[i].key,
+                    strerror(-jobs[i].err));
+            ret = 1;
+        }
+        bytes += jobs[i].bytes;
+        own += jobs[i].own_checked;
+        cross += jobs[i].cross_checked;
+        failures += jobs[i].failures;
+    }
+    usec = (now_ns() - t0) / 1000;
+    pthread_barrier_destroy(&phase);
+
+    printf("{\"test\": \"stress\", \"dev\": \"%s\", \"threads\": %i, "
+           "\"bsize\": %li, \"size\": %lli, \"rounds\": %i, \"bytes\": %lli, "
+           "\"usec\": %llu, \"MBps\": %.2f, \"own_checked\": %li, "
+           "\"cross_checked\": %li, \"failures\": %li}\n",
+           dev, nthreads, bsize, size, rounds, bytes,
+           (unsigned long long) usec, usec ? (double) bytes / usec : 0.0,
+           own, cross, failures);
+    if (failures)
+        ret = 1;
+    if (create_sessions)
+        sessions(0);
+    return ret;
 }
 
 int main(int argc, char **argv)
 {
-	//return normal_read(argc, argv);
-	return user1_write(argc, argv);
+    if (argc >= 3 && !strcmp(argv[1], "read"))
+        return normal_read(argv[2], argc > 3 ? strtoul(argv[3], NULL, 0) : 1);
+    if (argc >= 4 && !strcmp(argv[1], "write"))
+        return user1_write(argv[2], argv[3],
+                           argc > 4 ? strtoul(argv[4], NULL, 0) : 1);
+    if (argc >= 2 && !strcmp(argv[1], "bench"))
+        return bench(argc - 1, argv + 1);
+    if (argc >= 2 && !strcmp(argv[1], "stress"))
+        return stress(argc - 1, argv + 1);
+
+    fprintf(stderr, "Usage: %s read <dev> [key]\n"
+            "       %s write <dev> <text> [key]\n"
+            "       %s bench [options] <dev>\n"
+            "       %s stress [options] <dev>\n",
+            argv[0], argv[0], argv[0], argv[0]);
+    return 1;
 }
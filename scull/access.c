@@ -260,8 +260,8 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key)
 	/* initialize the device */
 	memset(lptr, 0, sizeof(struct scull_listitem));
 	lptr->key = key;
-	scull_trim(&(lptr->device)); /* initialize it */
-	init_MUTEX(&(lptr->device.sem));
+	scullq_init(&lptr->device.store, &scull_qops, /* initialize it */
+			scull_quantum, scull_qset);
 
 	/* place it in the list */
 	list_add(&lptr->list, &scull_c_list);
@@ -345,9 +345,7 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 	int err;
 
 	/* Initialize the device structure */
-	dev->quantum = scull_quantum;
-	dev->qset = scull_qset;
-	init_MUTEX(&dev->sem);
+	scullq_init(&dev->store, &scull_qops, scull_quantum, scull_qset);
 
 	/* Do the cdev stuff. */
 	cdev_init(&dev->cdev, devinfo->fops);
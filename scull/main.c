@@ -56,31 +56,34 @@ MODULE_LICENSE("Dual BSD/GPL");
 struct scull_dev *scull_devices;	/* allocated in scull_init_module */
 
 
+/*
+ * The allocator: plain kmalloc for every quantum.
+ */
+static int scull_alloc(struct scullq *sq, struct scullq_set *set, int s_pos)
+{
+	set->data[s_pos] = kmalloc(sq->quantum, GFP_KERNEL);
+	return set->data[s_pos] ? 0 : -ENOMEM;
+}
+
+static void scull_free(struct scullq *sq, struct scullq_set *set, int s_pos,
+		struct list_head *dead)
+{
+	kfree(set->data[s_pos]);
+}
+
+struct scullq_ops scull_qops = {
+	.name =  "kmalloc",
+	.alloc = scull_alloc,
+	.free =  scull_free,
+};
+
 /*
  * Empty out the scull device; must be called with the device
  * semaphore held.
  */
 int scull_trim(struct scull_dev *dev)
 {
-	struct scull_qset *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
-
-	for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
-			kfree(dptr->data);
-			dptr->data = NULL;
-		}
-		next = dptr->next;
-		kfree(dptr);
-	}
-	dev->size = 0;
-	dev->quantum = scull_quantum;
-	dev->qset = scull_qset;
-	dev->data = NULL;
-	return 0;
+	return scullq_trim(&dev->store, scull_quantum, scull_qset);
 }
 #ifdef SCULL_DEBUG /* use proc only if debugging */
 /*
@@ -94,12 +97,12 @@ int scull_read_procmem(char *buf, char **start, off_t offset,
 	int limit = count - 80; /* Don't print more than this */
 
 	for (i = 0; i < scull_nr_devs && len <= limit; i++) {
-		struct scull_dev *d = &scull_devices[i];
-		struct scull_qset *qs = d->data;
+		struct scullq *d = &scull_devices[i].store;
+		struct scullq_set *qs = d->data;
 		if (down_interruptible(&d->sem))
 			return -ERESTARTSYS;
 		len += sprintf(buf+len,"\nDevice %i: qset %i, q %i, sz %li\n",
-				i, d->qset, d->quantum, d->size);
+				i, d->qset, d->quantum, (long) d->size);
 		for (; qs && len <= limit; qs = qs->next) { /* scan the list */
 			len += sprintf(buf + len, "  item at %p, qset at %p\n",
 					qs, qs->data);
@@ -111,7 +114,7 @@ int scull_read_procmem(char *buf, char **start, off_t offset,
 								j, qs->data[j]);
 				}
 		}
-		up(&scull_devices[i].sem);
+		up(&d->sem);
 	}
 	*eof = 1;
 	return len;
@@ -149,15 +152,16 @@ static void scull_seq_stop(struct seq_file *s, void *v)
 
 static int scull_seq_show(struct seq_file *s, void *v)
 {
-	struct scull_dev *dev = (struct scull_dev *) v;
-	struct scull_qset *d;
+	struct scull_dev *sdev = (struct scull_dev *) v;
+	struct scullq *dev = &sdev->store;
+	struct scullq_set *d;
 	int i;
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
 	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
-			(int) (dev - scull_devices), dev->qset,
-			dev->quantum, dev->size);
+			(int) (sdev - scull_devices), dev->qset,
+			dev->quantum, (long) dev->size);
 	for (d = dev->data; d; d = d->next) { /* scan the list */
 		seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
 		if (d->data && !d->next) /* dump only the last item */
@@ -244,10 +248,10 @@ int scull_open(struct inode *inode, struct file *filp)
 
 	/* now trim to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible(&dev->sem))
+		if (down_interruptible(&dev->store.sem))
 			return -ERESTARTSYS;
 		scull_trim(dev); /* ignore errors */
-		up(&dev->sem);
+		up(&dev->store.sem);
 	}
 	return 0;          /* success */
 }
@@ -257,133 +261,24 @@ int scull_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 /*
- * Follow the list
- */
-struct scull_qset *scull_follow(struct scull_dev *dev, int n)
-{
-	struct scull_qset *qs = dev->data;
-
-        /* Allocate first qset explicitly if need be */
-	if (! qs) {
-		qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-		if (qs == NULL)
-			return NULL;  /* Never mind */
-		memset(qs, 0, sizeof(struct scull_qset));
-	}
-
-	/* Then follow the list */
-	while (n--) {
-		if (!qs->next) {
-			qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-			if (qs->next == NULL)
-				return NULL;  /* Never mind */
-			memset(qs->next, 0, sizeof(struct scull_qset));
-		}
-		qs = qs->next;
-		continue;
-	}
-	return qs;
-}
-
-/*
- * Data management: read and write
+ * Data management is all in the quantum store: read and write
+ * just hand it the right device.
  */
 
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scull_dev *dev = filp->private_data; 
-	struct scull_qset *dptr;	/* the first listitem */
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
-
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
-	if (*f_pos >= dev->size)
-		goto out;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
 
-	/* find listitem, qset index, and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scull_follow(dev, item);
-
-	if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
-		goto out; /* don't fill holes */
-
-	/* read only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
-
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
-		goto out;
-	}
-	*f_pos += count;
-	retval = count;
-
-  out:
-	up(&dev->sem);
-	return retval;
+	return scullq_read(&dev->store, buf, count, f_pos);
 }
 
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scull_dev *dev = filp->private_data;
-	struct scull_qset *dptr;
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
-
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
-
-	/* find listitem, qset index and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position */
-	dptr = scull_follow(dev, item);
-	if (dptr == NULL)
-		goto out;
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data)
-			goto out;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
-	}
-	/* write only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
-
-	if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto out;
-	}
-	*f_pos += count;
-	retval = count;
-
-        /* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
 
-  out:
-	up(&dev->sem);
-	return retval;
+	return scullq_write(&dev->store, buf, count, f_pos);
 }
 
 /*
@@ -523,27 +418,8 @@ int scull_ioctl(struct inode *inode, struct file *filp,
 loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 {
 	struct scull_dev *dev = filp->private_data;
-	loff_t newpos;
 
-	switch(whence) {
-	  case 0: /* SEEK_SET */
-		newpos = off;
-		break;
-
-	  case 1: /* SEEK_CUR */
-		newpos = filp->f_pos + off;
-		break;
-
-	  case 2: /* SEEK_END */
-		newpos = dev->size + off;
-		break;
-
-	  default: /* can't happen */
-		return -EINVAL;
-	}
-	if (newpos < 0) return -EINVAL;
-	filp->f_pos = newpos;
-	return newpos;
+	return scullq_llseek(&dev->store, filp, off, whence);
 }
 
 
@@ -647,9 +523,8 @@ int scull_init_module(void)
 
         /* Initialize each device. */
 	for (i = 0; i < scull_nr_devs; i++) {
-		scull_devices[i].quantum = scull_quantum;
-		scull_devices[i].qset = scull_qset;
-		init_MUTEX(&scull_devices[i].sem);
+		scullq_init(&scull_devices[i].store, &scull_qops,
+				scull_quantum, scull_qset);
 		scull_setup_cdev(&scull_devices[i], i);
 	}
 
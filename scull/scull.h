@@ -19,6 +19,7 @@
 #define _SCULL_H_
 
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
+#include "../include/scullq.h"
 
 /*
  * Macros to help debugging
@@ -53,13 +54,11 @@
 #endif
 
 /*
- * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * The bare device is a variable-length region of memory, kept in a
+ * scullq quantum store (see include/scullq.h) with kmalloc'd quanta.
  *
- * "scull_dev->data" points to an array of pointers, each
- * pointer refers to a memory area of SCULL_QUANTUM bytes.
- *
- * The array (quantum-set) is SCULL_QSET long.
+ * Each quantum is SCULL_QUANTUM bytes, and a quantum set holds
+ * SCULL_QSET of them.
  */
 #ifndef SCULL_QUANTUM
 #define SCULL_QUANTUM 4000
@@ -76,21 +75,9 @@
 #define SCULL_P_BUFFER 4000
 #endif
 
-/*
- * Representation of scull quantum sets.
- */
-struct scull_qset {
-	void **data;
-	struct scull_qset *next;
-};
-
 struct scull_dev {
-	struct scull_qset *data;  /* Pointer to first quantum set */
-	int quantum;              /* the current quantum size */
-	int qset;                 /* the current array size */
-	unsigned long size;       /* amount of data stored here */
+	struct scullq store;      /* data, geometry and semaphore */
 	unsigned int access_key;  /* used by sculluid and scullpriv */
-	struct semaphore sem;     /* mutual exclusion semaphore     */
 	struct cdev cdev;	  /* Char device structure		*/
 };
 
@@ -111,6 +98,8 @@ extern int scull_qset;
 
 extern int scull_p_buffer;	/* pipe.c */
 
+extern struct scullq_ops scull_qops;	/* main.c */
+
 
 /*
  * Prototypes for shared functions
@@ -50,8 +50,29 @@ void scullc_cleanup(void);
 
 /* declare one cache pointer: use it for all devices */
 kmem_cache_t *scullc_cache;
+static int scullc_cache_size; /* the quantum at load time */
 
+/*
+ * The allocator: quanta come from the cache.
+ */
+
+static int scullc_alloc(struct scullq *sq, struct scullq_set *set, int s_pos)
+{
+	set->data[s_pos] = kmem_cache_alloc(scullc_cache, GFP_KERNEL);
+	return set->data[s_pos] ? 0 : -ENOMEM;
+}
+
+static void scullc_free(struct scullq *sq, struct scullq_set *set, int s_pos,
+		struct list_head *dead)
+{
+	kmem_cache_free(scullc_cache, set->data[s_pos]);
+}
 
+static struct scullq_ops scullc_qops = {
+	.name =  "slab",
+	.alloc = scullc_alloc,
+	.free =  scullc_free,
+};
 
 
 
@@ -81,18 +102,19 @@ int scullc_read_procmem(char *buf, char **start, off_t offset,
 {
 	int i, j, quantum, qset, len = 0;
 	int limit = count - 80; /* Don't print more than this */
-	struct scullc_dev *d;
+	struct scullq *sq;
+	struct scullq_set *d;
 
 	*start = buf;
 	for(i = 0; i < scullc_devs; i++) {
-		d = &scullc_devices[i];
-		if (down_interruptible (&d->sem))
+		sq = &scullc_devices[i].store;
+		if (down_interruptible (&sq->sem))
 			return -ERESTARTSYS;
-		qset = d->qset;  /* retrieve the features of each device */
-		quantum=d->quantum;
+		qset = sq->qset;  /* retrieve the features of each device */
+		quantum = sq->quantum;
 		len += sprintf(buf+len,"\nDevice %i: qset %i, quantum %i, sz %li\n",
-				i, qset, quantum, (long)(d->size));
-		for (; d; d = d->next) { /* scan the list */
+				i, qset, quantum, (long)(sq->size));
+		for (d = sq->data; d; d = d->next) { /* scan the list */
 			len += sprintf(buf+len,"  item at %p, qset at %p\n",d,d->data);
 			scullc_proc_offset (buf, start, &offset, &len);
 			if (len > limit)
@@ -107,7 +129,7 @@ int scullc_read_procmem(char *buf, char **start, off_t offset,
 				}
 		}
 	  out:
-		up (&scullc_devices[i].sem);
+		up (&sq->sem);
 		if (len > limit)
 			break;
 	}
@@ -130,10 +152,10 @@ int scullc_open (struct inode *inode, struct file *filp)
 
     	/* now trim to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible (&dev->sem))
+		if (down_interruptible (&dev->store.sem))
 			return -ERESTARTSYS;
 		scullc_trim(dev); /* ignore errors */
-		up (&dev->sem);
+		up (&dev->store.sem);
 	}
 
 	/* and use filp->private_data to point to the device data */
@@ -148,311 +170,54 @@ int scullc_release (struct inode *inode, struct file *filp)
 }
 
 /*
- * Follow the list 
- */
-struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n)
-{
-	while (n--) {
-		if (!dev->next) {
-			dev->next = kmalloc(sizeof(struct scullc_dev), GFP_KERNEL);
-			memset(dev->next, 0, sizeof(struct scullc_dev));
-		}
-		dev = dev->next;
-		continue;
-	}
-	return dev;
-}
-
-/*
- * Data management: read and write
+ * Data management is all in the quantum store: the methods below
+ * just hand it the right device.
  */
 
 ssize_t scullc_read (struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-	struct scullc_dev *dev = filp->private_data; /* the first listitem */
-	struct scullc_dev *dptr;
-	int quantum = dev->quantum;
-	int qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
-
-	if (down_interruptible (&dev->sem))
-		return -ERESTARTSYS;
-	if (*f_pos > dev->size) 
-		goto nothing;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
-	/* find listitem, qset index, and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-    	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scullc_follow(dev, item);
-
-	if (!dptr->data)
-		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
-		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
-
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
-		retval = -EFAULT;
-		goto nothing;
-	}
-	up (&dev->sem);
-
-	*f_pos += count;
-	return count;
+	struct scullc_dev *dev = filp->private_data;
 
-  nothing:
-	up (&dev->sem);
-	return retval;
+	return scullq_read(&dev->store, buf, count, f_pos);
 }
 
-
-
 ssize_t scullc_write (struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scullc_dev *dev = filp->private_data;
-	struct scullc_dev *dptr;
-	int quantum = dev->quantum;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* our most likely error */
-
-	if (down_interruptible (&dev->sem))
-		return -ERESTARTSYS;
-
-	/* find listitem, qset index and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position */
-	dptr = scullc_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Allocate a quantum using the memory cache */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmem_cache_alloc(scullc_cache, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, scullc_quantum);
-	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto nomem;
-	}
-	*f_pos += count;
- 
-    	/* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
-	up (&dev->sem);
-	return count;
-
-  nomem:
-	up (&dev->sem);
-	return retval;
-}
 
-/*
- * The ioctl() implementation
- */
+	return scullq_write(&dev->store, buf, count, f_pos);
+}
 
 int scullc_ioctl (struct inode *inode, struct file *filp,
                  unsigned int cmd, unsigned long arg)
 {
-
-	int err = 0, ret = 0, tmp;
-
-	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
-	if (_IOC_TYPE(cmd) != SCULLC_IOC_MAGIC) return -ENOTTY;
-	if (_IOC_NR(cmd) > SCULLC_IOC_MAXNR) return -ENOTTY;
-
-	/*
-	 * the type is a bitmask, and VERIFY_WRITE catches R/W
-	 * transfers. Note that the type is user-oriented, while
-	 * verify_area is kernel-oriented, so the concept of "read" and
-	 * "write" is reversed
-	 */
-	if (_IOC_DIR(cmd) & _IOC_READ)
-		err = !access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd));
-	else if (_IOC_DIR(cmd) & _IOC_WRITE)
-		err =  !access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd));
-	if (err)
-		return -EFAULT;
-
-	switch(cmd) {
-
-	case SCULLC_IOCRESET:
-		scullc_qset = SCULLC_QSET;
-		scullc_quantum = SCULLC_QUANTUM;
-		break;
-
-	case SCULLC_IOCSQUANTUM: /* Set: arg points to the value */
-		ret = __get_user(scullc_quantum, (int __user *) arg);
-		break;
-
-	case SCULLC_IOCTQUANTUM: /* Tell: arg is the value */
-		scullc_quantum = arg;
-		break;
-
-	case SCULLC_IOCGQUANTUM: /* Get: arg is pointer to result */
-		ret = __put_user (scullc_quantum, (int __user *) arg);
-		break;
-
-	case SCULLC_IOCQQUANTUM: /* Query: return it (it's positive) */
-		return scullc_quantum;
-
-	case SCULLC_IOCXQUANTUM: /* eXchange: use arg as pointer */
-		tmp = scullc_quantum;
-		ret = __get_user(scullc_quantum, (int __user *) arg);
-		if (ret == 0)
-			ret = __put_user(tmp, (int __user *) arg);
-		break;
-
-	case SCULLC_IOCHQUANTUM: /* sHift: like Tell + Query */
-		tmp = scullc_quantum;
-		scullc_quantum = arg;
-		return tmp;
-
-	case SCULLC_IOCSQSET:
-		ret = __get_user(scullc_qset, (int __user *) arg);
-		break;
-
-	case SCULLC_IOCTQSET:
-		scullc_qset = arg;
-		break;
-
-	case SCULLC_IOCGQSET:
-		ret = __put_user(scullc_qset, (int __user *)arg);
-		break;
-
-	case SCULLC_IOCQQSET:
-		return scullc_qset;
-
-	case SCULLC_IOCXQSET:
-		tmp = scullc_qset;
-		ret = __get_user(scullc_qset, (int __user *)arg);
-		if (ret == 0)
-			ret = __put_user(tmp, (int __user *)arg);
-		break;
-
-	case SCULLC_IOCHQSET:
-		tmp = scullc_qset;
-		scullc_qset = arg;
-		return tmp;
-
-	default:  /* redundant, as cmd was checked against MAXNR */
-		return -ENOTTY;
-	}
-
-	return ret;
+	return scullq_ioctl(cmd, arg, &scullc_quantum, &scullc_qset,
+			SCULLC_QUANTUM, SCULLC_QSET);
 }
 
-/*
- * The "extended" operations
- */
-
 loff_t scullc_llseek (struct file *filp, loff_t off, int whence)
 {
 	struct scullc_dev *dev = filp->private_data;
-	long newpos;
-
-	switch(whence) {
-	case 0: /* SEEK_SET */
-		newpos = off;
-		break;
-
-	case 1: /* SEEK_CUR */
-		newpos = filp->f_pos + off;
-		break;
-
-	case 2: /* SEEK_END */
-		newpos = dev->size + off;
-		break;
-
-	default: /* can't happen */
-		return -EINVAL;
-	}
-	if (newpos<0) return -EINVAL;
-	filp->f_pos = newpos;
-	return newpos;
-}
-
-
-/*
- * A simple asynchronous I/O implementation.
- */
-
-struct async_work {
-	struct kiocb *iocb;
-	int result;
-	struct work_struct work;
-};
 
-/*
- * "Complete" an asynchronous operation.
- */
-static void scullc_do_deferred_op(void *p)
-{
-	struct async_work *stuff = (struct async_work *) p;
-	aio_complete(stuff->iocb, stuff->result, 0);
-	kfree(stuff);
+	return scullq_llseek(&dev->store, filp, off, whence);
 }
 
-
-static int scullc_defer_op(int write, struct kiocb *iocb, char __user *buf,
-		size_t count, loff_t pos)
-{
-	struct async_work *stuff;
-	int result;
-
-	/* Copy now while we can access the buffer */
-	if (write)
-		result = scullc_write(iocb->ki_filp, buf, count, &pos);
-	else
-		result = scullc_read(iocb->ki_filp, buf, count, &pos);
-
-	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb))
-		return result;
-
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
-	if (stuff == NULL)
-		return result; /* No memory, just complete now */
-	stuff->iocb = iocb;
-	stuff->result = result;
-	INIT_WORK(&stuff->work, scullc_do_deferred_op, stuff);
-	schedule_delayed_work(&stuff->work, HZ/100);
-	return -EIOCBQUEUED;
-}
-
-
 static ssize_t scullc_aio_read(struct kiocb *iocb, char __user *buf, size_t count,
 		loff_t pos)
 {
-	return scullc_defer_op(0, iocb, buf, count, pos);
+	struct scullc_dev *dev = iocb->ki_filp->private_data;
+
+	return scullq_aio(&dev->store, 0, iocb, buf, count, pos);
 }
 
 static ssize_t scullc_aio_write(struct kiocb *iocb, const char __user *buf,
 		size_t count, loff_t pos)
 {
-	return scullc_defer_op(1, iocb, (char __user *) buf, count, pos);
+	struct scullc_dev *dev = iocb->ki_filp->private_data;
+
+	return scullq_aio(&dev->store, 1, iocb, (char __user *) buf, count, pos);
 }
 
 
@@ -474,32 +239,17 @@ struct file_operations scullc_fops = {
 	.aio_write = scullc_aio_write,
 };
 
+/*
+ * The cache was created with the quantum size in force at load time,
+ * so a quantum set later through ioctl can't be any bigger.
+ */
 int scullc_trim(struct scullc_dev *dev)
 {
-	struct scullc_dev *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
-
-	if (dev->vmas) /* don't trim: there are active mappings */
-		return -EBUSY;
+	int quantum = scullc_quantum;
 
-	for (dptr = dev; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				if (dptr->data[i])
-					kmem_cache_free(scullc_cache, dptr->data[i]);
-
-			kfree(dptr->data);
-			dptr->data=NULL;
-		}
-		next=dptr->next;
-		if (dptr != dev) kfree(dptr); /* all of them but the first */
-	}
-	dev->size = 0;
-	dev->qset = scullc_qset;
-	dev->quantum = scullc_quantum;
-	dev->next = NULL;
-	return 0;
+	if (quantum <= 0 || quantum > scullc_cache_size)
+		quantum = scullc_cache_size;
+	return scullq_trim(&dev->store, quantum, scullc_qset);
 }
 
 
@@ -539,6 +289,17 @@ int scullc_init(void)
 	if (result < 0)
 		return result;
 
+	/*
+	 * The cache comes first: the devices are live as soon as
+	 * their cdev is added.
+	 */
+	scullc_cache = kmem_cache_create("scullc", scullc_quantum,
+			0, SLAB_HWCACHE_ALIGN, NULL, NULL); /* no ctor/dtor */
+	if (!scullc_cache) {
+		result = -ENOMEM;
+		goto fail_malloc;
+	}
+	scullc_cache_size = scullc_quantum;
 	
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
@@ -551,25 +312,19 @@ int scullc_init(void)
 	}
 	memset(scullc_devices, 0, scullc_devs*sizeof (struct scullc_dev));
 	for (i = 0; i < scullc_devs; i++) {
-		scullc_devices[i].quantum = scullc_quantum;
-		scullc_devices[i].qset = scullc_qset;
-		sema_init (&scullc_devices[i].sem, 1);
+		scullq_init(&scullc_devices[i].store, &scullc_qops,
+				scullc_quantum, scullc_qset);
 		scullc_setup_cdev(scullc_devices + i, i);
 	}
 
-	scullc_cache = kmem_cache_create("scullc", scullc_quantum,
-			0, SLAB_HWCACHE_ALIGN, NULL, NULL); /* no ctor/dtor */
-	if (!scullc_cache) {
-		scullc_cleanup();
-		return -ENOMEM;
-	}
-
 #ifdef SCULLC_USE_PROC /* only when available */
 	create_proc_read_entry("scullcmem", 0, NULL, scullc_read_procmem, NULL);
 #endif
 	return 0; /* succeed */
 
   fail_malloc:
+	if (scullc_cache)
+		kmem_cache_destroy(scullc_cache);
 	unregister_chrdev_region(dev, scullc_devs);
 	return result;
 }
@@ -586,6 +341,7 @@ void scullc_cleanup(void)
 
 	for (i = 0; i < scullc_devs; i++) {
 		cdev_del(&scullc_devices[i].cdev);
+		scullq_release(&scullc_devices[i].store);
 		scullc_trim(scullc_devices + i);
 	}
 	kfree(scullc_devices);
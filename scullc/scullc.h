@@ -15,6 +15,7 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
+#include "../include/scullq.h"
 
 /*
  * Macros to help debugging
@@ -41,11 +42,9 @@
 #define SCULLC_DEVS 4    /* scullc0 through scullc3 */
 
 /*
- * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
- *
- * "scullc_dev->data" points to an array of pointers, each
- * pointer refers to a memory page.
+ * The bare device is a variable-length region of memory, kept in a
+ * scullq quantum store (see include/scullq.h). Quanta come from a
+ * dedicated slab cache.
  *
  * The array (quantum-set) is SCULLC_QSET long.
  */
@@ -53,13 +52,7 @@
 #define SCULLC_QSET     500
 
 struct scullc_dev {
-	void **data;
-	struct scullc_dev *next;  /* next listitem */
-	int vmas;                 /* active mappings */
-	int quantum;              /* the current allocation size */
-	int qset;                 /* the current array size */
-	size_t size;              /* 32-bit will suffice */
-	struct semaphore sem;     /* Mutual exclusion */
+	struct scullq store;      /* The data, and its semaphore */
 	struct cdev cdev;
 };
 
@@ -72,14 +65,13 @@ extern struct file_operations scullc_fops;
  */
 extern int scullc_major;     /* main.c */
 extern int scullc_devs;
-extern int scullc_order;
+extern int scullc_quantum;
 extern int scullc_qset;
 
 /*
  * Prototypes for shared functions
  */
 int scullc_trim(struct scullc_dev *dev);
-struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n);
 
 
 #ifdef SCULLC_DEBUG
@@ -27,6 +27,7 @@
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/aio.h>
+#include <linux/mm.h>
 #include <asm/uaccess.h>
 #include "sculld.h"		/* local definitions */
 
@@ -49,6 +50,44 @@ int sculld_trim(struct sculld_dev *dev);
 void sculld_cleanup(void);
 
 
+/*
+ * The allocator: each quantum is a block of 2^order whole pages.
+ */
+
+static int sculld_alloc(struct scullq *sq, struct scullq_set *set, int s_pos)
+{
+	set->data[s_pos] = (void *)__get_free_pages(GFP_KERNEL, sq->order);
+	return set->data[s_pos] ? 0 : -ENOMEM;
+}
+
+static void sculld_free(struct scullq *sq, struct scullq_set *set, int s_pos,
+		struct list_head *dead)
+{
+	free_pages((unsigned long)(set->data[s_pos]), sq->order);
+}
+
+/*
+ * The page for a fault. The count for the page is incremented by the
+ * caller, so "order" must be zero. Otherwise, only the first page has
+ * its count incremented, and the allocating module must release it
+ * as a whole block. Therefore, it isn't possible to map pages from a
+ * multipage block: when they are unmapped, their count is
+ * individually decreased, and would drop to 0.
+ */
+static struct page *sculld_page(struct scullq *sq, struct scullq_set *set,
+		int s_pos, unsigned long pgoff)
+{
+	return virt_to_page(set->data[s_pos]);
+}
+
+static struct scullq_ops sculld_qops = {
+	.name =  "pages",
+	.alloc = sculld_alloc,
+	.free =  sculld_free,
+	.page =  sculld_page,
+};
+
+
 
 /* Device model stuff */
 
@@ -88,18 +127,19 @@ int sculld_read_procmem(char *buf, char **start, off_t offset,
 {
 	int i, j, order, qset, len = 0;
 	int limit = count - 80; /* Don't print more than this */
-	struct sculld_dev *d;
+	struct scullq *sq;
+	struct scullq_set *d;
 
 	*start = buf;
 	for(i = 0; i < sculld_devs; i++) {
-		d = &sculld_devices[i];
-		if (down_interruptible (&d->sem))
+		sq = &sculld_devices[i].store;
+		if (down_interruptible (&sq->sem))
 			return -ERESTARTSYS;
-		qset = d->qset;  /* retrieve the features of each device */
-		order = d->order;
+		qset = sq->qset;  /* retrieve the features of each device */
+		order = sq->order;
 		len += sprintf(buf+len,"\nDevice %i: qset %i, order %i, sz %li\n",
-				i, qset, order, (long)(d->size));
-		for (; d; d = d->next) { /* scan the list */
+				i, qset, order, (long)(sq->size));
+		for (d = sq->data; d; d = d->next) { /* scan the list */
 			len += sprintf(buf+len,"  item at %p, qset at %p\n",d,d->data);
 			sculld_proc_offset (buf, start, &offset, &len);
 			if (len > limit)
@@ -114,7 +154,7 @@ int sculld_read_procmem(char *buf, char **start, off_t offset,
 				}
 		}
 	  out:
-		up (&sculld_devices[i].sem);
+		up (&sq->sem);
 		if (len > limit)
 			break;
 	}
@@ -137,10 +177,10 @@ int sculld_open (struct inode *inode, struct file *filp)
 
     	/* now trim to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible (&dev->sem))
+		if (down_interruptible (&dev->store.sem))
 			return -ERESTARTSYS;
 		sculld_trim(dev); /* ignore errors */
-		up (&dev->sem);
+		up (&dev->store.sem);
 	}
 
 	/* and use filp->private_data to point to the device data */
@@ -155,320 +195,72 @@ int sculld_release (struct inode *inode, struct file *filp)
 }
 
 /*
- * Follow the list 
- */
-struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n)
-{
-	while (n--) {
-		if (!dev->next) {
-			dev->next = kmalloc(sizeof(struct sculld_dev), GFP_KERNEL);
-			memset(dev->next, 0, sizeof(struct sculld_dev));
-		}
-		dev = dev->next;
-		continue;
-	}
-	return dev;
-}
-
-/*
- * Data management: read and write
+ * Data management is all in the quantum store: the methods below
+ * just hand it the right device.
  */
 
 ssize_t sculld_read (struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-	struct sculld_dev *dev = filp->private_data; /* the first listitem */
-	struct sculld_dev *dptr;
-	int quantum = PAGE_SIZE << dev->order;
-	int qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
-
-	if (down_interruptible (&dev->sem))
-		return -ERESTARTSYS;
-	if (*f_pos > dev->size) 
-		goto nothing;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
-	/* find listitem, qset index, and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-    	/* follow the list up to the right position (defined elsewhere) */
-	dptr = sculld_follow(dev, item);
-
-	if (!dptr->data)
-		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
-		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
-
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
-		retval = -EFAULT;
-		goto nothing;
-	}
-	up (&dev->sem);
-
-	*f_pos += count;
-	return count;
+	struct sculld_dev *dev = filp->private_data;
 
-  nothing:
-	up (&dev->sem);
-	return retval;
+	return scullq_read(&dev->store, buf, count, f_pos);
 }
 
-
-
 ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct sculld_dev *dev = filp->private_data;
-	struct sculld_dev *dptr;
-	int quantum = PAGE_SIZE << dev->order;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* our most likely error */
-
-	if (down_interruptible (&dev->sem))
-		return -ERESTARTSYS;
-
-	/* find listitem, qset index and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position */
-	dptr = sculld_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Here's the allocation of a single quantum */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
-	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto nomem;
-	}
-	*f_pos += count;
- 
-    	/* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
-	up (&dev->sem);
-	return count;
 
-  nomem:
-	up (&dev->sem);
-	return retval;
+	return scullq_write(&dev->store, buf, count, f_pos);
 }
 
-/*
- * The ioctl() implementation
- */
-
 int sculld_ioctl (struct inode *inode, struct file *filp,
                  unsigned int cmd, unsigned long arg)
 {
-
-	int err = 0, ret = 0, tmp;
-
-	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
-	if (_IOC_TYPE(cmd) != SCULLD_IOC_MAGIC) return -ENOTTY;
-	if (_IOC_NR(cmd) > SCULLD_IOC_MAXNR) return -ENOTTY;
-
-	/*
-	 * the type is a bitmask, and VERIFY_WRITE catches R/W
-	 * transfers. Note that the type is user-oriented, while
-	 * verify_area is kernel-oriented, so the concept of "read" and
-	 * "write" is reversed
-	 */
-	if (_IOC_DIR(cmd) & _IOC_READ)
-		err = !access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd));
-	else if (_IOC_DIR(cmd) & _IOC_WRITE)
-		err =  !access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd));
-	if (err)
-		return -EFAULT;
-
-	switch(cmd) {
-
-	case SCULLD_IOCRESET:
-		sculld_qset = SCULLD_QSET;
-		sculld_order = SCULLD_ORDER;
-		break;
-
-	case SCULLD_IOCSORDER: /* Set: arg points to the value */
-		ret = __get_user(sculld_order, (int __user *) arg);
-		break;
-
-	case SCULLD_IOCTORDER: /* Tell: arg is the value */
-		sculld_order = arg;
-		break;
-
-	case SCULLD_IOCGORDER: /* Get: arg is pointer to result */
-		ret = __put_user (sculld_order, (int __user *) arg);
-		break;
-
-	case SCULLD_IOCQORDER: /* Query: return it (it's positive) */
-		return sculld_order;
-
-	case SCULLD_IOCXORDER: /* eXchange: use arg as pointer */
-		tmp = sculld_order;
-		ret = __get_user(sculld_order, (int __user *) arg);
-		if (ret == 0)
-			ret = __put_user(tmp, (int __user *) arg);
-		break;
-
-	case SCULLD_IOCHORDER: /* sHift: like Tell + Query */
-		tmp = sculld_order;
-		sculld_order = arg;
-		return tmp;
-
-	case SCULLD_IOCSQSET:
-		ret = __get_user(sculld_qset, (int __user *) arg);
-		break;
-
-	case SCULLD_IOCTQSET:
-		sculld_qset = arg;
-		break;
-
-	case SCULLD_IOCGQSET:
-		ret = __put_user(sculld_qset, (int __user *)arg);
-		break;
-
-	case SCULLD_IOCQQSET:
-		return sculld_qset;
-
-	case SCULLD_IOCXQSET:
-		tmp = sculld_qset;
-		ret = __get_user(sculld_qset, (int __user *)arg);
-		if (ret == 0)
-			ret = __put_user(tmp, (int __user *)arg);
-		break;
-
-	case SCULLD_IOCHQSET:
-		tmp = sculld_qset;
-		sculld_qset = arg;
-		return tmp;
-
-	default:  /* redundant, as cmd was checked against MAXNR */
-		return -ENOTTY;
-	}
-
-	return ret;
+	return scullq_ioctl(cmd, arg, &sculld_order, &sculld_qset,
+			SCULLD_ORDER, SCULLD_QSET);
 }
 
-/*
- * The "extended" operations
- */
-
 loff_t sculld_llseek (struct file *filp, loff_t off, int whence)
 {
 	struct sculld_dev *dev = filp->private_data;
-	long newpos;
 
-	switch(whence) {
-	case 0: /* SEEK_SET */
-		newpos = off;
-		break;
-
-	case 1: /* SEEK_CUR */
-		newpos = filp->f_pos + off;
-		break;
-
-	case 2: /* SEEK_END */
-		newpos = dev->size + off;
-		break;
-
-	default: /* can't happen */
-		return -EINVAL;
-	}
-	if (newpos<0) return -EINVAL;
-	filp->f_pos = newpos;
-	return newpos;
-}
-
-
-/*
- * A simple asynchronous I/O implementation.
- */
-
-struct async_work {
-	struct kiocb *iocb;
-	int result;
-	struct work_struct work;
-};
-
-/*
- * "Complete" an asynchronous operation.
- */
-static void sculld_do_deferred_op(void *p)
-{
-	struct async_work *stuff = (struct async_work *) p;
-	aio_complete(stuff->iocb, stuff->result, 0);
-	kfree(stuff);
+	return scullq_llseek(&dev->store, filp, off, whence);
 }
 
-
-static int sculld_defer_op(int write, struct kiocb *iocb, char __user *buf,
-		size_t count, loff_t pos)
-{
-	struct async_work *stuff;
-	int result;
-
-	/* Copy now while we can access the buffer */
-	if (write)
-		result = sculld_write(iocb->ki_filp, buf, count, &pos);
-	else
-		result = sculld_read(iocb->ki_filp, buf, count, &pos);
-
-	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb))
-		return result;
-
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
-	if (stuff == NULL)
-		return result; /* No memory, just complete now */
-	stuff->iocb = iocb;
-	stuff->result = result;
-	INIT_WORK(&stuff->work, sculld_do_deferred_op, stuff);
-	schedule_delayed_work(&stuff->work, HZ/100);
-	return -EIOCBQUEUED;
-}
-
-
 static ssize_t sculld_aio_read(struct kiocb *iocb, char __user *buf, size_t count,
 		loff_t pos)
 {
-	return sculld_defer_op(0, iocb, buf, count, pos);
+	struct sculld_dev *dev = iocb->ki_filp->private_data;
+
+	return scullq_aio(&dev->store, 0, iocb, buf, count, pos);
 }
 
 static ssize_t sculld_aio_write(struct kiocb *iocb, const char __user *buf,
 		size_t count, loff_t pos)
 {
-	return sculld_defer_op(1, iocb, (char __user *) buf, count, pos);
+	struct sculld_dev *dev = iocb->ki_filp->private_data;
+
+	return scullq_aio(&dev->store, 1, iocb, (char __user *) buf, count, pos);
 }
 
 
  
 /*
- * Mmap *is* available, but confined in a different file
+ * Mmap is also in the store, which gets the pages from the allocator.
  */
-extern int sculld_mmap(struct file *filp, struct vm_area_struct *vma);
+
+int sculld_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct sculld_dev *dev = filp->private_data;
+
+	/* refuse to map if order is not 0 (see sculld_page) */
+	if (dev->store.order)
+		return -ENODEV;
+
+	return scullq_mmap(&dev->store, vma);
+}
 
 
 /*
@@ -490,32 +282,10 @@ struct file_operations sculld_fops = {
 
 int sculld_trim(struct sculld_dev *dev)
 {
-	struct sculld_dev *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
-
-	if (dev->vmas) /* don't trim: there are active mappings */
-		return -EBUSY;
+	int order = dev->next_order < 0 ? sculld_order : dev->next_order;
+	int qset = dev->next_qset < 0 ? sculld_qset : dev->next_qset;
 
-	for (dptr = dev; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			/* This code frees a whole quantum-set */
-			for (i = 0; i < qset; i++)
-				if (dptr->data[i])
-					free_pages((unsigned long)(dptr->data[i]),
-							dptr->order);
-
-			kfree(dptr->data);
-			dptr->data=NULL;
-		}
-		next=dptr->next;
-		if (dptr != dev) kfree(dptr); /* all of them but the first */
-	}
-	dev->size = 0;
-	dev->qset = sculld_qset;
-	dev->order = sculld_order;
-	dev->next = NULL;
-	return 0;
+	return scullq_trim(&dev->store, PAGE_SIZE << order, qset);
 }
 
 
@@ -541,14 +311,124 @@ static ssize_t sculld_show_dev(struct device *ddev, char *buf)
 
 static DEVICE_ATTR(dev, S_IRUGO, sculld_show_dev, NULL);
 
+/*
+ * Statistics. They are read without the semaphore: a slightly stale
+ * number is fine here.
+ */
+#define SCULLD_SHOW(name, fmt, value)					\
+static ssize_t sculld_show_##name(struct device *ddev, char *buf)	\
+{									\
+	struct sculld_dev *dev = ddev->driver_data;			\
+									\
+	return sprintf(buf, fmt "\n", value);				\
+}									\
+static DEVICE_ATTR(name, S_IRUGO, sculld_show_##name, NULL);
+
+SCULLD_SHOW(size, "%zu", dev->store.size)
+SCULLD_SHOW(pages, "%lu", dev->store.quanta << dev->store.order)
+SCULLD_SHOW(faults, "%lu", dev->store.faults)
+SCULLD_SHOW(vmas, "%i", dev->store.vmas)
+SCULLD_SHOW(reads, "%lu", dev->store.reads)
+SCULLD_SHOW(read_bytes, "%lu", dev->store.read_bytes)
+SCULLD_SHOW(writes, "%lu", dev->store.writes)
+SCULLD_SHOW(write_bytes, "%lu", dev->store.write_bytes)
+
+/*
+ * Order and qset can be changed on a live device. The new values only
+ * take effect at the next trim (an open for writing), since the data
+ * already stored is laid out with the old ones. Reading shows what
+ * the next trim will use.
+ */
+/*
+ * A list item holds qset quanta, and its size must fit in an int:
+ * check a new value against the other one, both as the next trim will
+ * use it and as the store has it now.
+ */
+static int sculld_layout_ok(int order, int qset)
+{
+	return qset <= INT_MAX / (PAGE_SIZE << order);
+}
+
+static ssize_t sculld_show_order(struct device *ddev, char *buf)
+{
+	struct sculld_dev *dev = ddev->driver_data;
+
+	return sprintf(buf, "%i\n",
+			dev->next_order < 0 ? sculld_order : dev->next_order);
+}
+
+static ssize_t sculld_store_order(struct device *ddev, const char *buf,
+		size_t count)
+{
+	struct sculld_dev *dev = ddev->driver_data;
+	int order = simple_strtol(buf, NULL, 0);
+
+	if (order < 0 || order > MAX_ORDER - 1)
+		return -EINVAL;
+	if (!sculld_layout_ok(order, dev->next_qset < 0 ?
+				sculld_qset : dev->next_qset) ||
+			!sculld_layout_ok(order, dev->store.qset))
+		return -EINVAL;
+	dev->next_order = order;
+	return count;
+}
+
+static DEVICE_ATTR(order, S_IRUGO | S_IWUSR, sculld_show_order,
+		sculld_store_order);
+
+static ssize_t sculld_show_qset(struct device *ddev, char *buf)
+{
+	struct sculld_dev *dev = ddev->driver_data;
+
+	return sprintf(buf, "%i\n",
+			dev->next_qset < 0 ? sculld_qset : dev->next_qset);
+}
+
+static ssize_t sculld_store_qset(struct device *ddev, const char *buf,
+		size_t count)
+{
+	struct sculld_dev *dev = ddev->driver_data;
+	int qset = simple_strtol(buf, NULL, 0);
+
+	if (qset <= 0)
+		return -EINVAL;
+	if (!sculld_layout_ok(dev->next_order < 0 ?
+				sculld_order : dev->next_order, qset) ||
+			!sculld_layout_ok(dev->store.order, qset))
+		return -EINVAL;
+	dev->next_qset = qset;
+	return count;
+}
+
+static DEVICE_ATTR(qset, S_IRUGO | S_IWUSR, sculld_show_qset,
+		sculld_store_qset);
+
+static struct device_attribute *sculld_attrs[] = {
+	&dev_attr_dev,
+	&dev_attr_size,
+	&dev_attr_pages,
+	&dev_attr_faults,
+	&dev_attr_vmas,
+	&dev_attr_reads,
+	&dev_attr_read_bytes,
+	&dev_attr_writes,
+	&dev_attr_write_bytes,
+	&dev_attr_order,
+	&dev_attr_qset,
+	NULL
+};
+
 static void sculld_register_dev(struct sculld_dev *dev, int index)
 {
+	struct device_attribute **attr;
+
 	sprintf(dev->devname, "sculld%d", index);
 	dev->ldev.name = dev->devname;
 	dev->ldev.driver = &sculld_driver;
 	dev->ldev.dev.driver_data = dev;
 	register_ldd_device(&dev->ldev);
-	device_create_file(&dev->ldev.dev, &dev_attr_dev);
+	for (attr = sculld_attrs; *attr; attr++)
+		device_create_file(&dev->ldev.dev, *attr);
 }
 
 
@@ -589,9 +469,10 @@ int sculld_init(void)
 	}
 	memset(sculld_devices, 0, sculld_devs*sizeof (struct sculld_dev));
 	for (i = 0; i < sculld_devs; i++) {
-		sculld_devices[i].order = sculld_order;
-		sculld_devices[i].qset = sculld_qset;
-		sema_init (&sculld_devices[i].sem, 1);
+		scullq_init(&sculld_devices[i].store, &sculld_qops,
+				PAGE_SIZE << sculld_order, sculld_qset);
+		sculld_devices[i].next_order = -1;
+		sculld_devices[i].next_qset = -1;
 		sculld_setup_cdev(sculld_devices + i, i);
 		sculld_register_dev(sculld_devices + i, i);
 	}
@@ -620,6 +501,7 @@ void sculld_cleanup(void)
 	for (i = 0; i < sculld_devs; i++) {
 		unregister_ldd_device(&sculld_devices[i].ldev);
 		cdev_del(&sculld_devices[i].cdev);
+		scullq_release(&sculld_devices[i].store);
 		sculld_trim(sculld_devices + i);
 	}
 	kfree(sculld_devices);
@@ -17,6 +17,7 @@
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include "../include/lddbus.h"
+#include "../include/scullq.h"
 
 /*
  * Macros to help debugging
@@ -43,11 +44,9 @@
 #define SCULLD_DEVS 4    /* sculld0 through sculld3 */
 
 /*
- * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
- *
- * "sculld_dev->data" points to an array of pointers, each
- * pointer refers to a memory page.
+ * The bare device is a variable-length region of memory, kept in a
+ * scullq quantum store (see include/scullq.h). Each quantum is a
+ * block of 2^order pages.
  *
  * The array (quantum-set) is SCULLD_QSET long.
  */
@@ -55,16 +54,12 @@
 #define SCULLD_QSET     500
 
 struct sculld_dev {
-	void **data;
-	struct sculld_dev *next;  /* next listitem */
-	int vmas;                 /* active mappings */
-	int order;                /* the current allocation order */
-	int qset;                 /* the current array size */
-	size_t size;              /* 32-bit will suffice */
-	struct semaphore sem;     /* Mutual exclusion */
+	struct scullq store;      /* The data, and its semaphore */
 	struct cdev cdev;
 	char devname[20];
 	struct ldd_device ldev;
+	int next_order;           /* for the next trim, -1 for sculld_order */
+	int next_qset;            /* for the next trim, -1 for sculld_qset */
 };
 
 extern struct sculld_dev *sculld_devices;
@@ -83,7 +78,6 @@ extern int sculld_qset;
  * Prototypes for shared functions
  */
 int sculld_trim(struct sculld_dev *dev);
-struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n);
 
 
 #ifdef SCULLD_DEBUG
@@ -27,6 +27,7 @@
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/aio.h>
+#include <linux/mm.h>
 #include <asm/uaccess.h>
 #include "scullp.h"		/* local definitions */
 
@@ -49,6 +50,44 @@ int scullp_trim(struct scullp_dev *dev);
 void scullp_cleanup(void);
 
 
+/*
+ * The allocator: each quantum is a block of 2^order whole pages.
+ */
+
+static int scullp_alloc(struct scullq *sq, struct scullq_set *set, int s_pos)
+{
+	set->data[s_pos] = (void *)__get_free_pages(GFP_KERNEL, sq->order);
+	return set->data[s_pos] ? 0 : -ENOMEM;
+}
+
+static void scullp_free(struct scullq *sq, struct scullq_set *set, int s_pos,
+		struct list_head *dead)
+{
+	free_pages((unsigned long)(set->data[s_pos]), sq->order);
+}
+
+/*
+ * The page for a fault. The count for the page is incremented by the
+ * caller, so "order" must be zero. Otherwise, only the first page has
+ * its count incremented, and the allocating module must release it
+ * as a whole block. Therefore, it isn't possible to map pages from a
+ * multipage block: when they are unmapped, their count is
+ * individually decreased, and would drop to 0.
+ */
+static struct page *scullp_page(struct scullq *sq, struct scullq_set *set,
+		int s_pos, unsigned long pgoff)
+{
+	return virt_to_page(set->data[s_pos]);
+}
+
+static struct scullq_ops scullp_qops = {
+	.name =  "pages",
+	.alloc = scullp_alloc,
+	.free =  scullp_free,
+	.page =  scullp_page,
+};
+
+
 
 
 
@@ -79,18 +118,19 @@ int scullp_read_procmem(char *buf, char **start, off_t offset,
 {
 	int i, j, order, qset, len = 0;
 	int limit = count - 80; /* Don't print more than this */
-	struct scullp_dev *d;
+	struct scullq *sq;
+	struct scullq_set *d;
 
 	*start = buf;
 	for(i = 0; i < scullp_devs; i++) {
-		d = &scullp_devices[i];
-		if (down_interruptible (&d->sem))
+		sq = &scullp_devices[i].store;
+		if (down_interruptible (&sq->sem))
 			return -ERESTARTSYS;
-		qset = d->qset;  /* retrieve the features of each device */
-		order = d->order;
+		qset = sq->qset;  /* retrieve the features of each device */
+		order = sq->order;
 		len += sprintf(buf+len,"\nDevice %i: qset %i, order %i, sz %li\n",
-				i, qset, order, (long)(d->size));
-		for (; d; d = d->next) { /* scan the list */
+				i, qset, order, (long)(sq->size));
+		for (d = sq->data; d; d = d->next) { /* scan the list */
 			len += sprintf(buf+len,"  item at %p, qset at %p\n",d,d->data);
 			scullp_proc_offset (buf, start, &offset, &len);
 			if (len > limit)
@@ -105,7 +145,7 @@ int scullp_read_procmem(char *buf, char **start, off_t offset,
 				}
 		}
 	  out:
-		up (&scullp_devices[i].sem);
+		up (&sq->sem);
 		if (len > limit)
 			break;
 	}
@@ -128,10 +168,10 @@ int scullp_open (struct inode *inode, struct file *filp)
 
     	/* now trim to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible (&dev->sem))
+		if (down_interruptible (&dev->store.sem))
 			return -ERESTARTSYS;
 		scullp_trim(dev); /* ignore errors */
-		up (&dev->sem);
+		up (&dev->store.sem);
 	}
 
 	/* and use filp->private_data to point to the device data */
@@ -146,320 +186,72 @@ int scullp_release (struct inode *inode, struct file *filp)
 }
 
 /*
- * Follow the list 
- */
-struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n)
-{
-	while (n--) {
-		if (!dev->next) {
-			dev->next = kmalloc(sizeof(struct scullp_dev), GFP_KERNEL);
-			memset(dev->next, 0, sizeof(struct scullp_dev));
-		}
-		dev = dev->next;
-		continue;
-	}
-	return dev;
-}
-
-/*
- * Data management: read and write
+ * Data management is all in the quantum store: the methods below
+ * just hand it the right device.
  */
 
 ssize_t scullp_read (struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-	struct scullp_dev *dev = filp->private_data; /* the first listitem */
-	struct scullp_dev *dptr;
-	int quantum = PAGE_SIZE << dev->order;
-	int qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
-
-	if (down_interruptible (&dev->sem))
-		return -ERESTARTSYS;
-	if (*f_pos > dev->size) 
-		goto nothing;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
-	/* find listitem, qset index, and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-    	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scullp_follow(dev, item);
-
-	if (!dptr->data)
-		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
-		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
-
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
-		retval = -EFAULT;
-		goto nothing;
-	}
-	up (&dev->sem);
-
-	*f_pos += count;
-	return count;
+	struct scullp_dev *dev = filp->private_data;
 
-  nothing:
-	up (&dev->sem);
-	return retval;
+	return scullq_read(&dev->store, buf, count, f_pos);
 }
 
-
-
 ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scullp_dev *dev = filp->private_data;
-	struct scullp_dev *dptr;
-	int quantum = PAGE_SIZE << dev->order;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* our most likely error */
-
-	if (down_interruptible (&dev->sem))
-		return -ERESTARTSYS;
-
-	/* find listitem, qset index and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position */
-	dptr = scullp_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Here's the allocation of a single quantum */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
-	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto nomem;
-	}
-	*f_pos += count;
- 
-    	/* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
-	up (&dev->sem);
-	return count;
-
-  nomem:
-	up (&dev->sem);
-	return retval;
-}
 
-/*
- * The ioctl() implementation
- */
+	return scullq_write(&dev->store, buf, count, f_pos);
+}
 
 int scullp_ioctl (struct inode *inode, struct file *filp,
                  unsigned int cmd, unsigned long arg)
 {
-
-	int err = 0, ret = 0, tmp;
-
-	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
-	if (_IOC_TYPE(cmd) != SCULLP_IOC_MAGIC) return -ENOTTY;
-	if (_IOC_NR(cmd) > SCULLP_IOC_MAXNR) return -ENOTTY;
-
-	/*
-	 * the type is a bitmask, and VERIFY_WRITE catches R/W
-	 * transfers. Note that the type is user-oriented, while
-	 * verify_area is kernel-oriented, so the concept of "read" and
-	 * "write" is reversed
-	 */
-	if (_IOC_DIR(cmd) & _IOC_READ)
-		err = !access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd));
-	else if (_IOC_DIR(cmd) & _IOC_WRITE)
-		err =  !access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd));
-	if (err)
-		return -EFAULT;
-
-	switch(cmd) {
-
-	case SCULLP_IOCRESET:
-		scullp_qset = SCULLP_QSET;
-		scullp_order = SCULLP_ORDER;
-		break;
-
-	case SCULLP_IOCSORDER: /* Set: arg points to the value */
-		ret = __get_user(scullp_order, (int __user *) arg);
-		break;
-
-	case SCULLP_IOCTORDER: /* Tell: arg is the value */
-		scullp_order = arg;
-		break;
-
-	case SCULLP_IOCGORDER: /* Get: arg is pointer to result */
-		ret = __put_user (scullp_order, (int __user *) arg);
-		break;
-
-	case SCULLP_IOCQORDER: /* Query: return it (it's positive) */
-		return scullp_order;
-
-	case SCULLP_IOCXORDER: /* eXchange: use arg as pointer */
-		tmp = scullp_order;
-		ret = __get_user(scullp_order, (int __user *) arg);
-		if (ret == 0)
-			ret = __put_user(tmp, (int __user *) arg);
-		break;
-
-	case SCULLP_IOCHORDER: /* sHift: like Tell + Query */
-		tmp = scullp_order;
-		scullp_order = arg;
-		return tmp;
-
-	case SCULLP_IOCSQSET:
-		ret = __get_user(scullp_qset, (int __user *) arg);
-		break;
-
-	case SCULLP_IOCTQSET:
-		scullp_qset = arg;
-		break;
-
-	case SCULLP_IOCGQSET:
-		ret = __put_user(scullp_qset, (int __user *)arg);
-		break;
-
-	case SCULLP_IOCQQSET:
-		return scullp_qset;
-
-	case SCULLP_IOCXQSET:
-		tmp = scullp_qset;
-		ret = __get_user(scullp_qset, (int __user *)arg);
-		if (ret == 0)
-			ret = __put_user(tmp, (int __user *)arg);
-		break;
-
-	case SCULLP_IOCHQSET:
-		tmp = scullp_qset;
-		scullp_qset = arg;
-		return tmp;
-
-	default:  /* redundant, as cmd was checked against MAXNR */
-		return -ENOTTY;
-	}
-
-	return ret;
+	return scullq_ioctl(cmd, arg, &scullp_order, &scullp_qset,
+			SCULLP_ORDER, SCULLP_QSET);
 }
 
-/*
- * The "extended" operations
- */
-
 loff_t scullp_llseek (struct file *filp, loff_t off, int whence)
 {
 	struct scullp_dev *dev = filp->private_data;
-	long newpos;
-
-	switch(whence) {
-	case 0: /* SEEK_SET */
-		newpos = off;
-		break;
-
-	case 1: /* SEEK_CUR */
-		newpos = filp->f_pos + off;
-		break;
-
-	case 2: /* SEEK_END */
-		newpos = dev->size + off;
-		break;
-
-	default: /* can't happen */
-		return -EINVAL;
-	}
-	if (newpos<0) return -EINVAL;
-	filp->f_pos = newpos;
-	return newpos;
-}
-
-
-/*
- * A simple asynchronous I/O implementation.
- */
-
-struct async_work {
-	struct kiocb *iocb;
-	int result;
-	struct work_struct work;
-};
-
-/*
- * "Complete" an asynchronous operation.
- */
-static void scullp_do_deferred_op(void *p)
-{
-	struct async_work *stuff = (struct async_work *) p;
-	aio_complete(stuff->iocb, stuff->result, 0);
-	kfree(stuff);
-}
-
 
-static int scullp_defer_op(int write, struct kiocb *iocb, char __user *buf,
-		size_t count, loff_t pos)
-{
-	struct async_work *stuff;
-	int result;
-
-	/* Copy now while we can access the buffer */
-	if (write)
-		result = scullp_write(iocb->ki_filp, buf, count, &pos);
-	else
-		result = scullp_read(iocb->ki_filp, buf, count, &pos);
-
-	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb))
-		return result;
-
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
-	if (stuff == NULL)
-		return result; /* No memory, just complete now */
-	stuff->iocb = iocb;
-	stuff->result = result;
-	INIT_WORK(&stuff->work, scullp_do_deferred_op, stuff);
-	schedule_delayed_work(&stuff->work, HZ/100);
-	return -EIOCBQUEUED;
+	return scullq_llseek(&dev->store, filp, off, whence);
 }
 
-
 static ssize_t scullp_aio_read(struct kiocb *iocb, char __user *buf, size_t count,
 		loff_t pos)
 {
-	return scullp_defer_op(0, iocb, buf, count, pos);
+	struct scullp_dev *dev = iocb->ki_filp->private_data;
+
+	return scullq_aio(&dev->store, 0, iocb, buf, count, pos);
 }
 
 static ssize_t scullp_aio_write(struct kiocb *iocb, const char __user *buf,
 		size_t count, loff_t pos)
 {
-	return scullp_defer_op(1, iocb, (char __user *) buf, count, pos);
+	struct scullp_dev *dev = iocb->ki_filp->private_data;
+
+	return scullq_aio(&dev->store, 1, iocb, (char __user *) buf, count, pos);
 }
 
 
  
 /*
- * Mmap *is* available, but confined in a different file
+ * Mmap is also in the store, which gets the pages from the allocator.
  */
-extern int scullp_mmap(struct file *filp, struct vm_area_struct *vma);
+
+int scullp_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scullp_dev *dev = filp->private_data;
+
+	/* refuse to map if order is not 0 (see scullp_page) */
+	if (dev->store.order)
+		return -ENODEV;
+
+	return scullq_mmap(&dev->store, vma);
+}
 
 
 /*
@@ -481,32 +273,7 @@ struct file_operations scullp_fops = {
 
 int scullp_trim(struct scullp_dev *dev)
 {
-	struct scullp_dev *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
-
-	if (dev->vmas) /* don't trim: there are active mappings */
-		return -EBUSY;
-
-	for (dptr = dev; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			/* This code frees a whole quantum-set */
-			for (i = 0; i < qset; i++)
-				if (dptr->data[i])
-					free_pages((unsigned long)(dptr->data[i]),
-							dptr->order);
-
-			kfree(dptr->data);
-			dptr->data=NULL;
-		}
-		next=dptr->next;
-		if (dptr != dev) kfree(dptr); /* all of them but the first */
-	}
-	dev->size = 0;
-	dev->qset = scullp_qset;
-	dev->order = scullp_order;
-	dev->next = NULL;
-	return 0;
+	return scullq_trim(&dev->store, PAGE_SIZE << scullp_order, scullp_qset);
 }
 
 
@@ -558,9 +325,8 @@ int scullp_init(void)
 	}
 	memset(scullp_devices, 0, scullp_devs*sizeof (struct scullp_dev));
 	for (i = 0; i < scullp_devs; i++) {
-		scullp_devices[i].order = scullp_order;
-		scullp_devices[i].qset = scullp_qset;
-		sema_init (&scullp_devices[i].sem, 1);
+		scullq_init(&scullp_devices[i].store, &scullp_qops,
+				PAGE_SIZE << scullp_order, scullp_qset);
 		scullp_setup_cdev(scullp_devices + i, i);
 	}
 
@@ -587,6 +353,7 @@ void scullp_cleanup(void)
 
 	for (i = 0; i < scullp_devs; i++) {
 		cdev_del(&scullp_devices[i].cdev);
+		scullq_release(&scullp_devices[i].store);
 		scullp_trim(scullp_devices + i);
 	}
 	kfree(scullp_devices);
@@ -15,6 +15,7 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
+#include "../include/scullq.h"
 
 /*
  * Macros to help debugging
@@ -41,11 +42,9 @@
 #define SCULLP_DEVS 4    /* scullp0 through scullp3 */
 
 /*
- * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
- *
- * "scullp_dev->data" points to an array of pointers, each
- * pointer refers to a memory page.
+ * The bare device is a variable-length region of memory, kept in a
+ * scullq quantum store (see include/scullq.h). Each quantum is a
+ * block of 2^order pages.
  *
  * The array (quantum-set) is SCULLP_QSET long.
  */
@@ -53,13 +52,7 @@
 #define SCULLP_QSET     500
 
 struct scullp_dev {
-	void **data;
-	struct scullp_dev *next;  /* next listitem */
-	int vmas;                 /* active mappings */
-	int order;                /* the current allocation order */
-	int qset;                 /* the current array size */
-	size_t size;              /* 32-bit will suffice */
-	struct semaphore sem;     /* Mutual exclusion */
+	struct scullq store;      /* The data, and its semaphore */
 	struct cdev cdev;
 };
 
@@ -79,7 +72,6 @@ extern int scullp_qset;
  * Prototypes for shared functions
  */
 int scullp_trim(struct scullp_dev *dev);
-struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n);
 
 
 #ifdef SCULLP_DEBUG
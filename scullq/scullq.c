@@ -0,0 +1,631 @@
+/*
+ * scullq.c -- the quantum store shared by the scull family
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ * The data management that scull, scullc, scullp, scullv and sculld
+ * used to carry five copies of: list walking, read, write, trim,
+ * seek, the quantum/qset ioctls, asynchronous I/O and mmap. Nothing
+ * here knows how a quantum is allocated; that's the driver's
+ * scullq_ops.
+ */
+
+#include <linux/config.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/aio.h>
+#include <linux/sched.h>	/* current */
+#include <linux/mm.h>		/* get_user_pages() */
+#include <linux/pagemap.h>	/* page_cache_release() */
+#include <linux/highmem.h>	/* kmap() */
+#include <linux/workqueue.h>
+#include <asm/uaccess.h>
+
+#include "../include/scullq.h"
+
+MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
+MODULE_LICENSE("Dual BSD/GPL");
+
+static struct workqueue_struct *scullq_aio_wq;
+
+static void scullq_aio_work(void *data);
+
+
+void scullq_init(struct scullq *sq, struct scullq_ops *ops,
+		int quantum, int qset)
+{
+	memset(sq, 0, sizeof(*sq));
+	sq->ops = ops;
+	sq->quantum = quantum;
+	sq->order = get_order(quantum);
+	sq->qset = qset;
+	sema_init(&sq->sem, 1);
+	spin_lock_init(&sq->aio_lock);
+	INIT_LIST_HEAD(&sq->aio_queue);
+	INIT_WORK(&sq->aio_work, scullq_aio_work, sq);
+}
+EXPORT_SYMBOL(scullq_init);
+
+/*
+ * Empty out the store and switch it to a new geometry; must be called
+ * with the semaphore held.
+ */
+int scullq_trim(struct scullq *sq, int quantum, int qset)
+{
+	struct scullq_set *next, *dptr;
+	int i;
+	LIST_HEAD(dead);
+
+	if (sq->vmas) /* don't trim: there are active mappings */
+		return -EBUSY;
+
+	for (dptr = sq->data; dptr; dptr = next) { /* all the list items */
+		if (dptr->data) {
+			for (i = 0; i < sq->qset; i++)
+				if (dptr->data[i])
+					sq->ops->free(sq, dptr, i, &dead);
+			kfree(dptr->data);
+			kfree(dptr->priv);
+		}
+		next = dptr->next;
+		kfree(dptr);
+	}
+	if (sq->ops->release)
+		sq->ops->release(sq, &dead);
+	sq->data = NULL;
+	sq->size = 0;
+	sq->quanta = 0;
+	sq->quantum = quantum;
+	sq->order = get_order(quantum);
+	sq->qset = qset;
+	return 0;
+}
+EXPORT_SYMBOL(scullq_trim);
+
+/*
+ * Follow the list, creating items as needed.
+ */
+struct scullq_set *scullq_follow(struct scullq *sq, int n)
+{
+	struct scullq_set **qs = &sq->data;
+
+	for (;;) {
+		if (!*qs) {
+			*qs = kmalloc(sizeof(struct scullq_set), GFP_KERNEL);
+			if (*qs == NULL)
+				return NULL;  /* Never mind */
+			memset(*qs, 0, sizeof(struct scullq_set));
+		}
+		if (!n--)
+			return *qs;
+		qs = &(*qs)->next;
+	}
+}
+EXPORT_SYMBOL(scullq_follow);
+
+/*
+ * Find the byte at "pos", allocating its quantum if "alloc" is set.
+ * Returns NULL for a hole (or on allocation failure) and stores in
+ * "left" how many bytes remain in the quantum. Called with the
+ * semaphore held.
+ */
+static char *scullq_locate(struct scullq *sq, loff_t pos, int alloc,
+		size_t *left)
+{
+	struct scullq_set *dptr;
+	int quantum = sq->quantum, qset = sq->qset;
+	long itemsize = (long) quantum * qset; /* how many bytes in the listitem */
+	long item, rest;
+	int s_pos, q_pos;
+
+	/* find listitem, qset index, and offset in the quantum */
+	item = (long) pos / itemsize;
+	rest = (long) pos % itemsize;
+	s_pos = rest / quantum; q_pos = rest % quantum;
+	*left = quantum - q_pos;
+
+	dptr = scullq_follow(sq, item);
+	if (dptr == NULL)
+		return NULL;
+	if (!dptr->data) {
+		if (!alloc)
+			return NULL;
+		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
+		if (!dptr->data)
+			return NULL;
+		memset(dptr->data, 0, qset * sizeof(void *));
+	}
+	if (!dptr->data[s_pos]) {
+		if (!alloc || sq->ops->alloc(sq, dptr, s_pos))
+			return NULL;
+		memset(dptr->data[s_pos], 0, quantum);
+		sq->quanta++;
+	}
+	return (char *) dptr->data[s_pos] + q_pos;
+}
+
+/*
+ * Data management: read and write. As in the original scull, each
+ * call moves at most up to the end of the current quantum.
+ */
+
+ssize_t scullq_read(struct scullq *sq, char __user *buf, size_t count,
+		loff_t *f_pos)
+{
+	ssize_t retval = 0;
+	size_t left;
+	char *qptr;
+
+	if (down_interruptible(&sq->sem))
+		return -ERESTARTSYS;
+	if (*f_pos >= sq->size)
+		goto out;
+	if (*f_pos + count > sq->size)
+		count = sq->size - *f_pos;
+
+	qptr = scullq_locate(sq, *f_pos, 0, &left);
+	if (!qptr)
+		goto out; /* don't fill holes */
+	if (count > left)
+		count = left; /* read only up to the end of this quantum */
+
+	if (copy_to_user(buf, qptr, count)) {
+		retval = -EFAULT;
+		goto out;
+	}
+	*f_pos += count;
+	retval = count;
+	sq->reads++;
+	sq->read_bytes += count;
+
+  out:
+	up(&sq->sem);
+	return retval;
+}
+EXPORT_SYMBOL(scullq_read);
+
+ssize_t scullq_write(struct scullq *sq, const char __user *buf, size_t count,
+		loff_t *f_pos)
+{
+	ssize_t retval = -ENOMEM; /* our most likely error */
+	size_t left;
+	char *qptr;
+
+	if (down_interruptible(&sq->sem))
+		return -ERESTARTSYS;
+
+	qptr = scullq_locate(sq, *f_pos, 1, &left);
+	if (!qptr)
+		goto out;
+	if (count > left)
+		count = left; /* write only up to the end of this quantum */
+
+	if (copy_from_user(qptr, buf, count)) {
+		retval = -EFAULT;
+		goto out;
+	}
+	*f_pos += count;
+	retval = count;
+	sq->writes++;
+	sq->write_bytes += count;
+
+	/* update the size */
+	if (sq->size < *f_pos)
+		sq->size = *f_pos;
+
+  out:
+	up(&sq->sem);
+	return retval;
+}
+EXPORT_SYMBOL(scullq_write);
+
+loff_t scullq_llseek(struct scullq *sq, struct file *filp, loff_t off,
+		int whence)
+{
+	loff_t newpos;
+
+	switch(whence) {
+	case 0: /* SEEK_SET */
+		newpos = off;
+		break;
+
+	case 1: /* SEEK_CUR */
+		newpos = filp->f_pos + off;
+		break;
+
+	case 2: /* SEEK_END */
+		newpos = sq->size + off;
+		break;
+
+	default: /* can't happen */
+		return -EINVAL;
+	}
+	if (newpos < 0) return -EINVAL;
+	filp->f_pos = newpos;
+	return newpos;
+}
+EXPORT_SYMBOL(scullq_llseek);
+
+
+/*
+ * The quantum/qset ioctls. They act on the driver's load-time
+ * parameters, which are picked up by the next trim.
+ */
+int scullq_ioctl(unsigned int cmd, unsigned long arg, int *quantum,
+		int *qset, int def_quantum, int def_qset)
+{
+	int err = 0, ret = 0, tmp;
+
+	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
+	if (_IOC_TYPE(cmd) != SCULLQ_IOC_MAGIC) return -ENOTTY;
+	if (_IOC_NR(cmd) > SCULLQ_IOC_MAXNR) return -ENOTTY;
+
+	/*
+	 * the type is a bitmask, and VERIFY_WRITE catches R/W
+	 * transfers. Note that the type is user-oriented, while
+	 * verify_area is kernel-oriented, so the concept of "read" and
+	 * "write" is reversed
+	 */
+	if (_IOC_DIR(cmd) & _IOC_READ)
+		err = !access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd));
+	else if (_IOC_DIR(cmd) & _IOC_WRITE)
+		err =  !access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd));
+	if (err)
+		return -EFAULT;
+
+	switch(cmd) {
+
+	case SCULLQ_IOCRESET:
+		*quantum = def_quantum;
+		*qset = def_qset;
+		break;
+
+	case SCULLQ_IOCSQUANTUM: /* Set: arg points to the value */
+		ret = __get_user(*quantum, (int __user *) arg);
+		break;
+
+	case SCULLQ_IOCTQUANTUM: /* Tell: arg is the value */
+		*quantum = arg;
+		break;
+
+	case SCULLQ_IOCGQUANTUM: /* Get: arg is pointer to result */
+		ret = __put_user (*quantum, (int __user *) arg);
+		break;
+
+	case SCULLQ_IOCQQUANTUM: /* Query: return it (it's positive) */
+		return *quantum;
+
+	case SCULLQ_IOCXQUANTUM: /* eXchange: use arg as pointer */
+		tmp = *quantum;
+		ret = __get_user(*quantum, (int __user *) arg);
+		if (ret == 0)
+			ret = __put_user(tmp, (int __user *) arg);
+		break;
+
+	case SCULLQ_IOCHQUANTUM: /* sHift: like Tell + Query */
+		tmp = *quantum;
+		*quantum = arg;
+		return tmp;
+
+	case SCULLQ_IOCSQSET:
+		ret = __get_user(*qset, (int __user *) arg);
+		break;
+
+	case SCULLQ_IOCTQSET:
+		*qset = arg;
+		break;
+
+	case SCULLQ_IOCGQSET:
+		ret = __put_user(*qset, (int __user *)arg);
+		break;
+
+	case SCULLQ_IOCQQSET:
+		return *qset;
+
+	case SCULLQ_IOCXQSET:
+		tmp = *qset;
+		ret = __get_user(*qset, (int __user *)arg);
+		if (ret == 0)
+			ret = __put_user(tmp, (int __user *)arg);
+		break;
+
+	case SCULLQ_IOCHQSET:
+		tmp = *qset;
+		*qset = arg;
+		return tmp;
+
+	default:  /* redundant, as cmd was checked against MAXNR */
+		return -ENOTTY;
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL(scullq_ioctl);
+
+
+/*
+ * Asynchronous I/O.  The user buffer is pinned when the request is
+ * submitted, so the copy itself can be done later by a worker thread
+ * that has no access to the submitter's address space.  Each store
+ * has its own queue; the worker takes everything queued so far, moves
+ * the whole batch under a single hold of the semaphore and then
+ * completes it.  Requests to different devices run concurrently on the
+ * per-CPU threads of the workqueue, and finish in whatever order their
+ * device gets to them.
+ */
+
+#define SCULLQ_AIO_MAXPAGES 64	/* longest async transfer, in pages */
+
+struct scullq_aio {
+	struct list_head list;
+	struct kiocb *iocb;
+	int write;
+	loff_t pos;
+	size_t count;
+	unsigned long offset;	/* of the data in the first page */
+	int npages;
+	ssize_t result;
+	struct page *pages[SCULLQ_AIO_MAXPAGES];
+};
+
+/*
+ * Move one request between the store and its pinned pages.
+ */
+static ssize_t scullq_aio_xfer(struct scullq *sq, struct scullq_aio *req)
+{
+	unsigned long offset = req->offset;
+	size_t count = req->count, done = 0, left, chunk;
+	loff_t pos = req->pos;
+	char *qptr, *kaddr;
+	int i = 0;
+
+	if (!req->write) {
+		if (pos >= sq->size)
+			return 0;
+		if (pos + count > sq->size)
+			count = sq->size - pos;
+	}
+	while (done < count) {
+		qptr = scullq_locate(sq, pos, req->write, &left);
+		if (!qptr)
+			break; /* a hole when reading, no memory when writing */
+		chunk = min_t(size_t, left, PAGE_SIZE - offset);
+		chunk = min_t(size_t, chunk, count - done);
+		kaddr = kmap(req->pages[i]);
+		if (req->write)
+			memcpy(qptr, kaddr + offset, chunk);
+		else
+			memcpy(kaddr + offset, qptr, chunk);
+		kunmap(req->pages[i]);
+		done += chunk;
+		pos += chunk;
+		offset += chunk;
+		if (offset == PAGE_SIZE) {
+			offset = 0;
+			i++;
+		}
+	}
+	if (req->write) {
+		if (!done)
+			return -ENOMEM;
+		if (sq->size < pos)
+			sq->size = pos;
+		sq->writes++;
+		sq->write_bytes += done;
+	} else {
+		sq->reads++;
+		sq->read_bytes += done;
+	}
+	return done;
+}
+
+static void scullq_aio_put_pages(struct scullq_aio *req)
+{
+	int i;
+
+	for (i = 0; i < req->npages; i++) {
+		if (!req->write)
+			set_page_dirty_lock(req->pages[i]);
+		page_cache_release(req->pages[i]);
+	}
+}
+
+/*
+ * The worker: one batch per run, completions after the semaphore is
+ * released.
+ */
+static void scullq_aio_work(void *data)
+{
+	struct scullq *sq = data;
+	struct scullq_aio *req, *next;
+	LIST_HEAD(batch);
+
+	spin_lock(&sq->aio_lock);
+	list_splice_init(&sq->aio_queue, &batch);
+	spin_unlock(&sq->aio_lock);
+	if (list_empty(&batch))
+		return;
+
+	down(&sq->sem);
+	list_for_each_entry(req, &batch, list)
+		req->result = scullq_aio_xfer(sq, req);
+	up(&sq->sem);
+
+	list_for_each_entry_safe(req, next, &batch, list) {
+		scullq_aio_put_pages(req);
+		aio_complete(req->iocb, req->result, 0);
+		kfree(req);
+	}
+}
+
+ssize_t scullq_aio(struct scullq *sq, int write, struct kiocb *iocb,
+		char __user *buf, size_t count, loff_t pos)
+{
+	unsigned long addr = (unsigned long) buf;
+	struct scullq_aio *req;
+	int npages;
+
+	/* If this is a synchronous IOCB, just do the copy now. */
+	if (is_sync_kiocb(iocb)) {
+		if (write)
+			return scullq_write(sq, buf, count, &pos);
+		return scullq_read(sq, buf, count, &pos);
+	}
+	if (!count)
+		return 0;
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+	req->offset = addr & ~PAGE_MASK;
+	npages = (req->offset + count + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	if (npages > SCULLQ_AIO_MAXPAGES) { /* a short transfer, then */
+		npages = SCULLQ_AIO_MAXPAGES;
+		count = (npages << PAGE_SHIFT) - req->offset;
+	}
+
+	/* Pin the buffer; a device read writes into user memory */
+	down_read(&current->mm->mmap_sem);
+	req->npages = get_user_pages(current, current->mm, addr & PAGE_MASK,
+			npages, !write, 0, req->pages, NULL);
+	up_read(&current->mm->mmap_sem);
+	if (req->npages < npages) {
+		scullq_aio_put_pages(req);
+		kfree(req);
+		return -EFAULT;
+	}
+	req->iocb = iocb;
+	req->write = write;
+	req->pos = pos;
+	req->count = count;
+
+	spin_lock(&sq->aio_lock);
+	list_add_tail(&req->list, &sq->aio_queue);
+	spin_unlock(&sq->aio_lock);
+	queue_work(scullq_aio_wq, &sq->aio_work);
+	return -EIOCBQUEUED;
+}
+EXPORT_SYMBOL(scullq_aio);
+
+/*
+ * Before the store goes away: its work may still be queued, even with
+ * every request completed, if it was queued again while a run that
+ * had already taken them was going on. The workqueue is shared, and
+ * 2.6.10 can't cancel a single work, so wait for all of it.
+ */
+void scullq_release(struct scullq *sq)
+{
+	flush_workqueue(scullq_aio_wq);
+}
+EXPORT_SYMBOL(scullq_release);
+
+
+/*
+ * Memory mapping. open and close just keep track of how many times
+ * the store is mapped, to avoid releasing it.
+ */
+
+static void scullq_vma_open(struct vm_area_struct *vma)
+{
+	struct scullq *sq = vma->vm_private_data;
+
+	sq->vmas++;
+}
+
+static void scullq_vma_close(struct vm_area_struct *vma)
+{
+	struct scullq *sq = vma->vm_private_data;
+
+	sq->vmas--;
+}
+
+/*
+ * The nopage method: find the quantum, then ask the allocator for
+ * the page within it. The count for the page must be incremented,
+ * because it is automatically decremented at page unmap. If the store
+ * has holes, the process receives a SIGBUS when accessing the hole.
+ */
+static struct page *scullq_vma_nopage(struct vm_area_struct *vma,
+                                unsigned long address, int *type)
+{
+	struct scullq *sq = vma->vm_private_data;
+	struct scullq_set *ptr;
+	struct page *page = NOPAGE_SIGBUS;
+	unsigned long offset, pgoff;
+
+	down(&sq->sem);
+	offset = (address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+	if (offset >= sq->size) goto out; /* out of range */
+
+	offset >>= PAGE_SHIFT; /* offset is a number of pages */
+	pgoff = offset & ((1 << sq->order) - 1);
+	offset >>= sq->order; /* and now a number of quanta */
+	for (ptr = sq->data; ptr && offset >= sq->qset;) {
+		ptr = ptr->next;
+		offset -= sq->qset;
+	}
+	if (!ptr || !ptr->data || !ptr->data[offset])
+		goto out; /* hole or end-of-file */
+	page = sq->ops->page(sq, ptr, offset, pgoff);
+
+	/* got it, now increment the count */
+	get_page(page);
+	sq->faults++;
+	if (type)
+		*type = VM_FAULT_MINOR;
+  out:
+	up(&sq->sem);
+	return page;
+}
+
+static struct vm_operations_struct scullq_vm_ops = {
+	.open =     scullq_vma_open,
+	.close =    scullq_vma_close,
+	.nopage =   scullq_vma_nopage,
+};
+
+int scullq_mmap(struct scullq *sq, struct vm_area_struct *vma)
+{
+	/* quanta must be made of whole pages, and we must find them */
+	if (!sq->ops->page || sq->quantum != (PAGE_SIZE << sq->order))
+		return -ENODEV;
+
+	/* don't do anything here: "nopage" will set up page table entries */
+	vma->vm_ops = &scullq_vm_ops;
+	vma->vm_flags |= VM_RESERVED;
+	vma->vm_private_data = sq;
+	scullq_vma_open(vma);
+	return 0;
+}
+EXPORT_SYMBOL(scullq_mmap);
+
+
+static int __init scullq_module_init(void)
+{
+	scullq_aio_wq = create_workqueue("scullq_aio");
+	if (!scullq_aio_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+static void scullq_module_exit(void)
+{
+	destroy_workqueue(scullq_aio_wq); /* runs whatever is still queued */
+}
+
+module_init(scullq_module_init);
+module_exit(scullq_module_exit);
@@ -28,7 +28,6 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/aio.h>
 #include <asm/uaccess.h>
-#include <linux/vmalloc.h>
 #include "scullv.h"		/* local definitions */
 
 
@@ -80,18 +79,23 @@ int scullv_read_procmem(char *buf, char **start, off_t offset,
 {
 	int i, j, order, qset, len = 0;
 	int limit = count - 80; /* Don't print more than this */
-	struct scullv_dev *d;
+	struct scullq *sq;
+	struct scullq_set *d;
 
 	*start = buf;
+	len += sprintf(buf+len,"%s backend: vmaps %i, vunmaps %i, pool hits %i\n",
+			scullv_backend == SCULLV_BACKEND_PAGES ? "pages" : "vmalloc",
+			atomic_read(&scullv_vmaps), atomic_read(&scullv_vunmaps),
+			atomic_read(&scullv_pool_hits));
 	for(i = 0; i < scullv_devs; i++) {
-		d = &scullv_devices[i];
-		if (down_interruptible (&d->sem))
+		sq = &scullv_devices[i].store;
+		if (down_interruptible (&sq->sem))
 			return -ERESTARTSYS;
-		qset = d->qset;  /* retrieve the features of each device */
-		order = d->order;
+		qset = sq->qset;  /* retrieve the features of each device */
+		order = sq->order;
 		len += sprintf(buf+len,"\nDevice %i: qset %i, order %i, sz %li\n",
-				i, qset, order, (long)(d->size));
-		for (; d; d = d->next) { /* scan the list */
+				i, qset, order, (long)(sq->size));
+		for (d = sq->data; d; d = d->next) { /* scan the list */
 			len += sprintf(buf+len,"  item at %p, qset at %p\n",d,d->data);
 			scullv_proc_offset (buf, start, &offset, &len);
 			if (len > limit)
@@ -106,7 +110,7 @@ int scullv_read_procmem(char *buf, char **start, off_t offset,
 				}
 		}
 	  out:
-		up (&scullv_devices[i].sem);
+		up (&sq->sem);
 		if (len > limit)
 			break;
 	}
@@ -129,10 +133,10 @@ int scullv_open (struct inode *inode, struct file *filp)
 
     	/* now trim to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible (&dev->sem))
+		if (down_interruptible (&dev->store.sem))
 			return -ERESTARTSYS;
 		scullv_trim(dev); /* ignore errors */
-		up (&dev->sem);
+		up (&dev->store.sem);
 	}
 
 	/* and use filp->private_data to point to the device data */
@@ -147,319 +151,68 @@ int scullv_release (struct inode *inode, struct file *filp)
 }
 
 /*
- * Follow the list 
- */
-struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n)
-{
-	while (n--) {
-		if (!dev->next) {
-			dev->next = kmalloc(sizeof(struct scullv_dev), GFP_KERNEL);
-			memset(dev->next, 0, sizeof(struct scullv_dev));
-		}
-		dev = dev->next;
-		continue;
-	}
-	return dev;
-}
-
-/*
- * Data management: read and write
+ * Data management is all in the quantum store: the methods below
+ * just hand it the right device.
  */
 
 ssize_t scullv_read (struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-	struct scullv_dev *dev = filp->private_data; /* the first listitem */
-	struct scullv_dev *dptr;
-	int quantum = PAGE_SIZE << dev->order;
-	int qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
-
-	if (down_interruptible (&dev->sem))
-		return -ERESTARTSYS;
-	if (*f_pos > dev->size) 
-		goto nothing;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
-	/* find listitem, qset index, and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-    	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scullv_follow(dev, item);
-
-	if (!dptr->data)
-		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
-		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
-
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
-		retval = -EFAULT;
-		goto nothing;
-	}
-	up (&dev->sem);
-
-	*f_pos += count;
-	return count;
+	struct scullv_dev *dev = filp->private_data;
 
-  nothing:
-	up (&dev->sem);
-	return retval;
+	return scullq_read(&dev->store, buf, count, f_pos);
 }
 
-
-
 ssize_t scullv_write (struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scullv_dev *dev = filp->private_data;
-	struct scullv_dev *dptr;
-	int quantum = PAGE_SIZE << dev->order;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* our most likely error */
-
-	if (down_interruptible (&dev->sem))
-		return -ERESTARTSYS;
-
-	/* find listitem, qset index and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position */
-	dptr = scullv_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Allocate a quantum using virtual addresses */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = (void *)vmalloc(PAGE_SIZE << dptr->order);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
-	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto nomem;
-	}
-	*f_pos += count;
- 
-    	/* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
-	up (&dev->sem);
-	return count;
-
-  nomem:
-	up (&dev->sem);
-	return retval;
-}
 
-/*
- * The ioctl() implementation
- */
+	return scullq_write(&dev->store, buf, count, f_pos);
+}
 
 int scullv_ioctl (struct inode *inode, struct file *filp,
                  unsigned int cmd, unsigned long arg)
 {
-
-	int err = 0, ret = 0, tmp;
-
-	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
-	if (_IOC_TYPE(cmd) != SCULLV_IOC_MAGIC) return -ENOTTY;
-	if (_IOC_NR(cmd) > SCULLV_IOC_MAXNR) return -ENOTTY;
-
-	/*
-	 * the type is a bitmask, and VERIFY_WRITE catches R/W
-	 * transfers. Note that the type is user-oriented, while
-	 * verify_area is kernel-oriented, so the concept of "read" and
-	 * "write" is reversed
-	 */
-	if (_IOC_DIR(cmd) & _IOC_READ)
-		err = !access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd));
-	else if (_IOC_DIR(cmd) & _IOC_WRITE)
-		err =  !access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd));
-	if (err)
-		return -EFAULT;
-
-	switch(cmd) {
-
-	case SCULLV_IOCRESET:
-		scullv_qset = SCULLV_QSET;
-		scullv_order = SCULLV_ORDER;
-		break;
-
-	case SCULLV_IOCSORDER: /* Set: arg points to the value */
-		ret = __get_user(scullv_order, (int __user *) arg);
-		break;
-
-	case SCULLV_IOCTORDER: /* Tell: arg is the value */
-		scullv_order = arg;
-		break;
-
-	case SCULLV_IOCGORDER: /* Get: arg is pointer to result */
-		ret = __put_user (scullv_order, (int __user *) arg);
-		break;
-
-	case SCULLV_IOCQORDER: /* Query: return it (it's positive) */
-		return scullv_order;
-
-	case SCULLV_IOCXORDER: /* eXchange: use arg as pointer */
-		tmp = scullv_order;
-		ret = __get_user(scullv_order, (int __user *) arg);
-		if (ret == 0)
-			ret = __put_user(tmp, (int __user *) arg);
-		break;
-
-	case SCULLV_IOCHORDER: /* sHift: like Tell + Query */
-		tmp = scullv_order;
-		scullv_order = arg;
-		return tmp;
-
-	case SCULLV_IOCSQSET:
-		ret = __get_user(scullv_qset, (int __user *) arg);
-		break;
-
-	case SCULLV_IOCTQSET:
-		scullv_qset = arg;
-		break;
-
-	case SCULLV_IOCGQSET:
-		ret = __put_user(scullv_qset, (int __user *)arg);
-		break;
-
-	case SCULLV_IOCQQSET:
-		return scullv_qset;
-
-	case SCULLV_IOCXQSET:
-		tmp = scullv_qset;
-		ret = __get_user(scullv_qset, (int __user *)arg);
-		if (ret == 0)
-			ret = __put_user(tmp, (int __user *)arg);
-		break;
-
-	case SCULLV_IOCHQSET:
-		tmp = scullv_qset;
-		scullv_qset = arg;
-		return tmp;
-
-	default:  /* redundant, as cmd was checked against MAXNR */
-		return -ENOTTY;
-	}
-
-	return ret;
+	return scullq_ioctl(cmd, arg, &scullv_order, &scullv_qset,
+			SCULLV_ORDER, SCULLV_QSET);
 }
 
-/*
- * The "extended" operations
- */
-
 loff_t scullv_llseek (struct file *filp, loff_t off, int whence)
 {
 	struct scullv_dev *dev = filp->private_data;
-	long newpos;
-
-	switch(whence) {
-	case 0: /* SEEK_SET */
-		newpos = off;
-		break;
-
-	case 1: /* SEEK_CUR */
-		newpos = filp->f_pos + off;
-		break;
-
-	case 2: /* SEEK_END */
-		newpos = dev->size + off;
-		break;
-
-	default: /* can't happen */
-		return -EINVAL;
-	}
-	if (newpos<0) return -EINVAL;
-	filp->f_pos = newpos;
-	return newpos;
-}
-
 
-/*
- * A simple asynchronous I/O implementation.
- */
-
-struct async_work {
-	struct kiocb *iocb;
-	int result;
-	struct work_struct work;
-};
-
-/*
- * "Complete" an asynchronous operation.
- */
-static void scullv_do_deferred_op(void *p)
-{
-	struct async_work *stuff = (struct async_work *) p;
-	aio_complete(stuff->iocb, stuff->result, 0);
-	kfree(stuff);
+	return scullq_llseek(&dev->store, filp, off, whence);
 }
 
-
-static int scullv_defer_op(int write, struct kiocb *iocb, char __user *buf,
-		size_t count, loff_t pos)
-{
-	struct async_work *stuff;
-	int result;
-
-	/* Copy now while we can access the buffer */
-	if (write)
-		result = scullv_write(iocb->ki_filp, buf, count, &pos);
-	else
-		result = scullv_read(iocb->ki_filp, buf, count, &pos);
-
-	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb))
-		return result;
-
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
-	if (stuff == NULL)
-		return result; /* No memory, just complete now */
-	stuff->iocb = iocb;
-	stuff->result = result;
-	INIT_WORK(&stuff->work, scullv_do_deferred_op, stuff);
-	schedule_delayed_work(&stuff->work, HZ/100);
-	return -EIOCBQUEUED;
-}
-
-
 static ssize_t scullv_aio_read(struct kiocb *iocb, char __user *buf, size_t count,
 		loff_t pos)
 {
-	return scullv_defer_op(0, iocb, buf, count, pos);
+	struct scullv_dev *dev = iocb->ki_filp->private_data;
+
+	return scullq_aio(&dev->store, 0, iocb, buf, count, pos);
 }
 
 static ssize_t scullv_aio_write(struct kiocb *iocb, const char __user *buf,
 		size_t count, loff_t pos)
 {
-	return scullv_defer_op(1, iocb, (char __user *) buf, count, pos);
+	struct scullv_dev *dev = iocb->ki_filp->private_data;
+
+	return scullq_aio(&dev->store, 1, iocb, (char __user *) buf, count, pos);
 }
 
 
  
 /*
- * Mmap *is* available, but confined in a different file
+ * Mmap is also in the store, which gets the pages from the allocator.
  */
-extern int scullv_mmap(struct file *filp, struct vm_area_struct *vma);
+
+int scullv_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scullv_dev *dev = filp->private_data;
+
+	return scullq_mmap(&dev->store, vma);
+}
 
 
 /*
@@ -481,31 +234,7 @@ struct file_operations scullv_fops = {
 
 int scullv_trim(struct scullv_dev *dev)
 {
-	struct scullv_dev *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
-
-	if (dev->vmas) /* don't trim: there are active mappings */
-		return -EBUSY;
-
-	for (dptr = dev; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			/* Release the quantum-set */
-			for (i = 0; i < qset; i++)
-				if (dptr->data[i])
-					vfree(dptr->data[i]);
-
-			kfree(dptr->data);
-			dptr->data=NULL;
-		}
-		next=dptr->next;
-		if (dptr != dev) kfree(dptr); /* all of them but the first */
-	}
-	dev->size = 0;
-	dev->qset = scullv_qset;
-	dev->order = scullv_order;
-	dev->next = NULL;
-	return 0;
+	return scullq_trim(&dev->store, PAGE_SIZE << scullv_order, scullv_qset);
 }
 
 
@@ -556,10 +285,12 @@ int scullv_init(void)
 		goto fail_malloc;
 	}
 	memset(scullv_devices, 0, scullv_devs*sizeof (struct scullv_dev));
+	scullv_pool_init();
 	for (i = 0; i < scullv_devs; i++) {
-		scullv_devices[i].order = scullv_order;
-		scullv_devices[i].qset = scullv_qset;
-		sema_init (&scullv_devices[i].sem, 1);
+		scullq_init(&scullv_devices[i].store,
+				scullv_backend == SCULLV_BACKEND_PAGES ?
+				&scullv_pages_ops : &scullv_vmalloc_ops,
+				PAGE_SIZE << scullv_order, scullv_qset);
 		scullv_setup_cdev(scullv_devices + i, i);
 	}
 
@@ -586,9 +317,11 @@ void scullv_cleanup(void)
 
 	for (i = 0; i < scullv_devs; i++) {
 		cdev_del(&scullv_devices[i].cdev);
+		scullq_release(&scullv_devices[i].store);
 		scullv_trim(scullv_devices + i);
 	}
 	kfree(scullv_devices);
+	scullv_pool_drain();
 	unregister_chrdev_region(MKDEV (scullv_major, 0), scullv_devs);
 }
 
@@ -0,0 +1,277 @@
+/*  -*- C -*-
+ * pages.c -- quantum allocation for the scullv char module
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <linux/config.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/mm.h>		/* alloc_page() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/vmalloc.h>	/* vmalloc(), vmap() */
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <asm/atomic.h>
+
+#include "scullv.h"		/* local definitions */
+
+/*
+ * The classic backend gets each quantum from vmalloc() and gives it
+ * back with vfree(): every write after a trim pays for a new vmap
+ * area, and every trim for tearing it down and flushing the TLB.
+ *
+ * The "pages" backend allocates the pages of a quantum one by one,
+ * maps them once with vmap() and keeps the page array next to the
+ * mapping. Trimmed quanta go to a pool and are handed out again
+ * still mapped, so a trim/write cycle does no vmap work at all once
+ * the pool is warm; only what overflows the pool is unmapped, and
+ * that is done in one batch at the end of the trim. The page array
+ * also lets the fault handler find a page without vmalloc_to_page().
+ * The pool keeps one list per order, since devices may be trimmed at
+ * different orders; when it is full, chunks of other orders make room.
+ */
+
+int scullv_backend = SCULLV_BACKEND_VMALLOC;
+int scullv_pool_max = SCULLV_POOL;
+
+module_param(scullv_backend, int, 0);
+module_param(scullv_pool_max, int, 0);
+
+static struct list_head scullv_pool[SCULLV_POOL_ORDERS]; /* by order */
+static int scullv_pool_len;		/* on all of them */
+static spinlock_t scullv_pool_lock = SPIN_LOCK_UNLOCKED;
+
+/* How much mapping work we did, to compare the backends */
+atomic_t scullv_vmaps = ATOMIC_INIT(0);
+atomic_t scullv_vunmaps = ATOMIC_INIT(0);
+atomic_t scullv_pool_hits = ATOMIC_INIT(0);
+
+
+static struct scullv_chunk *scullv_chunk_alloc(int order)
+{
+	struct scullv_chunk *chunk;
+	int i, n = 1 << order;
+
+	chunk = kmalloc(sizeof(*chunk) + n * sizeof(struct page *), GFP_KERNEL);
+	if (!chunk)
+		return NULL;
+	chunk->order = order;
+	for (i = 0; i < n; i++) {
+		chunk->pages[i] = alloc_page(GFP_KERNEL | __GFP_HIGHMEM);
+		if (!chunk->pages[i])
+			goto fail;
+	}
+	chunk->addr = vmap(chunk->pages, n, VM_MAP, PAGE_KERNEL);
+	if (!chunk->addr)
+		goto fail;
+	atomic_inc(&scullv_vmaps);
+	return chunk;
+
+  fail:
+	while (i--)
+		__free_page(chunk->pages[i]);
+	kfree(chunk);
+	return NULL;
+}
+
+static void scullv_chunk_free(struct scullv_chunk *chunk)
+{
+	int i;
+
+	vunmap(chunk->addr);
+	atomic_inc(&scullv_vunmaps);
+	for (i = 0; i < (1 << chunk->order); i++)
+		__free_page(chunk->pages[i]);
+	kfree(chunk);
+}
+
+
+/*
+ * The classic backend.
+ */
+
+static int scullv_vmalloc_alloc(struct scullq *sq, struct scullq_set *set,
+		int s_pos)
+{
+	set->data[s_pos] = vmalloc(PAGE_SIZE << sq->order);
+	if (!set->data[s_pos])
+		return -ENOMEM;
+	atomic_inc(&scullv_vmaps);
+	return 0;
+}
+
+static void scullv_vmalloc_free(struct scullq *sq, struct scullq_set *set,
+		int s_pos, struct list_head *dead)
+{
+	vfree(set->data[s_pos]);
+	atomic_inc(&scullv_vunmaps);
+}
+
+/*
+ * "data" is a vmalloc address: turn it into a struct page.
+ */
+static struct page *scullv_vmalloc_page(struct scullq *sq,
+		struct scullq_set *set, int s_pos, unsigned long pgoff)
+{
+	return vmalloc_to_page(set->data[s_pos] + (pgoff << PAGE_SHIFT));
+}
+
+struct scullq_ops scullv_vmalloc_ops = {
+	.name =  "vmalloc",
+	.alloc = scullv_vmalloc_alloc,
+	.free =  scullv_vmalloc_free,
+	.page =  scullv_vmalloc_page,
+};
+
+
+/*
+ * The pages backend. The chunk behind each quantum is kept in the
+ * parallel "priv" array of the quantum set.
+ */
+
+static int scullv_pages_alloc(struct scullq *sq, struct scullq_set *set,
+		int s_pos)
+{
+	struct scullv_chunk *chunk = NULL;
+
+	if (!set->priv) {
+		set->priv = kmalloc(sq->qset * sizeof(void *), GFP_KERNEL);
+		if (!set->priv)
+			return -ENOMEM;
+		memset(set->priv, 0, sq->qset * sizeof(void *));
+	}
+
+	spin_lock(&scullv_pool_lock);
+	if (sq->order < SCULLV_POOL_ORDERS &&
+			!list_empty(&scullv_pool[sq->order])) {
+		chunk = list_entry(scullv_pool[sq->order].next,
+				struct scullv_chunk, list);
+		list_del(&chunk->list);
+		scullv_pool_len--;
+	}
+	spin_unlock(&scullv_pool_lock);
+
+	if (chunk)
+		atomic_inc(&scullv_pool_hits);
+	else
+		chunk = scullv_chunk_alloc(sq->order);
+	if (!chunk)
+		return -ENOMEM;
+	set->priv[s_pos] = chunk;
+	set->data[s_pos] = chunk->addr;
+	return 0;
+}
+
+/*
+ * The chunk is only moved to "dead"; scullv_pages_release() disposes
+ * of it at the end of the trim.
+ */
+static void scullv_pages_free(struct scullq *sq, struct scullq_set *set,
+		int s_pos, struct list_head *dead)
+{
+	struct scullv_chunk *chunk = set->priv[s_pos];
+
+	list_add_tail(&chunk->list, dead);
+	set->priv[s_pos] = NULL;
+}
+
+/*
+ * Make room in a full pool for a chunk of "order": move one chunk of
+ * another order to "stale". Called with the pool lock held.
+ */
+static int scullv_pool_evict(int order, struct list_head *stale)
+{
+	int i;
+
+	for (i = 0; i < SCULLV_POOL_ORDERS; i++) {
+		if (i == order || list_empty(&scullv_pool[i]))
+			continue;
+		list_move(scullv_pool[i].prev, stale);
+		scullv_pool_len--;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Refill the pool from "dead", taking the lock once, and unmap what
+ * doesn't fit, along with what was evicted for it.
+ */
+static void scullv_pages_release(struct scullq *sq, struct list_head *dead)
+{
+	struct scullv_chunk *chunk, *next;
+	LIST_HEAD(stale);
+
+	spin_lock(&scullv_pool_lock);
+	list_for_each_entry_safe(chunk, next, dead, list) {
+		if (chunk->order >= SCULLV_POOL_ORDERS)
+			continue;
+		if (scullv_pool_len >= scullv_pool_max &&
+				!scullv_pool_evict(chunk->order, &stale))
+			break;
+		list_move(&chunk->list, &scullv_pool[chunk->order]);
+		scullv_pool_len++;
+	}
+	spin_unlock(&scullv_pool_lock);
+
+	list_splice(&stale, dead);
+	list_for_each_entry_safe(chunk, next, dead, list) {
+		list_del(&chunk->list);
+		scullv_chunk_free(chunk);
+	}
+}
+
+/*
+ * We already know the struct page.
+ */
+static struct page *scullv_pages_page(struct scullq *sq,
+		struct scullq_set *set, int s_pos, unsigned long pgoff)
+{
+	struct scullv_chunk *chunk = set->priv[s_pos];
+
+	return chunk->pages[pgoff];
+}
+
+struct scullq_ops scullv_pages_ops = {
+	.name =    "pages",
+	.alloc =   scullv_pages_alloc,
+	.free =    scullv_pages_free,
+	.release = scullv_pages_release,
+	.page =    scullv_pages_page,
+};
+
+
+void scullv_pool_init(void)
+{
+	int i;
+
+	for (i = 0; i < SCULLV_POOL_ORDERS; i++)
+		INIT_LIST_HEAD(&scullv_pool[i]);
+}
+
+/*
+ * Unmap everything left in the pool, at module unload.
+ */
+void scullv_pool_drain(void)
+{
+	struct scullv_chunk *chunk, *next;
+	int i;
+
+	for (i = 0; i < SCULLV_POOL_ORDERS; i++)
+		list_for_each_entry_safe(chunk, next, &scullv_pool[i], list) {
+			list_del(&chunk->list);
+			scullv_chunk_free(chunk);
+		}
+	scullv_pool_len = 0;
+}
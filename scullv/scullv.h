@@ -15,6 +15,8 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
+#include <asm/atomic.h>
+#include "../include/scullq.h"
 
 /*
  * Macros to help debugging
@@ -41,25 +43,34 @@
 #define SCULLV_DEVS 4    /* scullv0 through scullv3 */
 
 /*
- * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
- *
- * "scullv_dev->data" points to an array of pointers, each
- * pointer refers to a memory page.
+ * The bare device is a variable-length region of memory, kept in a
+ * scullq quantum store (see include/scullq.h). Each quantum is
+ * 2^order pages, virtually contiguous.
  *
  * The array (quantum-set) is SCULLV_QSET long.
  */
 #define SCULLV_ORDER    4 /* 16 pages at a time */
 #define SCULLV_QSET     500
 
+/*
+ * Where quanta come from (see pages.c): plain vmalloc(), or pages
+ * mapped once with vmap() and recycled through a pool of SCULLV_POOL
+ * quanta across trims.
+ */
+#define SCULLV_BACKEND_VMALLOC 0
+#define SCULLV_BACKEND_PAGES   1
+#define SCULLV_POOL     64
+#define SCULLV_POOL_ORDERS 11 /* chunks of higher orders aren't pooled */
+
+struct scullv_chunk {
+	struct list_head list;    /* in the pool, or on a free batch */
+	void *addr;               /* where the pages are mapped */
+	int order;
+	struct page *pages[0];
+};
+
 struct scullv_dev {
-	void **data;
-	struct scullv_dev *next;  /* next listitem */
-	int vmas;                 /* active mappings */
-	int order;                /* the current allocation order */
-	int qset;                 /* the current array size */
-	size_t size;              /* 32-bit will suffice */
-	struct semaphore sem;     /* Mutual exclusion */
+	struct scullq store;      /* The data, and its semaphore */
 	struct cdev cdev;
 };
 
@@ -74,12 +85,17 @@ extern int scullv_major;     /* main.c */
 extern int scullv_devs;
 extern int scullv_order;
 extern int scullv_qset;
+extern int scullv_backend;   /* pages.c */
+extern int scullv_pool_max;
+extern atomic_t scullv_vmaps, scullv_vunmaps, scullv_pool_hits;
+extern struct scullq_ops scullv_vmalloc_ops, scullv_pages_ops;
 
 /*
  * Prototypes for shared functions
  */
 int scullv_trim(struct scullv_dev *dev);
-struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n);
+void scullv_pool_init(void);
+void scullv_pool_drain(void);
 
 
 #ifdef SCULLV_DEBUG